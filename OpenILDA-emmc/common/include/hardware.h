@@ -21,5 +21,6 @@ inline void hw_dac_write32(uint32_t word);
 
 void __disable_fiq(void);
 void __enable_fiq(void);
+void memory_barrier(void);
 
 #endif /* HARDWARE_H_ */
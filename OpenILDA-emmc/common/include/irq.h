@@ -1,18 +1,20 @@
 #ifndef IRQ_H_
 #define IRQ_H_
 
+#include <spsc_ring.h>
+
 #define RXBUFMASK 0xFF
 #define RXINDEXMASK 0xFF
 
-extern volatile unsigned int rxihead;
-extern volatile unsigned int rxitail;
 extern volatile unsigned char rxbuffer[RXINDEXMASK][RXBUFMASK];
 
 struct aux_buffer {
-	unsigned char rxbuffer[RXBUFMASK];
+	unsigned char rxbuffer[RXBUFMASK + 1];
 	unsigned char data_len;
 };
 
-extern volatile struct aux_buffer aux_buffers[RXINDEXMASK];
+/* Complete messages from the UART, queued by the IRQ handler */
+extern volatile struct aux_buffer aux_buffers[RXINDEXMASK + 1];
+extern spsc_ring_t aux_rx_ring;
 
 #endif /* IRQ_H_ */
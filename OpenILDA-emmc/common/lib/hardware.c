@@ -1,5 +1,6 @@
 #include <bcm2835.h>
 #include <spi_dac.h>
+#include <dac_driver.h>
 
 /* hw_dac_init()
  *
@@ -10,7 +11,7 @@ void inline hw_dac_init(void) {
 	bcm2835_spi_begin();
 	bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
 	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-	bcm2835_spi_setClockDivider(12);
+	bcm2835_spi_setClockDivider(DAC_SPI_MIN_DIVIDER);
 	bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
 	bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
 	// LDAC
@@ -21,10 +22,13 @@ void inline hw_dac_init(void) {
 	bcm2835_gpio_clr(HC139_A_GPIO_PIN);
 	bcm2835_gpio_fsel(HC139_B_GPIO_PIN, BCM2835_GPIO_FSEL_OUTP);
 	bcm2835_gpio_clr(HC139_B_GPIO_PIN);
+	// Backend
+	if (dac_driver.init)
+		dac_driver.init();
 }
 
 void inline hw_dac_zero_all_channels(void) {
-	dac_write_all(0x07FF, 0x07FF, 0x00, 0x00, 0x00, 0x00);
+	dac_driver.zero();
 }
 
 /* led_set_frontled()
@@ -4,9 +4,9 @@
 
 volatile unsigned int rxhead;
 volatile unsigned int rxtail;
-volatile unsigned int rxihead;
-volatile unsigned int rxitail;
-volatile struct aux_buffer aux_buffers[RXINDEXMASK];
+static unsigned int rxdropping;
+volatile struct aux_buffer aux_buffers[RXINDEXMASK + 1];
+spsc_ring_t aux_rx_ring;
 
 static void irq_init(void) {
 	BCM2835_UART1->IER = 0x05;
@@ -24,13 +24,25 @@ void __attribute__((interrupt("IRQ"))) c_irq_handler(void) {
 			break; //no more interrupts
 		if ((rb & 6) == 4) {
 			c = BCM2835_UART1->IO  & 0xFF;
+			/* The slot at produce is always free; it only
+			 * gets handed over once the message is complete. If
+			 * the ring is full at any point in a message, the
+			 * whole message is dropped, up to the next '['. */
+			unsigned msg;
 			if (c == '[') {
 				rxhead = 0;
-			} else if (c == ']') {
-				aux_buffers[rxihead].data_len = rxhead;
-				rxihead = (rxihead + 1) & RXINDEXMASK;
-			} else {
-				aux_buffers[rxihead].rxbuffer[rxhead] = c;
+				rxdropping = 0;
+			}
+			if (!spsc_ring_reserve(&aux_rx_ring, RXINDEXMASK, &msg))
+				rxdropping = 1;
+			if (rxdropping)
+				continue;
+
+			if (c == ']') {
+				aux_buffers[msg].data_len = rxhead;
+				spsc_ring_commit(&aux_rx_ring, RXINDEXMASK, 1);
+			} else if (c != '[') {
+				aux_buffers[msg].rxbuffer[rxhead] = c;
 				rxhead = (rxhead + 1) & RXBUFMASK;
 			}
 		}
@@ -17,6 +17,7 @@
 
 #include <serial.h>
 #include <string.h>
+#include <stdlib.h>
 #include <lpc17xx_pwm.h>
 #include <lpc17xx_clkpwr.h>
 #include <ether.h>
@@ -28,40 +29,45 @@
 #include <lightengine.h>
 #include <tables.h>
 #include <playback.h>
-#include <render.h>
 
 #include <bcm2835.h>
 #include <spi_dac.h>
-unsigned int ticks_per_point;
-
-/* Each point is 14 bytes. We buffer 1800 points.
- *
- * This gives us up to 60ms at 30k, 45ms at 40k, 36ms at 50k, or 30ms at
- * 60k.
+#include <dac_dma.h>
+#include <dac_clock.h>
+#include <dac_instrument.h>
+#include <dac_frame.h>
+#include <spsc_ring.h>
+#include <dac_settings.h>
+#include <dac_driver.h>
+#include <dac_calibrate.h>
+
+/* Each point is 14 bytes (16 if DAC_BUFFER_ENCODED). The default of 2048
+ * points gives us up to 68ms at 30k, 51ms at 40k, 41ms at 50k, or 34ms at
+ * 60k; unattended playback can afford much more, interactive control
+ * wants less. dac_buffer_mask is the size minus one, for the ring and
+ * fiq_handler.S.
  */
-packed_point_t dac_buffer[DAC_BUFFER_POINTS] AHB0;
+dac_buffer_point_t *dac_buffer;
+uint32_t dac_buffer_mask;
 
-#define DAC_MAX_COLOR_DELAY	16
+#define DAC_BUFFER_MASK	dac_buffer_mask
 
-union color_control {
-	struct {
-		uint8_t blue_produce;
-		uint8_t green_produce;
-		uint8_t red_produce;
-		uint8_t color_consume;
-	};
-	uint32_t word;
-};
+/* Latency target: if dac_latency_high_ms is set, producers are only
+ * offered enough room to fill the ring to that many milliseconds of
+ * points at the current rate, and the DAC starts once it holds
+ * dac_latency_low_ms. */
+static int dac_latency_low_ms;
+static int dac_latency_high_ms;
 
 volatile struct {
 	uint32_t count;
-	uint16_t produce;
-	uint16_t consume;
+	spsc_ring_t ring;		/* fiq_handler.S knows this layout */
 
 	enum {
 		IRQ_DO_BUFFER = 14,
 		IRQ_DO_ABSTRACT,
-		IRQ_DO_PANIC
+		IRQ_DO_PANIC,
+		IRQ_DO_FRAME
 	} irq_do;
 	enum dac_state state;
 	enum playback_source playback_src;
@@ -70,35 +76,76 @@ volatile struct {
 	/* Color channels */
 	int32_t blue_gain;
 	int32_t blue_offset;
-	uint16_t blue_buffer[DAC_MAX_COLOR_DELAY];
-	union color_control color_control;
 	int32_t red_gain;
 	int32_t red_offset;
-	uint16_t red_buffer[DAC_MAX_COLOR_DELAY];
 	int32_t green_gain;
 	int32_t green_offset;
-	uint16_t green_buffer[DAC_MAX_COLOR_DELAY];
 	uint32_t transform_matrix[8];
 } dac_control;
 
-/* Buffer for point rate changes.
+/* Buffer for point rate changes. Each entry carries the system timer
+ * divisors for its rate, worked out when it is queued, so that the FIQ
+ * can switch rates without dividing.
  */
-static uint32_t dac_rate_buffer[DAC_RATE_BUFFER_SIZE];
-static int dac_rate_produce;
-static volatile int dac_rate_consume;
+struct dac_rate_entry {
+	uint32_t ticks;
+	uint32_t rem;
+	uint32_t pps;
+};
+
+static struct dac_rate_entry dac_rate_buffer[DAC_RATE_BUFFER_SIZE];
+static spsc_ring_t dac_rate_ring;
+
+#define DAC_RATE_MASK	(DAC_RATE_BUFFER_SIZE - 1)
 
 uint32_t dac_cycle_count;
 
 /* Internal state. */
 int dac_current_pps;
+
+/* The rate last set with dac_set_rate(), before any in-band changes. */
+int dac_nominal_pps;
 int dac_flags = 0;
+enum dac_engine dac_engine = DAC_ENGINE_FIQ;
+int dac_frame_mode;
+volatile dac_underflow_t dac_underflow;
+
+/* Latched output: with LDAC held high, SPI writes only load the DACs'
+ * input registers, and every FIQ starts with an LDAC pulse that moves
+ * the point written in the previous period to all outputs at once, at
+ * the period edge. This is the LDAC bit while latched output is on, and
+ * 0 otherwise, so that the FIQ and the DMA chain can pulse it blindly. */
+uint32_t dac_ldac_mask;
 
 /* Shutter pin config. */
 #define DAC_SHUTTER_PIN		6
 #define DAC_SHUTTER_EN_PIN	7
 
+/* fiq_install
+ *
+ * Copy asm_fiq_handler into the FIQ vector, so that it runs from 0x1C
+ * rather than through the ldr pc there. vectors.s leaves room after the
+ * vector, and the handler is position independent.
+ */
+#ifndef PC_BUILD
+extern uint8_t fiq_vector[], fiq_vector_end[];
+
+static void COLD fiq_install(void) {
+	uint32_t len = asm_fiq_handler_end - (uint8_t *)asm_fiq_handler;
+	uint32_t room = fiq_vector_end - fiq_vector;
+
+	if (len > room)
+		panic("fiq: handler is %d bytes, %d at vector", len, room);
+
+	memcpy((void *)0x1C, asm_fiq_handler, len);
+	outputf("fiq: %d bytes at vector", len);
+}
+#endif
+
 void fiq_init(void) {
-	BCM2835_ST->C1 = BCM2835_ST->CLO + ticks_per_point;
+	dac_fiq_seed();
+	dac_st_clock.compare = BCM2835_ST->CLO + dac_clock_next_period(&dac_st_clock);
+	BCM2835_ST->C1 = dac_st_clock.compare;
 	BCM2835_ST->CS = 2;
 	//PUT32(0x2000B210, 0x00000000);
 	BCM2835_IRQ->FIQ_CONTROL = 0x80|1;
@@ -109,11 +156,17 @@ void fiq_init(void) {
  * Set the DAC point rate to a new value.
  */
 int dac_set_rate(int points_per_second) {
-	ASSERT(points_per_second <= 200000);
 	ASSERT(points_per_second > 0);
 
+	/* Faster than dac_calibrate() says the FIQ can keep up with, the
+	 * output would fall behind; play as fast as it can instead. */
+	if (points_per_second > dac_max_rate) {
+		outputf("dac: rate %d clamped to %d", points_per_second,
+			dac_max_rate);
+		points_per_second = dac_max_rate;
+	}
+
 	/* The PWM peripheral is set in dac_init() to use CCLK/4. */
-	ticks_per_point = 1E6 / points_per_second;
 	//LPC_PWM1->MR0 = ticks_per_point;
 
 	/* The LDAC low pulse must be at least 20ns long. At CCLK/4 = 24
@@ -122,9 +175,22 @@ int dac_set_rate(int points_per_second) {
 
 	/* Enable this rate to take effect when the timer next overflows. */
 	//LPC_PWM1->LER = (1<<0) | (1<<5);
-	 fiq_init();
+
+	/* The FIQ reschedules itself from the previous compare value, so
+	 * while playing, the new rate just takes effect from the next
+	 * period. Otherwise, (re)arm the timer from now. */
+	__disable_fiq();
+	dac_clock_set_rate(&dac_st_clock, DAC_CLOCK_ST_HZ, points_per_second);
+	dac_fiq_seed();
+	__enable_fiq();
+
+	if (dac_engine == DAC_ENGINE_DMA)
+		dac_dma_set_rate(points_per_second);
+	else if (dac_control.state != DAC_PLAYING)
+		fiq_init();
 
 	dac_current_pps = points_per_second;
+	dac_nominal_pps = points_per_second;
 
 	return 0;
 }
@@ -147,11 +213,38 @@ int dac_start(void) {
 
 	outputf("dac: starting");
 
+	if (dac_frame_mode && dac_frame_start() < 0) {
+		outputf("dac: not starting - no frame");
+		return -1;
+	}
+
 	dac_control.state = DAC_PLAYING;
 	dac_control.playback_src = playback_src;
-	dac_control.irq_do = (playback_src == SRC_ABSTRACT ? IRQ_DO_ABSTRACT : IRQ_DO_BUFFER);
+	if (playback_src == SRC_ABSTRACT)
+		dac_control.irq_do = IRQ_DO_ABSTRACT;
+	else if (dac_frame_mode)
+		dac_control.irq_do = IRQ_DO_FRAME;
+	else
+		dac_control.irq_do = IRQ_DO_BUFFER;
 	//LPC_PWM1->TCR = PWM_TCR_COUNTER_ENABLE | PWM_TCR_PWM_ENABLE;
-	fiq_init();
+
+	/* Hold LDAC high, so that points only reach the outputs when the
+	 * output engine pulses it. */
+	if (dac_ldac_mask)
+		bcm2835_gpio_set(LDAC_GPIO_PIN);
+
+	if (dac_engine == DAC_ENGINE_DMA) {
+		if (dac_dma_start() < 0) {
+			outputf("dac: not starting - dma start failed");
+			dac_control.state = DAC_PREPARED;
+			dac_control.irq_do = IRQ_DO_PANIC;
+			return -1;
+		}
+	} else {
+		fiq_init();
+	}
+
+	dac_clock_measure_start();
 
 	led_set_backled(1);
 	shutter_set(1);
@@ -169,27 +262,34 @@ int dac_rate_queue(int points_per_second) {
 		return -1;
 	}
 
-	int produce = dac_rate_produce;
-
-	int fullness = produce - dac_rate_consume;
-	if (fullness < 0)
-		fullness += DAC_RATE_BUFFER_SIZE;
+	if (points_per_second <= 0 || points_per_second > dac_max_rate) {
+		outputf("drq rejected: rate %d", points_per_second);
+		return -1;
+	}
 
-	/* The buffer can only ever become one word short of full -
-	 * produce = consume means empty.
-	 */
-	if (fullness >= DAC_RATE_BUFFER_SIZE - 1) {
+	unsigned produce;
+	if (!spsc_ring_reserve(&dac_rate_ring, DAC_RATE_MASK, &produce)) {
 		outputf("drq rejected: full");
 		return -1;
 	}
 
-	dac_rate_buffer[produce] = points_per_second;
+	dac_rate_buffer[produce].ticks = DAC_CLOCK_ST_HZ / points_per_second;
+	dac_rate_buffer[produce].rem = DAC_CLOCK_ST_HZ % points_per_second;
+	dac_rate_buffer[produce].pps = points_per_second;
 
-	dac_rate_produce = (produce + 1) % DAC_RATE_BUFFER_SIZE;
+	spsc_ring_commit(&dac_rate_ring, DAC_RATE_MASK, 1);
 
 	return 0;
 }
 
+/* dac_rate_pending
+ *
+ * Return the number of queued rate changes not yet played.
+ */
+int dac_rate_pending(void) {
+	return spsc_ring_count(&dac_rate_ring, DAC_RATE_MASK);
+}
+
 /* dac_request
  *
  * "Dear ring buffer: where should I put data and how much should I write?"
@@ -198,36 +298,82 @@ int dac_rate_queue(int points_per_second) {
  * give by dac_request_addr().
  */
 int dac_request(void) {
-	int consume = dac_control.consume;
-	int ret;
+	unsigned produce;
 
 	if (dac_control.state == DAC_IDLE)
 		return -1;
 
-/*
-	outputf("d_r: p %d, c %d", dac_control.produce, consume);
-*/
-
-	if (dac_control.produce >= consume) {
-		/* The read pointer is behind the write pointer, so we can
-		 * go ahead and fill the buffer up to the end. */
-		if (consume == 0) {
-			/* But not if consume = 0, since the buffer can only
-			 * ever become one word short of full. */
-			ret = (DAC_BUFFER_POINTS - dac_control.produce) - 1;
-		} else {
-			ret = DAC_BUFFER_POINTS - dac_control.produce;
-		}
-	} else {
-		/* We can only fil up as far as the write pointer. */
-		ret = (consume - dac_control.produce) - 1;
+	int n = spsc_ring_reserve(&dac_control.ring, DAC_BUFFER_MASK, &produce);
+
+	if (dac_latency_high_ms) {
+		int room = (dac_latency_high_ms * dac_current_pps) / 1000
+			- dac_fullness();
+		if (room < 0)
+			room = 0;
+		if (n > room)
+			n = room;
 	}
 
-	return ret;
+	return n;
 }
 
-packed_point_t *dac_request_addr(void) {
-	return &dac_buffer[dac_control.produce];
+dac_buffer_point_t *dac_request_addr(void) {
+	return &dac_buffer[dac_control.ring.produce];
+}
+
+/* dac_consume_request
+ *
+ * The consumer-side counterpart of dac_request: point *addr at the oldest
+ * queued point, and return how many points can be read from there without
+ * wrapping. Used by output engines that move points in bulk rather than
+ * one per FIQ.
+ */
+int dac_consume_request(dac_buffer_point_t **addr) {
+	if (dac_control.irq_do == IRQ_DO_FRAME) {
+		*addr = dac_frame_out.base + dac_frame_out.pos;
+		return dac_frame_out.npoints - dac_frame_out.pos;
+	}
+
+	unsigned consume;
+	int n = spsc_ring_peek(&dac_control.ring, DAC_BUFFER_MASK, &consume);
+
+	*addr = &dac_buffer[consume];
+	return n;
+}
+
+/* dac_consume_advance
+ *
+ * "Dear ring buffer: I have just taken this many points."
+ */
+void dac_consume_advance(int count) {
+	if (dac_control.irq_do == IRQ_DO_FRAME) {
+		dac_frame_out.pos += count;
+		if (dac_frame_out.pos >= dac_frame_out.npoints)
+			dac_frame_wrap(&dac_frame_out);
+		return;
+	}
+
+	spsc_ring_release(&dac_control.ring, DAC_BUFFER_MASK, count);
+}
+
+/* dac_consume_available
+ *
+ * Return the number of points an output engine could take right now. In
+ * frame mode the current frame can always be looped, so there's no limit.
+ */
+int dac_consume_available(void) {
+	if (dac_control.irq_do == IRQ_DO_FRAME)
+		return DAC_FRAME_MAX_POINTS;
+
+	return dac_fullness();
+}
+
+/* dac_count_points
+ *
+ * Credit points that have actually been played to the DAC point count.
+ */
+void dac_count_points(int count) {
+	dac_control.count += count;
 }
 
 /* dac_advance
@@ -239,41 +385,35 @@ packed_point_t *dac_request_addr(void) {
  * than dac_request allowed, but it should not write *more*.
  */
 void dac_advance(int count) {
-	if (dac_control.state == DAC_PREPARED || dac_control.state == DAC_PLAYING) {
-		int new_produce = (dac_control.produce + count) % DAC_BUFFER_POINTS;
-		dac_control.produce = new_produce;
-	}
+	if (dac_control.state == DAC_PREPARED || dac_control.state == DAC_PLAYING)
+		spsc_ring_commit(&dac_control.ring, DAC_BUFFER_MASK, count);
 }
 
+/* Color delay lines
+ *
+ * The galvos lag behind the color modulation, so each color channel can
+ * be delayed by up to DAC_MAX_COLOR_DELAY - 1 points relative to X/Y.
+ * This is applied by dac_store_point() as points go into the buffer, so
+ * it costs the FIQ nothing.
+ */
+struct delay_lines delay_lines;
+
 /* delay_line_get_delay
  *
  * Return the number of points of delay in the given delay line.
  */
 int delay_line_get_delay(int color_index) {
-	union color_control cc = dac_control.color_control;
-	int produce;
-	if (color_index == 0) produce = cc.red_produce;
-	else if (color_index == 1) produce = cc.green_produce;
-	else produce = cc.blue_produce;
-	return (produce - cc.color_consume + DAC_MAX_COLOR_DELAY) % DAC_MAX_COLOR_DELAY;
+	return delay_lines.delay[color_index];
 }
 
 /* delay_line_reset
  *
- * Reset the delay lines' buffers.
+ * Clear the delay lines' history, so that a new stream starts out blank
+ * rather than with colors left over from the last one.
  */
 static void delay_line_reset(void) {
-	memset(&dac_control.red_buffer, 0, sizeof(&dac_control.red_buffer));
-	memset(&dac_control.green_buffer, 0, sizeof(&dac_control.green_buffer));
-	memset(&dac_control.blue_buffer, 0, sizeof(&dac_control.blue_buffer));
-}
-
-static void move_data_forward(volatile uint16_t *buf, int n) {
-	uint16_t buf2[DAC_MAX_COLOR_DELAY];
-	int i;
-	for (i = 0; i < DAC_MAX_COLOR_DELAY; i++) buf2[i] = buf[i];
-	for (i = 0; i < DAC_MAX_COLOR_DELAY; i++)
-		buf[i] = buf2[(i + n) % DAC_MAX_COLOR_DELAY];
+	memset(delay_lines.history, 0, sizeof(delay_lines.history));
+	delay_lines.produce = 0;
 }
 
 /* delay_line_set_delay
@@ -284,87 +424,10 @@ static void move_data_forward(volatile uint16_t *buf, int n) {
  * Increasing it will cause intermediate points to be repeated once.
  */
 void delay_line_set_delay(int color_index, int delay) {
-	uint32_t produce;
-	int i;
-
 	if (delay < 0) delay = 0;
 	if (delay >= DAC_MAX_COLOR_DELAY) delay = DAC_MAX_COLOR_DELAY - 1;
 
-	int cur_delay = delay_line_get_delay(color_index);
-	int offset = delay - cur_delay;
-	outputf("cur delay %d; offset %d", cur_delay, offset);
-
-	if (offset >= 0) {
-		/* Repeat some color points. This only requires changing
-		 * our one channel's produce pointer and buffer, not the
-		 * global consume pointer. */
-
-		if (color_index == 0) {
-			__disable_fiq();
-			produce = dac_control.color_control.red_produce;
-			volatile uint16_t *data = dac_control.red_buffer;
-			uint16_t repvalue = data[produce];
-			for (i = 0; i < offset; i++) {
-				produce = (produce + 1) % DAC_MAX_COLOR_DELAY;
-				data[produce] = repvalue;
-			}
-			dac_control.color_control.red_produce = produce;
-			__enable_fiq();
-		} else if (color_index == 1) {
-			__disable_fiq();
-			produce = dac_control.color_control.green_produce;
-			volatile uint16_t *data = dac_control.green_buffer;
-			uint16_t repvalue = data[produce];
-			for (i = 0; i < offset; i++) {
-				produce = (produce + 1) % DAC_MAX_COLOR_DELAY;
-				data[produce] = repvalue;
-			}
-			dac_control.color_control.green_produce = produce;
-			__enable_fiq();
-		} else {
-			__disable_fiq();
-			produce = dac_control.color_control.blue_produce;
-			volatile uint16_t *data = dac_control.blue_buffer;
-			uint16_t repvalue = data[produce];
-			for (i = 0; i < offset; i++) {
-				produce = (produce + 1) % DAC_MAX_COLOR_DELAY;
-				data[produce] = repvalue;
-			}
-			dac_control.color_control.blue_produce = produce;
-			__enable_fiq();
-		}
-
-	} else {
-		/* Move the consume pointer up a bit - but this means that we
-		 * also have to update the other two channels. */
-		int count = -offset;
-
-		if (color_index == 0) {
-			__disable_fiq();
-			move_data_forward(dac_control.green_buffer, count);
-			move_data_forward(dac_control.blue_buffer, count);
-			dac_control.color_control.word =
-				(dac_control.color_control.word + 0x01000101)
-				& 0x0f0f0f0f;
-			__enable_fiq();
-		} else if (color_index == 1) {
-			__disable_fiq();
-			move_data_forward(dac_control.red_buffer, count);
-			move_data_forward(dac_control.blue_buffer, count);
-			dac_control.color_control.word =
-				(dac_control.color_control.word + 0x01010001)
-				& 0x0f0f0f0f;
-			__enable_fiq();
-		} else {
-			__disable_fiq();
-			move_data_forward(dac_control.red_buffer, count);
-			move_data_forward(dac_control.green_buffer, count);
-			dac_control.color_control.word =
-				(dac_control.color_control.word + 0x01010100)
-				& 0x0f0f0f0f;
-			__enable_fiq();
-		}
-	}
+	delay_lines.delay[color_index] = delay;
 }
 
 /* color_corr_get_offset, color_corr_get_gain,
@@ -393,11 +456,6 @@ void color_corr_set_gain(int color_index, int32_t gain) {
 	else dac_control.blue_gain = gain;
 }
 
-//extern uint8_t goto_dac16_handle_irq[];
-//extern uint8_t goto_dac16_handle_irq_end[];
-//extern char hw_dac_16bit;
-//extern uint8_t PWM1_IRQHandler[];
-
 /* dac_init
  *
  * Initialize the DAC. This must be called once after reset.
@@ -410,6 +468,11 @@ void COLD dac_init() {
 
 	/* Set up the SSP to communicate with the DAC, and initialize to 0 */
 	hw_dac_init();
+	outputf("dac: %s", dac_driver.name);
+#ifndef PC_BUILD
+	fiq_install();
+#endif
+	dac_calibrate();
 
 	/* ... and LDAC on the PWM peripheral */
 	//LPC_PINCON->PINSEL4 |= (1 << 8);
@@ -439,16 +502,20 @@ void COLD dac_init() {
 	dac_control.count = 0;
 	dac_current_pps = 0;
 
-	dac_control.color_control.word = 0;
 	delay_line_reset();
 
+	dac_underflow.policy = DAC_UNDERFLOW_STOP;
+	dac_set_park(0, 0);
+
+	if (dac_set_buffer_size(settings.buffer_points
+	    ? settings.buffer_points : DAC_BUFFER_DEFAULT_POINTS) < 0)
+		panic("dac: no point buffer");
+
 	dac_control.red_gain = COORD_MAX;
 	dac_control.green_gain = COORD_MAX;
 	dac_control.blue_gain = COORD_MAX;
 
-	//if (hw_dac_16bit) {
-	//	memcpy(PWM1_IRQHandler, goto_dac16_handle_irq, goto_dac16_handle_irq_end - goto_dac16_handle_irq);
-	//}
+	dac_dma_init();
 }
 
 /* dac_configure
@@ -463,10 +530,11 @@ int dac_prepare(void) {
 	if (le_get_state() != LIGHTENGINE_READY)
 		return -1;
 
-	dac_control.produce = 0;
-	dac_control.consume = 0;
-	dac_rate_produce = 0;
-	dac_rate_consume = 0;
+	spsc_ring_reset(&dac_control.ring);
+	spsc_ring_reset(&dac_rate_ring);
+	delay_line_reset();
+	dac_frame_reset();
+	dac_underflow.current = 0;
 	dac_flags &= ~DAC_FLAG_STOP_ALL;
 	dac_control.state = DAC_PREPARED;
 	dac_control.irq_do = IRQ_DO_PANIC;
@@ -487,6 +555,7 @@ void NOINLINE dac_stop(int flags) {
 	 * the DAC outputs to be left on. */
 	//LPC_PWM1->TCR = PWM_TCR_COUNTER_RESET;
 	BCM2835_IRQ->FIQ_CONTROL = 0x00;
+	dac_dma_stop();
 
 	/* Close the shutter. */
 	dac_flags &= ~DAC_FLAG_SHUTTER;
@@ -495,6 +564,7 @@ void NOINLINE dac_stop(int flags) {
 
 	/* Set LDAC to update immediately */
 	//LPC_PINCON->PINSEL4 &= ~(3 << 8);
+	bcm2835_gpio_clr(LDAC_GPIO_PIN);
 
 	/* Clear out all the DAC channels. */
 	hw_dac_zero_all_channels();
@@ -508,25 +578,50 @@ void NOINLINE dac_stop(int flags) {
 	dac_control.irq_do = IRQ_DO_PANIC;
 	dac_control.count = 0;
 	dac_flags |= flags;
+}
 
-	delay_line_reset();
+/* dac_rate_pop
+ *
+ * Take the next queued rate change, returning its rate, or -1 if the
+ * queue is empty. Used by output engines that handle
+ * DAC_CTRL_RATE_CHANGE outside the FIQ.
+ */
+int dac_rate_pop(void) {
+	unsigned rate_consume;
+	if (!spsc_ring_peek(&dac_rate_ring, DAC_RATE_MASK, &rate_consume))
+		return -1;
+
+	int pps = dac_rate_buffer[rate_consume].pps;
+	spsc_ring_release(&dac_rate_ring, DAC_RATE_MASK, 1);
+	dac_current_pps = pps;
+
+	return pps;
 }
 
-void dac_pop_rate_change(void) {
-	int rate_consume = dac_rate_consume;
-	if (rate_consume != dac_rate_produce) {
-		dac_set_rate(dac_rate_buffer[rate_consume]);
-		rate_consume++;
-		if (rate_consume >= DAC_RATE_BUFFER_SIZE)
-			rate_consume = 0;
-		dac_rate_consume = rate_consume;
-	}
+/* dac_fiq_pop_rate_change
+ *
+ * Called from the FIQ when it plays a point tagged DAC_CTRL_RATE_CHANGE:
+ * switch the point clock to the next queued rate. The new rate takes
+ * effect from the period following the tagged point, as the period for
+ * the tagged point itself has already been scheduled.
+ */
+void dac_fiq_pop_rate_change(void) {
+	unsigned rate_consume;
+	if (!spsc_ring_peek(&dac_rate_ring, DAC_RATE_MASK, &rate_consume))
+		return;
+
+	struct dac_rate_entry *e = &dac_rate_buffer[rate_consume];
+	dac_st_clock.ticks = e->ticks;
+	dac_st_clock.rem = e->rem;
+	dac_st_clock.div = e->pps;
+	dac_st_clock.acc = 0;
+	dac_current_pps = e->pps;
+
+	spsc_ring_release(&dac_rate_ring, DAC_RATE_MASK, 1);
 }
 
 static void inline dac_write_point(dac_point_t *p) {
 
-	#define MASK_XY(v)	((((v) >> 4) + 0x800) & 0xFFF)
-
 	//LPC_SSP1->DR = (p->b >> 4) | 0x2000;
 
 	uint32_t xi = p->x, yi = p->y;
@@ -539,7 +634,7 @@ static void inline dac_write_point(dac_point_t *p) {
 	//LPC_SSP1->DR = (p->i >> 4) | 0x5000;
 	//LPC_SSP1->DR = (p->u1 >> 4) | 0x1000;
 	//LPC_SSP1->DR = (p->u2 >> 4);
-	dac_write_all(MASK_XY(x),  MASK_XY(y), p->i >> 4, p->r >> 4, p->g >> 4, p->b >> 4);
+	dac_driver.write_point(x, y, p->i, p->r, p->g, p->b);
 }
 
 static NOINLINE COLD __attribute__((noreturn)) void dac_panic_not_playing(void) {
@@ -577,15 +672,183 @@ enum dac_state dac_get_state(void) {
 	return dac_control.state;
 }
 
+/* dac_set_engine
+ *
+ * Select whether points are written out by the FIQ handler or by the DMA
+ * engine. This can only be changed while the DAC is not playing; the new
+ * engine takes effect at the next dac_start().
+ */
+int dac_set_engine(enum dac_engine engine) {
+	if (engine != DAC_ENGINE_FIQ && engine != DAC_ENGINE_DMA)
+		return -1;
+
+	if (dac_control.state == DAC_PLAYING) {
+		outputf("dac: can't change engine while playing");
+		return -1;
+	}
+
+#if !DAC_DRIVER_DMA
+	if (engine == DAC_ENGINE_DMA) {
+		outputf("dac: no DMA engine for %s", dac_driver.name);
+		return -1;
+	}
+#endif
+
+	if (engine == DAC_ENGINE_DMA)
+		BCM2835_IRQ->FIQ_CONTROL = 0x00;
+
+	dac_engine = engine;
+	return 0;
+}
+
+enum dac_engine dac_get_engine(void) {
+	return dac_engine;
+}
+
+/* dac_set_frame_mode
+ *
+ * Select between streaming output from the point ring (0) and frame mode
+ * (nonzero), where producers submit whole frames with dac_frame_commit()
+ * and the current frame loops until the next one arrives. Only allowed
+ * while the DAC is idle.
+ */
+int dac_set_frame_mode(int enable) {
+	if (dac_control.state != DAC_IDLE) {
+		outputf("dac: can't change frame mode while active");
+		return -1;
+	}
+
+	dac_frame_mode = enable ? 1 : 0;
+	return 0;
+}
+
+/* dac_set_latched
+ *
+ * Turn latched output on or off; see dac_ldac_mask. This delays output
+ * by one point period. Only allowed while the DAC is not playing.
+ */
+int dac_set_latched(int enable) {
+	if (dac_control.state == DAC_PLAYING) {
+		outputf("dac: can't change latching while playing");
+		return -1;
+	}
+
+	dac_ldac_mask = enable ? 1 << LDAC_GPIO_PIN : 0;
+	return 0;
+}
+
+/* dac_set_buffer_size
+ *
+ * (Re)allocate the point ring, rounding points up to a power of two
+ * within DAC_BUFFER_MIN_POINTS..DAC_BUFFER_MAX_POINTS. Only allowed while
+ * the DAC is idle. Returns the new size, or -1 if it couldn't be changed;
+ * if allocation fails, the old ring is kept.
+ */
+int dac_set_buffer_size(int points) {
+	int size = DAC_BUFFER_MIN_POINTS;
+
+	if (dac_control.state != DAC_IDLE && dac_buffer) {
+		outputf("dac: can't resize buffer while active");
+		return -1;
+	}
+
+	while (size < points && size < DAC_BUFFER_MAX_POINTS)
+		size <<= 1;
+
+	if (dac_buffer && size == dac_buffer_mask + 1)
+		return size;
+
+	dac_buffer_point_t *buf = malloc(size * sizeof(dac_buffer_point_t));
+	if (!buf) {
+		outputf("dac: can't allocate %d points", size);
+		return -1;
+	}
+
+	free(dac_buffer);
+	dac_buffer = buf;
+	dac_buffer_mask = size - 1;
+	spsc_ring_reset(&dac_control.ring);
+
+	return size;
+}
+
+int dac_get_buffer_size(void) {
+	return dac_buffer_mask + 1;
+}
+
+/* dac_set_latency
+ *
+ * Set the latency target, as low and high watermarks in milliseconds of
+ * points at the current rate. A high watermark of 0 turns the target off,
+ * and producers may fill the whole ring again.
+ */
+int dac_set_latency(int low_ms, int high_ms) {
+	if (low_ms < 0 || high_ms < 0 || (high_ms && low_ms > high_ms))
+		return -1;
+
+	dac_latency_low_ms = low_ms;
+	dac_latency_high_ms = high_ms;
+	return 0;
+}
+
+/* dac_latency_low_points
+ *
+ * Return the low watermark in points at the current rate, or 0 if there
+ * is no latency target.
+ */
+int dac_latency_low_points(void) {
+	if (!dac_latency_high_ms)
+		return 0;
+
+	int points = (dac_latency_low_ms * dac_current_pps) / 1000;
+	if (points > (int)dac_buffer_mask)
+		points = dac_buffer_mask;
+	return points;
+}
+
+/* dac_set_underflow_policy
+ *
+ * Choose what happens when the point ring runs dry; see
+ * DAC_UNDERFLOW_STOP and friends in dac.h.
+ */
+int dac_set_underflow_policy(int policy) {
+	if (policy < DAC_UNDERFLOW_STOP || policy > DAC_UNDERFLOW_PARK)
+		return -1;
+
+	dac_underflow.policy = policy;
+	return 0;
+}
+
+/* dac_set_park
+ *
+ * Set the position the scanners are moved to on underflow under
+ * DAC_UNDERFLOW_PARK. This is in raw DAC coordinates, not run through the
+ * geometric corrector, so a bad correction can't park the beam somewhere
+ * unexpected.
+ */
+void dac_set_park(int32_t x, int32_t y) {
+	dac_underflow.park[0] = DAC_WORD_X(x);
+	dac_underflow.park[1] = DAC_WORD_Y(y);
+}
+
+/* dac_underflow_reset
+ *
+ * Clear the underflow statistics.
+ */
+void dac_underflow_reset(void) {
+	__disable_fiq();
+	dac_underflow.count = 0;
+	dac_underflow.starved = 0;
+	dac_underflow.longest = 0;
+	__enable_fiq();
+}
+
 /* dac_fullness
  *
  * Returns the number of points currently in the buffer.
  */
 int dac_fullness(void) {
-	int fullness = dac_control.produce - dac_control.consume;
-	if (fullness < 0)
-		fullness += DAC_BUFFER_POINTS;
-	return fullness;
+	return spsc_ring_count(&dac_control.ring, DAC_BUFFER_MASK);
 }
 
 /* shutter_set
@@ -610,6 +873,42 @@ void shutter_set(int state) {
 	}
 }
 
+/* dac_store_points
+ *
+ * Store n points into the DAC buffer, like dac_store_point(). In an
+ * encoded buffer, the colors are encoded first with the raw X/Y parked in
+ * the X and Y words, and then the whole batch goes through
+ * transform_points() at once.
+ */
+void dac_store_points(dac_buffer_point_t *dest, dac_point_t *src, int n) {
+	int i;
+
+#if DAC_BUFFER_ENCODED
+	for (i = 0; i < n; i++) {
+		dac_point_t p = src[i];
+		if (mesh_active)
+			mesh_warp(&p.x, &p.y);
+		delay_line_apply(&p);
+		dac_encode_color(&dest[i], &p);
+		dest[i].word[ENC_X] = p.x;
+		dest[i].word[ENC_Y] = p.y;
+	}
+
+	transform_points(transform_encode_matrix,
+		(uint32_t *)&dest->word[ENC_X], n,
+		sizeof(encoded_point_t) / sizeof(uint32_t));
+
+	for (i = 0; i < n; i++) {
+		int16_t x = dest[i].word[ENC_X], y = dest[i].word[ENC_Y];
+		dest[i].word[ENC_X] = DAC_WORD_X(x);
+		dest[i].word[ENC_Y] = DAC_WORD_Y(y);
+	}
+#else
+	for (i = 0; i < n; i++)
+		dac_store_point(&dest[i], &src[i]);
+#endif
+}
+
 /* impl_dac_pack_point
  *
  * The actual dac_pack_point function is declared 'static inline' in dac.h,
@@ -621,6 +920,11 @@ void impl_dac_pack_point(packed_point_t *dest, dac_point_t *src) {
 	dac_pack_point(dest, src);
 }
 
+void impl_dac_encode_point(encoded_point_t *dest, dac_point_t *src) __attribute__((used));
+void impl_dac_encode_point(encoded_point_t *dest, dac_point_t *src) {
+	dac_encode_point(dest, src);
+}
+
 int32_t __attribute__((used)) impl_translate(int32_t xi, int32_t yi) {
 	int32_t x = translate_x(xi, yi);
 	int32_t y = translate_y(xi, yi);
@@ -635,7 +939,7 @@ uint32_t dac_get_count() {
 	return dac_control.count;
 }
 
-void dac_stop_underflow() {
+void dac_stop_underflow(void) {
 	//LPC_PWM1->IR = PWM_IR_PWMMRn(0);
 	dac_stop(DAC_FLAG_STOP_UNDERFLOW);
 }
@@ -643,52 +947,149 @@ void dac_stop_underflow() {
 uint32_t count_prev = 0;
 void print_dac_cycle_count(void) {
 	uint32_t count   = dac_control.count;
-	outputf("dac [%.2d][%.4d][%.2d]", dac_cycle_count, count - count_prev, ticks_per_point);
+	outputf("dac [%.2d][%.4d][%.2d]", dac_cycle_count, count - count_prev, dac_st_clock.ticks);
 	count_prev = count;
+
+	if (dac_control.state == DAC_PLAYING) {
+		dac_rate_stats_t stats;
+		dac_clock_get_stats(&stats);
+		outputf("dac rate: req %d meas %d.%03d drift %d pts %d ppm slips %d",
+			stats.requested_pps, stats.measured_mpps / 1000,
+			stats.measured_mpps % 1000, stats.drift_points,
+			stats.drift_ppm, dac_st_clock.slips);
+	}
+
+	if (dac_underflow.count)
+		outputf("underflow: n %d starved %d longest %d",
+			dac_underflow.count, dac_underflow.starved,
+			dac_underflow.longest);
+
+	outputf("fiq: n %d dur max %d late max %d missed %d",
+		dac_fiq_stats.count, dac_fiq_stats.max_duration,
+		dac_fiq_stats.max_lateness, dac_fiq_stats.missed);
+}
+/* dac_fiq_starve
+ *
+ * Called from the FIQ for each period the point ring is empty, unless
+ * the underflow policy is to stop. The lasers are blanked on the first
+ * starved period (and the scanners parked, if asked); after that the DACs
+ * just hold their outputs until points arrive.
+ */
+static inline void dac_fiq_starve(void) {
+	uint32_t current = ++dac_underflow.current;
+
+	dac_underflow.starved++;
+	if (current > dac_underflow.longest)
+		dac_underflow.longest = current;
+
+	if (current != 1)
+		return;
+
+	dac_underflow.count++;
+
+	dac_driver_write_color(DAC_WORD_I_BITS, DAC_WORD_R_BITS,
+		DAC_WORD_G_BITS, DAC_WORD_B_BITS);
+
+	if (dac_underflow.policy == DAC_UNDERFLOW_PARK)
+		dac_driver_write_xy(dac_underflow.park[0], dac_underflow.park[1]);
 }
+
+/* On the host, the simulator calls the handler like any other function. */
+#ifdef PC_BUILD
+#define FIQ_HANDLER
+#else
+#define FIQ_HANDLER	__attribute__((interrupt("FIQ")))
+#endif
+
 #if 1
-void __attribute__((interrupt("FIQ"))) c_fiq_handler(void) {
+void FIQ_HANDLER c_fiq_handler(void) {
 //void c_fiq_handler(void) {
 #if DAC_INSTRUMENT_TIME
 	uint32_t st_stamp = BCM2835_ST->CLO;
 #endif
 	BCM2835_ST->CS = 2;
-	BCM2835_ST->C1 = BCM2835_ST->CLO + ticks_per_point;
 
-	if (dac_control.irq_do != IRQ_DO_BUFFER)
-		return;
+	/* Latch the point written last period. The LDAC low time has to be
+	 * at least 100ns, which the scheduling below more than covers. */
+	if (dac_ldac_mask)
+		bcm2835_gpio_clr(LDAC_GPIO_PIN);
 
-	uint16_t consume = dac_control.consume;
+#if DAC_INSTRUMENT_TIME
+	int32_t lateness = st_stamp - dac_st_clock.compare;
+	dac_fiq_stats_record(dac_fiq_stats.lateness_hist,
+		&dac_fiq_stats.max_lateness, lateness < 0 ? 0 : lateness);
+#endif
 
-	if (consume == dac_control.produce) {
-		dac_stop_underflow();
-		return;
+	/* Schedule from the previous compare value, not from now. */
+	uint32_t compare = dac_st_clock.compare + dac_clock_next_period(&dac_st_clock);
+	if ((int32_t)(compare - BCM2835_ST->CLO) <= 0) {
+		compare = BCM2835_ST->CLO + dac_st_clock.ticks;
+		dac_st_clock.slips++;
 	}
+	dac_st_clock.compare = compare;
+	BCM2835_ST->C1 = compare;
 
-	packed_point_t *point = &dac_buffer[consume];
-	consume++;
+	if (dac_ldac_mask)
+		bcm2835_gpio_set(LDAC_GPIO_PIN);
 
-	if (consume == DAC_BUFFER_POINTS)
-		consume = 0;
+	dac_buffer_point_t *point;
+
+	if (dac_control.irq_do == IRQ_DO_FRAME) {
+		point = dac_frame_next(&dac_frame_out);
+	} else if (dac_control.irq_do == IRQ_DO_BUFFER) {
+		unsigned consume;
+
+		if (!spsc_ring_peek(&dac_control.ring, DAC_BUFFER_MASK, &consume)) {
+			if (dac_underflow.policy == DAC_UNDERFLOW_STOP) {
+				dac_stop_underflow();
+				return;
+			}
+			dac_fiq_starve();
+			goto exit;
+		}
+
+		dac_underflow.current = 0;
+
+		point = &dac_buffer[consume];
+		spsc_ring_release(&dac_control.ring, DAC_BUFFER_MASK, 1);
+	} else {
+		goto exit;
+	}
 
-	dac_control.consume = consume;
 	dac_control.count++;
 
+	if (DAC_BUFFER_CONTROL(point) & DAC_CTRL_RATE_CHANGE)
+		dac_fiq_pop_rate_change();
+
+#if DAC_BUFFER_ENCODED
+	dac_driver_write_color(point->word[ENC_I], point->word[ENC_R],
+		point->word[ENC_G], point->word[ENC_B]);
+	dac_driver_write_xy(point->word[ENC_X], point->word[ENC_Y]);
+#else
 	uint32_t xi = point->x, yi = point->y;
 
 	int32_t x = translate_x(xi, yi);
 	int32_t y = translate_y(xi, yi);
 
-	uint8_t red = ((point->irg) >> 16) & 0x00FF;
-	uint8_t green = ((point->irg) >> 4) & 0x00FF;
-	uint8_t blue = ((point->bf) >> 4) & 0x00FF;
-	uint8_t intensity = (UNPACK_I(point)) >> 8;
-
-	dac_write_all(MASK_XY(x), MASK_XY(y), intensity, red, green, blue);
+	dac_driver_write_color(DAC_WORD_I(UNPACK_I(point)),
+		DAC_WORD_R(UNPACK_R(point)), DAC_WORD_G(UNPACK_G(point)),
+		DAC_WORD_B(UNPACK_B(point)));
+	dac_driver_write_xy(DAC_WORD_X(x), DAC_WORD_Y(y));
+#endif
 
+exit:
 #if DAC_INSTRUMENT_TIME
-	dac_cycle_count = BCM2835_ST->CLO - st_stamp;
+	{
+		uint32_t now = BCM2835_ST->CLO;
+		dac_cycle_count = now - st_stamp;
+		dac_fiq_stats_record(dac_fiq_stats.duration_hist,
+			&dac_fiq_stats.max_duration, dac_cycle_count);
+		if ((int32_t)(now - dac_st_clock.compare) >= 0)
+			dac_fiq_stats.missed++;
+		dac_fiq_stats.count++;
+	}
 #endif
+	return;
 }
 #endif
 INITIALIZER(hardware, dac_init);
@@ -0,0 +1,123 @@
+/* SPI clock and point rate calibration
+ *
+ * The FIQ spends most of each point shifting words out over SPI, so the
+ * point rate the board can sustain follows from the SPI clock. This times
+ * the backend's point writes at each SPI divider, from the fastest its
+ * parts are rated for down, and keeps the fastest one that times steadily,
+ * and no faster than the divider allows (give or take the 1us timer).
+ * The point time there, plus the rest of the FIQ's work, gives
+ * dac_max_rate, which dac_set_rate() and dac_rate_queue() hold rates to.
+ *
+ * It runs from dac_init(), and again on request over OSC.
+ */
+
+#include <serial.h>
+#include <attrib.h>
+#include <hardware.h>
+#include <dac.h>
+
+#include <bcm2835.h>
+#include <dac_driver.h>
+#include <dac_calibrate.h>
+
+int dac_max_rate = DAC_MAX_POINT_RATE;
+int dac_spi_divider = DAC_SPI_MIN_DIVIDER;
+uint32_t dac_point_ns;
+
+/* dac_calibrate_time
+ *
+ * Time DAC_CAL_ROUNDS rounds of point writes at the current divider, and
+ * return the shortest time per point in ns. Anything else can only make
+ * a round longer, so the shortest is the one to believe; but if fewer
+ * than half of the rounds come within an eighth of it, the timing isn't
+ * steady, and this returns 0.
+ */
+static uint32_t COLD dac_calibrate_time(void) {
+	uint32_t ns[DAC_CAL_ROUNDS];
+	uint32_t best = ~0;
+	int round, i, steady = 0;
+
+	for (round = 0; round < DAC_CAL_ROUNDS; round++) {
+		__disable_fiq();
+		uint32_t start = BCM2835_ST->CLO;
+		for (i = 0; i < DAC_CAL_POINTS; i++)
+			dac_driver.write_point(0, 0, 0, 0, 0, 0);
+		uint32_t us = BCM2835_ST->CLO - start;
+		__enable_fiq();
+
+		ns[round] = us * 1000 / DAC_CAL_POINTS;
+		if (ns[round] < best)
+			best = ns[round];
+	}
+
+	for (round = 0; round < DAC_CAL_ROUNDS; round++) {
+		if (ns[round] - best <= best / 8)
+			steady++;
+	}
+
+	return steady * 2 >= DAC_CAL_ROUNDS ? best : 0;
+}
+
+/* dac_calibrate
+ *
+ * Pick the SPI divider and set dac_max_rate. The DAC must not be playing;
+ * the outputs are left at zero. If the current rate is now too fast, it
+ * is brought down.
+ */
+int COLD dac_calibrate(void) {
+	int div;
+
+	if (dac_get_state() == DAC_PLAYING) {
+		outputf("dac: not calibrating - playing");
+		return -1;
+	}
+
+	for (div = DAC_SPI_MIN_DIVIDER; div <= DAC_CAL_MAX_DIVIDER; div += 2) {
+		/* 16 SPI clocks a word */
+		uint32_t spi_ns = (uint64_t)DAC_SPI_WORDS * 16 * div
+			* 1000000000 / DAC_CAL_CORE_HZ;
+		uint32_t ns;
+
+		bcm2835_spi_setClockDivider(div);
+		ns = dac_calibrate_time();
+
+		if (!ns || ns < spi_ns - spi_ns / 8) {
+			outputf("dac: spi /%d rejected, %d ns", div, ns);
+			continue;
+		}
+
+		dac_spi_divider = div;
+		dac_point_ns = ns;
+		break;
+	}
+
+	if (div > DAC_CAL_MAX_DIVIDER) {
+		/* Nothing timed right: stay at the rated divider, and trust
+		 * the limit we always had. */
+		bcm2835_spi_setClockDivider(DAC_SPI_MIN_DIVIDER);
+		dac_spi_divider = DAC_SPI_MIN_DIVIDER;
+		dac_point_ns = 0;
+		dac_max_rate = DAC_MAX_POINT_RATE;
+		outputf("dac: calibration failed");
+	} else {
+		uint32_t fiq_ns = dac_point_ns + DAC_CAL_FIQ_OVERHEAD_NS;
+		int rate = 10000000 * DAC_CAL_FIQ_SHARE / fiq_ns;
+
+		rate -= rate % 1000;
+		if (rate > DAC_MAX_POINT_RATE)
+			rate = DAC_MAX_POINT_RATE;
+		if (rate < 1000)
+			rate = 1000;
+		dac_max_rate = rate;
+	}
+
+	hw_dac_zero_all_channels();
+
+	outputf("dac: spi /%d, %d ns a point, max %d pps", dac_spi_divider,
+		dac_point_ns, dac_max_rate);
+
+	if (dac_current_pps > dac_max_rate)
+		dac_set_rate(dac_max_rate);
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/* Point clock and rate measurement
+ *
+ * The accumulator itself lives in dac_clock.h, since both the FIQ handler
+ * and the DMA engine step it. This file sets it up, and keeps a running
+ * comparison of the points actually played against the points that the
+ * requested rate says should have been played.
+ */
+
+#include <serial.h>
+#include <attrib.h>
+#include <dac.h>
+
+#include <bcm2835.h>
+#include <dac_clock.h>
+
+dac_clock_t dac_st_clock;
+
+static int dac_measuring;
+static uint32_t dac_measure_start_count;
+static uint32_t dac_measure_last_count;
+static uint32_t dac_measure_last_time;
+static uint32_t dac_measured_mpps;
+static uint64_t dac_measure_elapsed_us;
+
+/* Sum of pps * elapsed microseconds; divide by 1E6 for points. */
+static uint64_t dac_measure_expected;
+
+/* dac_clock_set_rate
+ *
+ * Set a clock to divide hz down to pps. The new rate takes effect from the
+ * next period; the current compare value is kept, so changing the rate
+ * doesn't introduce a phase jump.
+ */
+void dac_clock_set_rate(dac_clock_t *c, uint32_t hz, uint32_t pps) {
+	c->ticks = hz / pps;
+	c->rem = hz % pps;
+	c->acc = 0;
+	c->div = pps;
+}
+
+/* dac_clock_measure_start
+ *
+ * Reset the measurement baseline. Called when the DAC starts playing.
+ */
+void dac_clock_measure_start(void) {
+	dac_measure_start_count = dac_get_count();
+	dac_measure_last_count = dac_measure_start_count;
+	dac_measure_last_time = bcm2835_st_read();
+	dac_measured_mpps = 0;
+	dac_measure_elapsed_us = 0;
+	dac_measure_expected = 0;
+	dac_measuring = 1;
+}
+
+/* dac_clock_measure
+ *
+ * Periodic event: sample the DAC point count against the system timer.
+ */
+void dac_clock_measure(void) {
+	if (dac_get_state() != DAC_PLAYING) {
+		dac_measuring = 0;
+		return;
+	}
+
+	if (!dac_measuring) {
+		dac_clock_measure_start();
+		return;
+	}
+
+	uint32_t now = bcm2835_st_read();
+	uint32_t count = dac_get_count();
+	uint32_t dt = now - dac_measure_last_time;
+
+	if (!dt)
+		return;
+
+	dac_measured_mpps = ((uint64_t)(count - dac_measure_last_count)
+		* 1000000000ULL) / dt;
+	dac_measure_expected += (uint64_t)dac_current_pps * dt;
+	dac_measure_elapsed_us += dt;
+
+	dac_measure_last_count = count;
+	dac_measure_last_time = now;
+}
+
+/* dac_clock_get_stats
+ *
+ * Report measured versus requested rate since the DAC was started.
+ */
+void dac_clock_get_stats(dac_rate_stats_t *stats) {
+	uint32_t expected = dac_measure_expected / 1000000;
+	uint32_t played = dac_measure_last_count - dac_measure_start_count;
+
+	stats->requested_pps = dac_current_pps;
+	stats->measured_mpps = dac_measured_mpps;
+	stats->drift_points = played - expected;
+	stats->drift_ppm = expected ?
+		((int64_t)stats->drift_points * 1000000) / expected : 0;
+	stats->elapsed_s = dac_measure_elapsed_us / 1000000;
+}
@@ -0,0 +1,490 @@
+/* DMA-driven DAC output engine
+ *
+ * Instead of taking one FIQ per point, this engine turns points from the
+ * dac_buffer ring into chains of BCM2835 DMA control blocks. Each point is
+ * a fixed run of DAC_DMA_CB_PER_POINT control blocks:
+ *
+ *  - a write to the PWM FIFO, paced by the PWM DREQ. This holds the chain
+ *    until the next point period starts.
+ *  - a write of dac_ldac_mask to GPCLR0, which latches the previous
+ *    point if latched output is on.
+ *  - a write of the following period's length to the PWM range register.
+ *    The lengths come from a dac_clock accumulator, so the average rate
+ *    is exact even though the PWM can only count whole ticks.
+ *  - a write of dac_ldac_mask to GPSET0, ending the LDAC pulse.
+ *  - for each MCP49x2: a write of the HC139 address lines to GPSET0 and
+ *    GPCLR0, then for each of its channels a header + data write to the
+ *    SPI0 FIFO (paced by the SPI TX DREQ) and a read of the received word
+ *    (paced by the SPI RX DREQ). The read stalls the chain until the
+ *    transfer is over and /CS is released, so the next HC139 write can
+ *    never glitch a transfer in progress.
+ *
+ * Points are grouped in blocks. The main loop fills free blocks from the
+ * dac_buffer ring and links them onto the tail of the running chain. The
+ * last control block of each block writes that block's sequence number to
+ * dac_dma_done_seq, so the CPU can tell which blocks have been played
+ * without taking an interrupt.
+ */
+
+#include <string.h>
+#include <serial.h>
+#include <tables.h>
+#include <attrib.h>
+#include <dac.h>
+#include <hardware.h>
+#include <transform.h>
+
+#include <bcm2835.h>
+#include <spi_dac.h>
+#include <dac_dma.h>
+#include <dac_clock.h>
+
+#define DMA			BCM2835_DMA(DAC_DMA_CHANNEL)
+
+#define DMA_CS_GO	(BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_WAIT_WRITES \
+			| BCM2835_DMA_CS_PRIORITY(8) | BCM2835_DMA_CS_PANIC_PRIORITY(15))
+
+/* In DMA mode, SPI0 takes a header word (DLEN << 16 | CS[7:0]) before each
+ * transfer, and then shifts data out LSB first. */
+#define SPI_DMA_HEADER	((2 << 16) | BCM2835_SPI0_CS_TA)
+#define SPI_DMA_WORD(w)	((((w) & 0xFF) << 8) | (((w) >> 8) & 0xFF))
+
+#define MASK_XY(v)	((((v) >> 4) + 0x800) & 0xFFF)
+
+typedef struct dac_dma_point {
+	BCM2835_DMA_CB_TypeDef cb[DAC_DMA_CB_PER_POINT];
+	uint32_t spi[12];
+	uint32_t range;
+	uint32_t pad[3];
+} dac_dma_point_t;
+
+struct dac_dma_block {
+	dac_dma_point_t points[DAC_DMA_BLOCK_POINTS];
+	BCM2835_DMA_CB_TypeDef done;
+	uint32_t seq;
+	int npoints;
+};
+
+static struct dac_dma_block dac_dma_blocks[DAC_DMA_BLOCKS];
+
+/* HC139 address line writes, laid out as GPSET0, GPSET1, reserved, GPCLR0 */
+static uint32_t dac_dma_select[3][4] __attribute__((aligned(32)));
+
+static uint32_t dac_dma_pace_word;
+static dac_clock_t dac_dma_clock;
+static uint32_t dac_dma_sink;
+static volatile uint32_t dac_dma_done_seq;
+
+static uint32_t dac_dma_seq;
+static int dac_dma_fill;	/* Next block to fill */
+static int dac_dma_retire;	/* Oldest block not yet played */
+static int dac_dma_queued;	/* Blocks handed to the DMA engine */
+static int dac_dma_running;
+
+/* Underflow handling: the X/Y words of the last point queued, for
+ * DAC_UNDERFLOW_HOLD, and when the current starvation episode began. */
+static uint32_t dac_dma_last_xy[2];
+static int dac_dma_starving;
+static uint32_t dac_dma_starve_start;
+
+static void dac_dma_cb(BCM2835_DMA_CB_TypeDef *cb, uint32_t ti, uint32_t src,
+                       uint32_t dest, uint32_t len) {
+	cb->TI = ti | BCM2835_DMA_TI_WAIT_RESP;
+	cb->SOURCE_AD = src;
+	cb->DEST_AD = dest;
+	cb->TXFR_LEN = len;
+	cb->STRIDE = 0;
+	cb->NEXTCONBK = BCM2835_RAM_BUS_ADDR(cb + 1);
+}
+
+/* dac_dma_build_point
+ *
+ * Set up the constant part of a point's control blocks. Only the SPI data
+ * words and the final link change when the point is refilled.
+ */
+static void COLD dac_dma_build_point(dac_dma_point_t *pt) {
+	const uint32_t fifo = BCM2835_PERI_BUS_ADDR(&BCM2835_SPI0->FIFO);
+	const uint32_t sink = BCM2835_RAM_BUS_ADDR(&dac_dma_sink);
+	BCM2835_DMA_CB_TypeDef *cb = pt->cb;
+	int chip, ch;
+
+	dac_dma_cb(cb++, BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_PWM)
+		| BCM2835_DMA_TI_DEST_DREQ,
+		BCM2835_RAM_BUS_ADDR(&dac_dma_pace_word),
+		BCM2835_PERI_BUS_ADDR(&BCM2835_PWM->FIF1), 4);
+
+	dac_dma_cb(cb++, 0, BCM2835_RAM_BUS_ADDR(&dac_ldac_mask),
+		BCM2835_PERI_BUS_ADDR(&BCM2835_GPIO->GPCLR0), 4);
+
+	dac_dma_cb(cb++, 0, BCM2835_RAM_BUS_ADDR(&pt->range),
+		BCM2835_PERI_BUS_ADDR(&BCM2835_PWM->RNG1), 4);
+
+	dac_dma_cb(cb++, 0, BCM2835_RAM_BUS_ADDR(&dac_ldac_mask),
+		BCM2835_PERI_BUS_ADDR(&BCM2835_GPIO->GPSET0), 4);
+
+	for (chip = 0; chip < 3; chip++) {
+		dac_dma_cb(cb++, BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC,
+			BCM2835_RAM_BUS_ADDR(dac_dma_select[chip]),
+			BCM2835_PERI_BUS_ADDR(&BCM2835_GPIO->GPSET0), 16);
+
+		for (ch = 0; ch < 2; ch++) {
+			dac_dma_cb(cb++, BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_TX)
+				| BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC,
+				BCM2835_RAM_BUS_ADDR(&pt->spi[4 * chip + 2 * ch]), fifo, 8);
+			dac_dma_cb(cb++, BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_RX)
+				| BCM2835_DMA_TI_SRC_DREQ, fifo, sink, 4);
+		}
+	}
+
+	for (ch = 0; ch < 6; ch++)
+		pt->spi[2 * ch] = SPI_DMA_HEADER;
+}
+
+/* dac_dma_encode
+ *
+ * Transform a point and encode its six MCP49x2 command words. The word
+ * order is X, Y (MCP4922), I, R (MCP4902 #1), G, B (MCP4902 #2).
+ */
+#if DAC_BUFFER_ENCODED
+static void dac_dma_encode(uint32_t *spi, encoded_point_t *point) {
+	/* Already done by the producer; just reorder and byte-swap. */
+	spi[1] = SPI_DMA_WORD(point->word[ENC_X]);
+	spi[3] = SPI_DMA_WORD(point->word[ENC_Y]);
+	spi[5] = SPI_DMA_WORD(point->word[ENC_I]);
+	spi[7] = SPI_DMA_WORD(point->word[ENC_R]);
+	spi[9] = SPI_DMA_WORD(point->word[ENC_G]);
+	spi[11] = SPI_DMA_WORD(point->word[ENC_B]);
+}
+#else
+static void dac_dma_encode(uint32_t *spi, packed_point_t *point) {
+	int32_t xi = point->x, yi = point->y;
+	int32_t x = transform_clamp(translate_x(xi, yi));
+	int32_t y = transform_clamp(translate_y(xi, yi));
+
+	uint32_t intensity = UNPACK_I(point) >> 8;
+	uint32_t red = (point->irg >> 16) & 0xFF;
+	uint32_t green = (point->irg >> 4) & 0xFF;
+	uint32_t blue = (point->bf >> 4) & 0xFF;
+
+	spi[1] = SPI_DMA_WORD(MASK_XY(x) | 0x3000 | (0<<15));
+	spi[3] = SPI_DMA_WORD(MASK_XY(y) | 0x3000 | (1<<15));
+	spi[5] = SPI_DMA_WORD((intensity << 4) | 0x3000 | (0<<15));
+	spi[7] = SPI_DMA_WORD((red << 4) | 0x3000 | (1<<15));
+	spi[9] = SPI_DMA_WORD((green << 4) | 0x3000 | (0<<15));
+	spi[11] = SPI_DMA_WORD((blue << 4) | 0x3000 | (1<<15));
+}
+#endif
+
+/* dac_dma_fill_block
+ *
+ * Move up to one block's worth of points out of dac_buffer into the next
+ * free DMA block, and link it onto the end of the chain. Nothing is moved
+ * unless at least min_points are waiting. Returns the number of points
+ * moved.
+ */
+static int dac_dma_fill_block(int min_points) {
+	struct dac_dma_block *blk = &dac_dma_blocks[dac_dma_fill];
+	int i, n = 0;
+
+	if (dac_dma_queued >= DAC_DMA_BLOCKS)
+		return 0;
+
+	if (dac_consume_available() < min_points)
+		return 0;
+
+	while (n < DAC_DMA_BLOCK_POINTS) {
+		dac_buffer_point_t *src;
+		int avail = dac_consume_request(&src);
+		if (avail <= 0)
+			break;
+
+		if (avail > DAC_DMA_BLOCK_POINTS - n)
+			avail = DAC_DMA_BLOCK_POINTS - n;
+
+		for (i = 0; i < avail; i++) {
+			dac_dma_point_t *pt = &blk->points[n + i];
+			dac_dma_encode(pt->spi, src + i);
+			pt->range = dac_clock_next_period(&dac_dma_clock);
+
+			/* Points are encoded in play order, so an in-band
+			 * rate change can be applied right here. */
+			if (DAC_BUFFER_CONTROL(src + i) & DAC_CTRL_RATE_CHANGE) {
+				int pps = dac_rate_pop();
+				if (pps > 0)
+					dac_clock_set_rate(&dac_dma_clock, DAC_DMA_PWM_HZ, pps);
+			}
+			pt->cb[DAC_DMA_CB_PER_POINT - 1].NEXTCONBK =
+				BCM2835_RAM_BUS_ADDR(pt + 1);
+		}
+
+		dac_consume_advance(avail);
+		n += avail;
+	}
+
+	if (!n)
+		return 0;
+
+	dac_dma_last_xy[0] = blk->points[n - 1].spi[1];
+	dac_dma_last_xy[1] = blk->points[n - 1].spi[3];
+
+	blk->points[n - 1].cb[DAC_DMA_CB_PER_POINT - 1].NEXTCONBK =
+		BCM2835_RAM_BUS_ADDR(&blk->done);
+	blk->done.NEXTCONBK = 0;
+	blk->seq = ++dac_dma_seq;
+	blk->npoints = n;
+	memory_barrier();
+
+	/* Link onto the block before us. If the engine has already loaded
+	 * that block's final control block, it will stop, and
+	 * dac_dma_poll() will restart it from here. */
+	if (dac_dma_queued) {
+		int prev = (dac_dma_fill + DAC_DMA_BLOCKS - 1) % DAC_DMA_BLOCKS;
+		dac_dma_blocks[prev].done.NEXTCONBK =
+			BCM2835_RAM_BUS_ADDR(&blk->points[0]);
+		memory_barrier();
+	}
+
+	dac_dma_fill = (dac_dma_fill + 1) % DAC_DMA_BLOCKS;
+	dac_dma_queued++;
+
+	return n;
+}
+
+/* dac_dma_retire_blocks
+ *
+ * Release every block whose completion marker has been written.
+ */
+static void dac_dma_retire_blocks(void) {
+	uint32_t done = dac_dma_done_seq;
+
+	while (dac_dma_queued) {
+		struct dac_dma_block *blk = &dac_dma_blocks[dac_dma_retire];
+		if ((int32_t)(done - blk->seq) < 0)
+			break;
+
+		dac_count_points(blk->npoints);
+		dac_dma_retire = (dac_dma_retire + 1) % DAC_DMA_BLOCKS;
+		dac_dma_queued--;
+	}
+}
+
+static void dac_dma_kick(void) {
+	DMA->CONBLK_AD = BCM2835_RAM_BUS_ADDR(&dac_dma_blocks[dac_dma_retire].points[0]);
+	DMA->CS = DMA_CS_GO;
+}
+
+/* dac_dma_starve
+ *
+ * The chain has run dry, but the underflow policy says to keep going.
+ * The first time, play a single blank point - at the last position, or at
+ * the park position - and then leave the channel idle until points arrive.
+ * Starvation is timed with the system timer and converted to periods.
+ */
+static void dac_dma_starve(void) {
+	uint32_t now = BCM2835_ST->CLO;
+
+	if (!dac_dma_starving) {
+		struct dac_dma_block *blk = &dac_dma_blocks[dac_dma_fill];
+		dac_dma_point_t *pt = &blk->points[0];
+
+		if (dac_underflow.policy == DAC_UNDERFLOW_PARK) {
+			pt->spi[1] = SPI_DMA_WORD(dac_underflow.park[0]);
+			pt->spi[3] = SPI_DMA_WORD(dac_underflow.park[1]);
+		} else {
+			pt->spi[1] = dac_dma_last_xy[0];
+			pt->spi[3] = dac_dma_last_xy[1];
+		}
+		pt->spi[5] = SPI_DMA_WORD(0x3000 | (0<<15));
+		pt->spi[7] = SPI_DMA_WORD(0x3000 | (1<<15));
+		pt->spi[9] = SPI_DMA_WORD(0x3000 | (0<<15));
+		pt->spi[11] = SPI_DMA_WORD(0x3000 | (1<<15));
+		pt->range = dac_dma_clock.ticks;
+		pt->cb[DAC_DMA_CB_PER_POINT - 1].NEXTCONBK =
+			BCM2835_RAM_BUS_ADDR(&blk->done);
+
+		/* Not a real point, so it isn't counted as played. */
+		blk->done.NEXTCONBK = 0;
+		blk->seq = ++dac_dma_seq;
+		blk->npoints = 0;
+		memory_barrier();
+
+		dac_dma_fill = (dac_dma_fill + 1) % DAC_DMA_BLOCKS;
+		dac_dma_queued++;
+		dac_dma_kick();
+
+		dac_dma_starving = 1;
+		dac_dma_starve_start = now;
+		dac_underflow.count++;
+	}
+
+	uint32_t periods = (uint64_t)(now - dac_dma_starve_start)
+		* dac_current_pps / 1000000;
+	dac_underflow.starved += periods - dac_underflow.current;
+	dac_underflow.current = periods;
+	if (periods > dac_underflow.longest)
+		dac_underflow.longest = periods;
+}
+
+/* dac_dma_poll
+ *
+ * Main loop hook: retire played blocks, top the chain back up, and
+ * restart the channel if it ran off the end of the chain.
+ */
+static void dac_dma_poll(void) {
+	if (!dac_dma_running)
+		return;
+
+	dac_dma_retire_blocks();
+
+	/* Only hand over partial blocks when we are about to run dry. */
+	while (dac_dma_fill_block(dac_dma_queued > 1 ? DAC_DMA_BLOCK_POINTS : 1))
+		dac_dma_starving = 0;
+
+	if (!dac_dma_starving)
+		dac_underflow.current = 0;
+
+	uint32_t cs = DMA->CS;
+	if (cs & BCM2835_DMA_CS_ERROR) {
+		outputf("dac: dma error %08x", DMA->DEBUG);
+		dac_stop_underflow();
+		return;
+	}
+
+	if (cs & BCM2835_DMA_CS_ACTIVE)
+		return;
+
+	/* The channel stopped: either we linked the next block in too late,
+	 * or there is nothing left to play. */
+	dac_dma_retire_blocks();
+	if (dac_dma_queued)
+		dac_dma_kick();
+	else if (dac_underflow.policy == DAC_UNDERFLOW_STOP)
+		dac_stop_underflow();
+	else
+		dac_dma_starve();
+}
+
+/* dac_dma_set_rate
+ *
+ * Change the length of the PWM period that paces each point. Points that
+ * are already in DMA blocks keep the period they were encoded with.
+ */
+void dac_dma_set_rate(int points_per_second) {
+	dac_clock_set_rate(&dac_dma_clock, DAC_DMA_PWM_HZ, points_per_second);
+	if (!dac_dma_running)
+		BCM2835_PWM->RNG1 = dac_dma_clock.ticks;
+}
+
+/* dac_dma_fullness
+ *
+ * Return the number of points held by the DMA engine, beyond those still
+ * in dac_buffer.
+ */
+int dac_dma_fullness(void) {
+	int i, n = 0;
+	for (i = 0; i < dac_dma_queued; i++)
+		n += dac_dma_blocks[(dac_dma_retire + i) % DAC_DMA_BLOCKS].npoints;
+	return n;
+}
+
+/* dac_dma_start
+ *
+ * Prime the DMA blocks from dac_buffer, hand SPI0 to the DMA controller,
+ * and start the PWM timebase. Returns -1 if there was nothing to play.
+ */
+int dac_dma_start(void) {
+	DMA->CS = BCM2835_DMA_CS_RESET;
+	dac_dma_set_rate(dac_current_pps);
+
+	dac_dma_fill = 0;
+	dac_dma_retire = 0;
+	dac_dma_queued = 0;
+	dac_dma_done_seq = dac_dma_seq;
+	dac_dma_starving = 0;
+
+	while (dac_dma_fill_block(1))
+		;
+
+	if (!dac_dma_queued)
+		return -1;
+
+	/* SPI0 in DMA mode, automatically releasing /CS after each word. The
+	 * RX DREQ fires as soon as a full word has come back. */
+	BCM2835_SPI0->CS = BCM2835_SPI0_CS_CLEAR;
+	BCM2835_SPI0->DC = (0x30 << 24) | (0x01 << 16) | (0x10 << 8) | 0x20;
+	BCM2835_SPI0->CS = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS;
+
+	/* One PWM FIFO word per point: the DREQ threshold of 1 keeps the FIFO
+	 * empty, so each pacing write waits for the previous period to end. */
+	BCM2835_PWM->CTL = BCM2835_PWM_CTL_CLRF1;
+	BCM2835_PWM->DMAC = BCM2835_PWM_DMAC_ENAB | BCM2835_PWM_DMAC_PANIC(1)
+		| BCM2835_PWM_DMAC_DREQ(1);
+	BCM2835_PWM->CTL = BCM2835_PWM_CTL_USEF1 | BCM2835_PWM_CTL_PWEN1;
+
+	dac_dma_running = 1;
+	dac_dma_kick();
+
+	return 0;
+}
+
+/* dac_dma_stop
+ *
+ * Halt the DMA channel and the timebase, and give SPI0 back to the
+ * polled writers in mcp49x2.c.
+ */
+void dac_dma_stop(void) {
+	if (!dac_dma_running)
+		return;
+
+	dac_dma_running = 0;
+
+	DMA->CS = BCM2835_DMA_CS_ABORT;
+	DMA->CS = BCM2835_DMA_CS_RESET;
+
+	BCM2835_PWM->DMAC = 0;
+	BCM2835_PWM->CTL = BCM2835_PWM_CTL_CLRF1;
+
+	BCM2835_SPI0->CS = BCM2835_SPI0_CS_CLEAR;
+
+	dac_dma_queued = 0;
+}
+
+/* dac_dma_init
+ *
+ * Build the static parts of the control block chains, and set up the PWM
+ * clock. Called once from dac_init().
+ */
+void COLD dac_dma_init(void) {
+	int i, j;
+
+	/* MCP4922, MCP4902 #1, MCP4902 #2; see SELECT_MCP49xx in
+	 * fiq_handler.S */
+	dac_dma_select[0][0] = 1 << HC139_B_GPIO_PIN;
+	dac_dma_select[0][3] = 1 << HC139_A_GPIO_PIN;
+	dac_dma_select[1][0] = 1 << HC139_A_GPIO_PIN;
+	dac_dma_select[1][3] = 1 << HC139_B_GPIO_PIN;
+	dac_dma_select[2][3] = (1 << HC139_A_GPIO_PIN) | (1 << HC139_B_GPIO_PIN);
+
+	for (i = 0; i < DAC_DMA_BLOCKS; i++) {
+		struct dac_dma_block *blk = &dac_dma_blocks[i];
+		for (j = 0; j < DAC_DMA_BLOCK_POINTS; j++)
+			dac_dma_build_point(&blk->points[j]);
+
+		dac_dma_cb(&blk->done, 0, BCM2835_RAM_BUS_ADDR(&blk->seq),
+			BCM2835_RAM_BUS_ADDR(&dac_dma_done_seq), 4);
+		blk->done.NEXTCONBK = 0;
+	}
+
+	PUT32(BCM2835_DMA_ENABLE, GET32(BCM2835_DMA_ENABLE) | (1 << DAC_DMA_CHANNEL));
+	DMA->CS = BCM2835_DMA_CS_RESET;
+
+	/* PWM clock: PLLD / DAC_DMA_PWM_DIVIDER */
+	BCM2835_PWM->CTL = 0;
+	BCM2835_CM_PWM->CTL = BCM2835_CM_PASSWD | BCM2835_CM_SRC_PLLD;
+	while (BCM2835_CM_PWM->CTL & BCM2835_CM_BUSY)
+		;
+	BCM2835_CM_PWM->DIV = BCM2835_CM_PASSWD | (DAC_DMA_PWM_DIVIDER << 12);
+	BCM2835_CM_PWM->CTL = BCM2835_CM_PASSWD | BCM2835_CM_ENAB | BCM2835_CM_SRC_PLLD;
+}
+
+INITIALIZER(poll, dac_dma_poll);
@@ -0,0 +1,108 @@
+/* Frame-mode output
+ *
+ * In streaming mode, any gap in the producer empties the point ring and
+ * stops the DAC. In frame mode the producer instead hands over whole
+ * frames, and the output engine loops the current frame until the next
+ * one is committed, so a slow SD read or a burst of OSC traffic just
+ * means the current frame is shown a little longer.
+ */
+
+#include <serial.h>
+#include <attrib.h>
+#include <hardware.h>
+
+#include <dac_frame.h>
+
+static dac_buffer_point_t dac_frames[DAC_FRAME_COUNT][DAC_FRAME_MAX_POINTS];
+
+dac_frame_out_t dac_frame_out;
+
+/* Frame the producer is currently filling, or -1 */
+static int dac_frame_fill;
+
+/* dac_frame_reset
+ *
+ * Forget all frames. Called from dac_prepare().
+ */
+void dac_frame_reset(void) {
+	dac_frame_out.base = 0;
+	dac_frame_out.npoints = 0;
+	dac_frame_out.pos = 0;
+	dac_frame_out.loops_left = 0;
+	dac_frame_out.pending = 0;
+	dac_frame_out.repeats = 0;
+	dac_frame_fill = -1;
+}
+
+/* dac_frame_get_buffer
+ *
+ * Return a frame buffer of DAC_FRAME_MAX_POINTS points for the producer
+ * to fill. The same buffer is returned until it is committed.
+ */
+dac_buffer_point_t *dac_frame_get_buffer(void) {
+	dac_buffer_point_t *pending, *base;
+	int i;
+
+	if (dac_frame_fill >= 0)
+		return dac_frames[dac_frame_fill];
+
+	/* The FIQ may move pending into base at any time. Reading pending
+	 * first means that if it does so between the two reads, both reads
+	 * see the new frame, and the old one is free by then anyway; the
+	 * other way round could miss the frame being shown. */
+	pending = dac_frame_out.pending;
+	memory_barrier();
+	base = *(dac_buffer_point_t * volatile *)&dac_frame_out.base;
+
+	for (i = 0; i < DAC_FRAME_COUNT; i++) {
+		if (dac_frames[i] != base && dac_frames[i] != pending) {
+			dac_frame_fill = i;
+			return dac_frames[i];
+		}
+	}
+
+	/* Can't happen with three frames. */
+	return 0;
+}
+
+/* dac_frame_commit
+ *
+ * Hand the frame from dac_frame_get_buffer() to the output engine, to be
+ * shown at least loops times once it comes up. Returns -1 if a committed
+ * frame is still waiting to be shown; the producer should keep its frame
+ * and try again later.
+ */
+int dac_frame_commit(int npoints, int loops) {
+	if (dac_frame_fill < 0 || npoints <= 0 || npoints > DAC_FRAME_MAX_POINTS)
+		return -1;
+
+	if (dac_frame_out.pending)
+		return -1;
+
+	if (loops < 1)
+		loops = 1;
+
+	dac_frame_out.pending_npoints = npoints;
+	dac_frame_out.pending_loops = loops;
+	memory_barrier();
+	dac_frame_out.pending = dac_frames[dac_frame_fill];
+	dac_frame_fill = -1;
+
+	return 0;
+}
+
+/* dac_frame_start
+ *
+ * Make the committed frame current, ready for the output engine to start.
+ * Returns -1 if no frame has been committed yet.
+ */
+int dac_frame_start(void) {
+	if (!dac_frame_out.pending)
+		return -1;
+
+	dac_frame_out.pos = 0;
+	dac_frame_out.loops_left = 0;
+	dac_frame_wrap(&dac_frame_out);
+
+	return 0;
+}
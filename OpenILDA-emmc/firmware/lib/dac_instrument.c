@@ -0,0 +1,42 @@
+/* FIQ timing instrumentation
+ *
+ * The statistics themselves are updated from the FIQ handlers; this is
+ * just the readout side.
+ */
+
+#include <string.h>
+#include <serial.h>
+#include <hardware.h>
+
+#include <dac_instrument.h>
+
+volatile dac_fiq_stats_t dac_fiq_stats;
+
+/* dac_fiq_stats_reset
+ *
+ * Clear all counters, histograms and maxima.
+ */
+void dac_fiq_stats_reset(void) {
+	__disable_fiq();
+	memset((void *)&dac_fiq_stats, 0, sizeof(dac_fiq_stats));
+	__enable_fiq();
+}
+
+static void dac_fiq_print_hist(const char *name, volatile uint32_t *hist) {
+	outputf("fiq %s: %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", name,
+		hist[0], hist[1], hist[2], hist[3], hist[4], hist[5], hist[6],
+		hist[7], hist[8], hist[9], hist[10], hist[11], hist[12],
+		hist[13], hist[14], hist[15]);
+}
+
+/* dac_fiq_stats_print
+ *
+ * Dump the full histograms to the serial port.
+ */
+void dac_fiq_stats_print(void) {
+	outputf("fiq: n %d dur max %d late max %d missed %d",
+		dac_fiq_stats.count, dac_fiq_stats.max_duration,
+		dac_fiq_stats.max_lateness, dac_fiq_stats.missed);
+	dac_fiq_print_hist("dur", dac_fiq_stats.duration_hist);
+	dac_fiq_print_hist("late", dac_fiq_stats.lateness_hist);
+}
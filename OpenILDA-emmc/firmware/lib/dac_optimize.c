@@ -0,0 +1,173 @@
+/* Scanner-aware point rate optimizer
+ *
+ * Shows are authored at one point rate, which has to be slow enough for
+ * the tightest corner in them; long straight runs could go much faster.
+ * This sits between the file decoder and dac_store_points(), and plays
+ * each window of DAC_OPT_WINDOW points as fast as a simple galvo model
+ * allows, but never slower than the rate the show was set to play at
+ * (dac_nominal_pps) nor faster than the DAC can go (dac_max_rate).
+ *
+ * The model limits each axis's step per point (speed) and the change of
+ * step from one point to the next (acceleration). At r points per second
+ * a step of d units is d * r units/s, and a change of step of d2 units
+ * is d2 * r^2 units/s^2, so a window may run at the lowest of
+ * vmax / d and sqrt(amax / d2) over its points.
+ *
+ * Rates go out in band: the first point of a window is tagged
+ * DAC_CTRL_RATE_CHANGE, and its rate queued with dac_rate_queue(). The
+ * new rate takes effect from the next point, so the tagged point itself
+ * is counted in the window too. The first point of each batch has already
+ * been given its rate by the batch before, which couldn't see it; rises
+ * are limited to a quarter per window to keep that point's step small.
+ */
+
+#include <serial.h>
+#include <attrib.h>
+#include <stdlib.h>
+#include <dac.h>
+#include <dac_calibrate.h>
+#include <dac_optimize.h>
+
+dac_opt_t dac_opt = {
+	.vmax = DAC_OPT_DEFAULT_VMAX,
+	.amax = DAC_OPT_DEFAULT_AMAX,
+};
+
+/* The last two points seen, and the rate the DAC will be playing at once
+ * everything queued so far has been popped. */
+static int32_t dac_opt_x[2], dac_opt_y[2];
+static int dac_opt_rate;
+
+/* isqrt64
+ *
+ * Integer square root, rounded down.
+ */
+static uint32_t isqrt64(uint64_t v) {
+	uint64_t bit = 1ULL << 62, r = 0;
+
+	while (bit > v)
+		bit >>= 2;
+
+	while (bit) {
+		if (v >= r + bit) {
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return r;
+}
+
+/* dac_opt_window_rate
+ *
+ * Return the fastest rate the model allows for the largest step d1 and
+ * the largest change of step d2 in a window.
+ */
+static int dac_opt_window_rate(uint32_t d1, uint32_t d2) {
+	uint64_t rate = dac_max_rate;
+
+	if (d1 && (uint64_t)dac_opt.vmax * 1000 / d1 < rate)
+		rate = (uint64_t)dac_opt.vmax * 1000 / d1;
+
+	if (d2) {
+		uint32_t ra = isqrt64((uint64_t)dac_opt.amax * 1000000 / d2);
+		if (ra < rate)
+			rate = ra;
+	}
+
+	return rate;
+}
+
+void dac_opt_set_enabled(int enabled) {
+	dac_opt.enabled = !!enabled;
+	outputf("dac: optimizer %s", dac_opt.enabled ? "on" : "off");
+}
+
+void dac_opt_set_model(uint32_t vmax, uint32_t amax) {
+	if (!vmax || !amax)
+		return;
+
+	dac_opt.vmax = vmax;
+	dac_opt.amax = amax;
+}
+
+/* dac_opt_queue
+ *
+ * Tag p to switch to rate, if the rate queue will have it.
+ */
+static void dac_opt_queue(dac_point_t *p, int rate) {
+	if (dac_rate_queue(rate) < 0)
+		return;
+
+	p->control |= DAC_CTRL_RATE_CHANGE;
+	dac_opt_rate = rate;
+	dac_opt.changes++;
+}
+
+/* dac_opt_process
+ *
+ * Choose rates for n decoded points, in place. Off, this just brings the
+ * rate back to dac_nominal_pps, if the optimizer had changed it.
+ */
+void dac_opt_process(dac_point_t *p, int n) {
+	int k, j;
+
+	if (n <= 0 || dac_nominal_pps <= 0)
+		return;
+
+	/* Nothing queued: the DAC is at whatever it was last set to. */
+	if (!dac_rate_pending())
+		dac_opt_rate = dac_current_pps;
+	if (dac_opt_rate <= 0)
+		return;
+
+	if (!dac_opt.enabled) {
+		if (dac_opt_rate != dac_nominal_pps)
+			dac_opt_queue(p, dac_nominal_pps);
+		return;
+	}
+
+	for (k = 0; k < n; k += DAC_OPT_WINDOW) {
+		int end = k + DAC_OPT_WINDOW < n ? k + DAC_OPT_WINDOW : n;
+		uint32_t d1 = 0, d2 = 0;
+
+		for (j = k; j < end; j++) {
+			int32_t dx = p[j].x - dac_opt_x[0];
+			int32_t dy = p[j].y - dac_opt_y[0];
+			uint32_t ax = abs(dx), ay = abs(dy);
+			uint32_t ddx = abs(dx - (dac_opt_x[0] - dac_opt_x[1]));
+			uint32_t ddy = abs(dy - (dac_opt_y[0] - dac_opt_y[1]));
+
+			if (ax > d1) d1 = ax;
+			if (ay > d1) d1 = ay;
+			if (ddx > d2) d2 = ddx;
+			if (ddy > d2) d2 = ddy;
+
+			dac_opt_x[1] = dac_opt_x[0];
+			dac_opt_y[1] = dac_opt_y[0];
+			dac_opt_x[0] = p[j].x;
+			dac_opt_y[0] = p[j].y;
+		}
+
+		int rate = dac_opt_window_rate(d1, d2);
+		int cur = dac_opt_rate;
+
+		rate -= rate % 100;
+		if (rate < dac_nominal_pps)
+			rate = dac_nominal_pps;
+		if (rate > cur + (cur >> DAC_OPT_RISE_SHIFT))
+			rate = cur + (cur >> DAC_OPT_RISE_SHIFT);
+
+		if (rate < cur
+		    || rate >= cur + (cur >> DAC_OPT_HYSTERESIS_SHIFT))
+			dac_opt_queue(&p[k], rate);
+
+		dac_opt.windows++;
+		dac_opt.rate_sum += dac_opt_rate;
+	}
+
+	dac_opt.points += n;
+}
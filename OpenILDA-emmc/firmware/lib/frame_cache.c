@@ -0,0 +1,323 @@
+/* Decoded frame cache
+ *
+ * Frames are kept decoded, as packed_point_t, so that repeated frames,
+ * looped shows and recalled cues play from memory instead of being read
+ * and decoded again. The memory is split into blocks of
+ * FCACHE_BLOCK_POINTS points, and a frame holds a chain of as many as it
+ * needs, so that frames of any size share it without fragmenting it.
+ * Frames are kept in least recently used order, and the least recently
+ * used are dropped to make room for new ones.
+ *
+ * A frame is filled as it is decoded, between fcache_fill_begin() and
+ * fcache_fill_commit(), and can't be looked up until it is complete.
+ * Frames are only dropped by fcache_fill_begin(), which the player calls
+ * when it starts a frame from the file, so never while one is being read
+ * from the cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <serial.h>
+#include <frame_cache.h>
+
+typedef packed_point_t fcache_block_t[FCACHE_BLOCK_POINTS];
+
+struct fcache_entry {
+	fcache_key_t key;
+	int points;
+	uint32_t next;		/* Where the file carries on after the frame */
+	int first;		/* First block */
+	int hnext;		/* Hash chain, or free list */
+	int older, newer;	/* LRU list */
+};
+
+static struct {
+	struct fcache_entry *entry;
+	int *bucket;
+	int *block_next;	/* Block chains, and the free list */
+	fcache_block_t *block;
+	int blocks, blocks_free, bucket_mask;
+	int free_entry, free_block;
+	int newest, oldest;
+} fcache;
+
+fcache_stats_t fcache_stats;
+
+/* fcache_init
+ *
+ * Take memory for the cache, if it hasn't been already. Returns the
+ * number of blocks in it, or 0 if there wasn't enough memory.
+ */
+int fcache_init(void) {
+	size_t size, per_block;
+	char *mem = NULL;
+	int i, buckets;
+
+	if (fcache.blocks)
+		return fcache.blocks;
+
+	for (size = FCACHE_MAX_BYTES; size >= FCACHE_MIN_BYTES; size >>= 1) {
+		mem = malloc(size);
+		if (mem)
+			break;
+	}
+
+	if (!mem) {
+		outputf("fcache: no memory");
+		return 0;
+	}
+
+	/* Leave the other half for the point ring and the like. */
+	free(mem);
+	size >>= 1;
+	mem = malloc(size);
+	if (!mem)
+		return 0;
+
+	/* Each block needs an entry, a chain link and up to one bucket. */
+	per_block = sizeof(fcache_block_t) + sizeof(struct fcache_entry)
+		+ 2 * sizeof(int);
+	fcache.blocks = size / per_block;
+
+	for (buckets = 1; buckets * 2 <= fcache.blocks; buckets <<= 1)
+		;
+
+	fcache.entry = (struct fcache_entry *)mem;
+	fcache.bucket = (int *)(fcache.entry + fcache.blocks);
+	fcache.block_next = fcache.bucket + buckets;
+	fcache.block = (fcache_block_t *)(fcache.block_next + fcache.blocks);
+	fcache.bucket_mask = buckets - 1;
+
+	for (i = 0; i < buckets; i++)
+		fcache.bucket[i] = -1;
+
+	for (i = 0; i < fcache.blocks; i++) {
+		fcache.entry[i].hnext = i + 1 < fcache.blocks ? i + 1 : -1;
+		fcache.block_next[i] = i + 1 < fcache.blocks ? i + 1 : -1;
+	}
+
+	fcache.free_entry = fcache.free_block = 0;
+	fcache.blocks_free = fcache.blocks;
+	fcache.newest = fcache.oldest = -1;
+	fcache_stats.blocks = fcache.blocks;
+
+	outputf("fcache: %d KiB, %d blocks", (int)(size >> 10), fcache.blocks);
+
+	return fcache.blocks;
+}
+
+static int fcache_hash(const fcache_key_t *key) {
+	uint32_t h = key->file * 31 + key->size;
+	return (h ^ (uint32_t)key->frame * 2654435761u) & fcache.bucket_mask;
+}
+
+static int fcache_find(const fcache_key_t *key) {
+	int e = fcache.bucket[fcache_hash(key)];
+
+	while (e >= 0 && memcmp(&fcache.entry[e].key, key, sizeof(*key)))
+		e = fcache.entry[e].hnext;
+
+	return e;
+}
+
+static void fcache_lru_unlink(int e) {
+	struct fcache_entry *en = &fcache.entry[e];
+
+	if (en->newer >= 0) fcache.entry[en->newer].older = en->older;
+	else fcache.newest = en->older;
+
+	if (en->older >= 0) fcache.entry[en->older].newer = en->newer;
+	else fcache.oldest = en->newer;
+}
+
+static void fcache_lru_push(int e) {
+	struct fcache_entry *en = &fcache.entry[e];
+
+	en->newer = -1;
+	en->older = fcache.newest;
+	if (fcache.newest >= 0)
+		fcache.entry[fcache.newest].newer = e;
+	else
+		fcache.oldest = e;
+	fcache.newest = e;
+}
+
+/* fcache_release
+ *
+ * Give back an entry that isn't in the hash or LRU lists, and its blocks.
+ */
+static void fcache_release(int e) {
+	struct fcache_entry *en = &fcache.entry[e];
+	int b = en->first, n = 1;
+
+	while (fcache.block_next[b] >= 0) {
+		b = fcache.block_next[b];
+		n++;
+	}
+
+	fcache.block_next[b] = fcache.free_block;
+	fcache.free_block = en->first;
+	fcache.blocks_free += n;
+	fcache_stats.blocks_used -= n;
+
+	en->hnext = fcache.free_entry;
+	fcache.free_entry = e;
+}
+
+/* fcache_drop
+ *
+ * Take a cached frame out of the cache.
+ */
+static void fcache_drop(int e) {
+	int *link = &fcache.bucket[fcache_hash(&fcache.entry[e].key)];
+
+	while (*link != e)
+		link = &fcache.entry[*link].hnext;
+	*link = fcache.entry[e].hnext;
+
+	fcache_lru_unlink(e);
+	fcache_release(e);
+	fcache_stats.frames--;
+}
+
+/* fcache_lookup
+ *
+ * Find a frame, and make it the most recently used. Returns its entry,
+ * with its point count and where the file carries on after it, or -1.
+ */
+int fcache_lookup(const fcache_key_t *key, int *points, uint32_t *next) {
+	if (!fcache.blocks)
+		return -1;
+
+	int e = fcache_find(key);
+	if (e < 0) {
+		fcache_stats.misses++;
+		return -1;
+	}
+
+	fcache_lru_unlink(e);
+	fcache_lru_push(e);
+	fcache_stats.hits++;
+
+	*points = fcache.entry[e].points;
+	*next = fcache.entry[e].next;
+	return e;
+}
+
+/* fcache_fill_begin
+ *
+ * Make room for a frame of points points, dropping the least recently
+ * used frames as needed. Returns the entry to fill, or -1 if there is no
+ * room for it.
+ */
+int fcache_fill_begin(const fcache_key_t *key, int points, uint32_t next) {
+	int need = (points + FCACHE_BLOCK_POINTS - 1) / FCACHE_BLOCK_POINTS;
+	int e, b, i;
+
+	if (!fcache.blocks || need <= 0)
+		return -1;
+
+	while (fcache.blocks_free < need || fcache.free_entry < 0) {
+		if (fcache.oldest < 0) {
+			fcache_stats.uncached++;
+			return -1;
+		}
+
+		fcache_drop(fcache.oldest);
+		fcache_stats.evictions++;
+	}
+
+	e = fcache.free_entry;
+	fcache.free_entry = fcache.entry[e].hnext;
+
+	/* Take the chain of need blocks off the front of the free list. */
+	b = fcache.free_block;
+	for (i = 1; i < need; i++)
+		b = fcache.block_next[b];
+
+	fcache.entry[e].first = fcache.free_block;
+	fcache.free_block = fcache.block_next[b];
+	fcache.block_next[b] = -1;
+	fcache.blocks_free -= need;
+	fcache_stats.blocks_used += need;
+
+	fcache.entry[e].key = *key;
+	fcache.entry[e].points = points;
+	fcache.entry[e].next = next;
+
+	return e;
+}
+
+/* fcache_fill_commit
+ *
+ * Add a filled frame to the cache, in place of any copy already there.
+ */
+void fcache_fill_commit(int e) {
+	struct fcache_entry *en = &fcache.entry[e];
+	int old = fcache_find(&en->key);
+
+	if (old >= 0)
+		fcache_drop(old);
+
+	int *bucket = &fcache.bucket[fcache_hash(&en->key)];
+	en->hnext = *bucket;
+	*bucket = e;
+	fcache_lru_push(e);
+
+	fcache_stats.fills++;
+	fcache_stats.frames++;
+}
+
+/* fcache_fill_abort
+ *
+ * Give up on a frame that won't be filled after all.
+ */
+void fcache_fill_abort(int e) {
+	fcache_release(e);
+}
+
+void fcache_cursor_start(fcache_cursor_t *c, int entry) {
+	c->entry = entry;
+	c->block = fcache.entry[entry].first;
+	c->base = 0;
+}
+
+/* fcache_point
+ *
+ * Return point pos of the cursor's frame. Moving forwards through the
+ * frame follows the chain from where the cursor was; moving back starts
+ * it over.
+ */
+static packed_point_t *fcache_point(fcache_cursor_t *c, int pos) {
+	if (pos < c->base)
+		fcache_cursor_start(c, c->entry);
+
+	while (pos >= c->base + FCACHE_BLOCK_POINTS) {
+		c->block = fcache.block_next[c->block];
+		c->base += FCACHE_BLOCK_POINTS;
+	}
+
+	return &fcache.block[c->block][pos - c->base];
+}
+
+/* fcache_put
+ *
+ * Store n points, from point pos on, into a frame being filled.
+ */
+void fcache_put(fcache_cursor_t *c, int pos, dac_point_t *p, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		dac_pack_point(fcache_point(c, pos + i), &p[i]);
+}
+
+/* fcache_get
+ *
+ * Read n points, from point pos on, out of a cached frame.
+ */
+void fcache_get(fcache_cursor_t *c, int pos, dac_point_t *p, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		dac_unpack_point(&p[i], fcache_point(c, pos + i));
+}
@@ -1,5 +1,10 @@
+#include <stddef.h>
 #include <bcm2835.h>
 #include <spi_dac.h>
+#include <dac.h>
+#include <dac_driver.h>
+
+#if DAC_DRIVER == DAC_DRIVER_MCP49X2
 
 void inline bcm2835_spi_mcp4922_a(uint16_t data) {
 	spi_select_mcp4922();
@@ -41,3 +46,21 @@ void dac_write_all(uint16_t x, uint16_t y, uint8_t intensity, uint8_t red, uint8
 	bcm2835_spi_mcp4902_2b(blue);
 }
 
+static void mcp49x2_zero(void) {
+	dac_write_all(0x07FF, 0x07FF, 0x00, 0x00, 0x00, 0x00);
+}
+
+static void mcp49x2_write_point(int32_t x, int32_t y, uint16_t i, uint16_t r,
+				uint16_t g, uint16_t b) {
+	dac_write_all(DAC_MASK_XY(x), DAC_MASK_XY(y), i >> 8, r >> 8, g >> 8, b >> 8);
+}
+
+const dac_driver_t dac_driver = {
+	.name = DAC_DRIVER_NAME,
+	.init = NULL,
+	.zero = mcp49x2_zero,
+	.write_point = mcp49x2_write_point,
+	.fiq = DAC_DRIVER_FIQ
+};
+
+#endif /* DAC_DRIVER == DAC_DRIVER_MCP49X2 */
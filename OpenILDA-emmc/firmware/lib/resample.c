@@ -0,0 +1,126 @@
+/* Point stream resampler
+ *
+ * Converts points sampled at one rate into points at another, so that
+ * content keeps its timing whatever rate the DAC plays at. Output points
+ * are spaced step = src / out source points apart, in 16.16 fixed point.
+ * X and Y are interpolated, linearly or with a Catmull-Rom cubic through
+ * the four nearest source points; colors and the other channels are
+ * taken from the nearest source point, so that blanking edges stay sharp
+ * rather than fading in and out.
+ *
+ * The stream is processed a block at a time: resample_block() takes as
+ * many source points as it needs from a block to fill the output, and
+ * reports how many it used, so that the rest can be offered next time.
+ */
+
+#include <string.h>
+#include <resample.h>
+
+/* resample_set_rate
+ *
+ * Convert from src_pps to out_pps from here on. The stream carries on
+ * from where it was.
+ */
+void resample_set_rate(resample_t *r, int src_pps, int out_pps) {
+	r->step = ((uint64_t)src_pps << 16) / out_pps;
+	if (!r->step)
+		r->step = 1;
+}
+
+/* resample_reset
+ *
+ * Forget the stream so far; the next source point starts it over.
+ */
+void resample_reset(resample_t *r) {
+	r->phase = RESAMPLE_ONE;
+	r->primed = 0;
+}
+
+static inline int32_t resample_clamp(int32_t v) {
+	if (v > 32767) return 32767;
+	if (v < -32768) return -32768;
+	return v;
+}
+
+/* resample_cubic
+ *
+ * Catmull-Rom spline through p0..p3, at t (0.16) between p1 and p2:
+ * p1 + t/2 (c1 + t (c2 + t c3)). The coefficients need up to 19 bits, so
+ * the products are taken at 64 bits.
+ */
+static inline int32_t resample_cubic(int32_t p0, int32_t p1, int32_t p2,
+				     int32_t p3, int32_t t) {
+	int32_t c1 = p2 - p0;
+	int32_t c2 = 2 * p0 - 5 * p1 + 4 * p2 - p3;
+	int32_t c3 = 3 * (p1 - p2) + p3 - p0;
+	int64_t v;
+
+	v = ((int64_t)c3 * t >> 16) + c2;
+	v = (v * t >> 16) + c1;
+	v = v * t >> 17;
+
+	return resample_clamp(p1 + (int32_t)v);
+}
+
+static inline int32_t resample_linear(int32_t p1, int32_t p2, int32_t t) {
+	return p1 + (int32_t)((int64_t)(p2 - p1) * t >> 16);
+}
+
+/* resample_push
+ *
+ * Shift a source point into the history. The first point of a stream
+ * fills all of it, so that the stream starts from a standstill there.
+ */
+static inline void resample_push(resample_t *r, const dac_point_t *p) {
+	if (!r->primed) {
+		r->hist[0] = r->hist[1] = r->hist[2] = r->hist[3] = *p;
+		r->primed = 1;
+		return;
+	}
+
+	memmove(&r->hist[0], &r->hist[1], 3 * sizeof(r->hist[0]));
+	r->hist[3] = *p;
+}
+
+/* resample_block
+ *
+ * Produce up to max_out points into out, from up to n_in source points
+ * from in. Returns the number of points produced, and sets *used to the
+ * number of source points consumed; the output runs two source points
+ * behind the input, for the cubic's lookahead.
+ */
+int resample_block(resample_t *r, const dac_point_t *in, int n_in, int *used,
+		   dac_point_t *out, int max_out) {
+	int i = 0, o = 0;
+
+	while (o < max_out) {
+		while (r->phase >= RESAMPLE_ONE) {
+			if (i == n_in)
+				goto done;
+			resample_push(r, &in[i++]);
+			r->phase -= RESAMPLE_ONE;
+		}
+
+		const dac_point_t *h = r->hist;
+		int32_t t = r->phase;
+
+		/* Nearest for everything but X and Y */
+		out[o] = h[t < RESAMPLE_ONE / 2 ? 1 : 2];
+		out[o].control = 0;
+
+		if (r->mode == RESAMPLE_CUBIC) {
+			out[o].x = resample_cubic(h[0].x, h[1].x, h[2].x, h[3].x, t);
+			out[o].y = resample_cubic(h[0].y, h[1].y, h[2].y, h[3].y, t);
+		} else {
+			out[o].x = resample_linear(h[1].x, h[2].x, t);
+			out[o].y = resample_linear(h[1].y, h[2].y, t);
+		}
+
+		o++;
+		r->phase += r->step;
+	}
+
+done:
+	*used = i;
+	return o;
+}
@@ -0,0 +1,48 @@
+/* TLV5610 DAC backend
+ *
+ * The cold side of the backend in dac_tlv5610.h: selecting the chip and
+ * setting up its control registers, and single point writes.
+ */
+
+#include <bcm2835.h>
+#include <spi_dac.h>
+#include <dac.h>
+#include <dac_driver.h>
+
+#if DAC_DRIVER == DAC_DRIVER_TLV5610
+
+/* tlv5610_init
+ *
+ * Select HC139 output Y3 for good, and set the control registers. The
+ * DAC outputs are left alone; dac_stop() zeroes them.
+ */
+static void tlv5610_init(void) {
+	bcm2835_gpio_set(HC139_A_GPIO_PIN);
+	bcm2835_gpio_set(HC139_B_GPIO_PIN);
+
+	bcm2835_spi_write(TLV5610_CTRL0);
+	bcm2835_spi_write(TLV5610_CTRL1 | TLV5610_CTRL1_FAST);
+}
+
+static void tlv5610_write_point(int32_t x, int32_t y, uint16_t i, uint16_t r,
+				uint16_t g, uint16_t b) {
+	dac_driver_write_color(DAC_WORD_I(i), DAC_WORD_R(r), DAC_WORD_G(g),
+		DAC_WORD_B(b));
+	dac_driver_write_xy(DAC_WORD_X(x), DAC_WORD_Y(y));
+}
+
+static void tlv5610_zero(void) {
+	tlv5610_write_point(0, 0, 0, 0, 0, 0);
+	bcm2835_spi_write(TLV5610_ADDR(1));
+	bcm2835_spi_write(TLV5610_ADDR(0));
+}
+
+const dac_driver_t dac_driver = {
+	.name = DAC_DRIVER_NAME,
+	.init = tlv5610_init,
+	.zero = tlv5610_zero,
+	.write_point = tlv5610_write_point,
+	.fiq = DAC_DRIVER_FIQ
+};
+
+#endif /* DAC_DRIVER == DAC_DRIVER_TLV5610 */
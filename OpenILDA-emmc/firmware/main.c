@@ -19,6 +19,7 @@
 #include <dac_settings.h>
 
 #include <bcm2835.h>
+#include <dac_clock.h>
 
 struct {
 	volatile uint32_t time;
@@ -74,6 +75,7 @@ struct periodic_event {
 //	{ dhcp_fine_tmr, 500, "dhcp f", 25 },
 //	{ autoip_tmr, AUTOIP_TMR_INTERVAL, "autoip", 10 },
 //	{ broadcast_send, 1000, "broadcast", 10 },
+	{ dac_clock_measure, 1000000, "dac_clock", 8 },
 #if DAC_INSTRUMENT_TIME
 	{ print_dac_cycle_count, 1000000, "dac_cycle_count", 4 },
 #endif
@@ -155,7 +157,7 @@ int notmain (void)
 	playback_set_src(SRC_ILDAPLAYER);
 
 	/* Default values */
-	dac_set_rate(1000);
+	fplay_set_rate(1000);
 	ilda_set_fps_limit(5);
 
 	while(1) {
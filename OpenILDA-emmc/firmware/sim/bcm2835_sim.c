@@ -0,0 +1,380 @@
+/* Host model of the BCM2835 peripherals used by the DAC path
+ *
+ * Host versions of the routines that touch the hardware, working on the
+ * bcm2835_sim register file, and the virtual time that drives the FIQ.
+ * See bcm2835_sim.h.
+ */
+
+#include <string.h>
+#include <bcm2835.h>
+#include <spi_dac.h>
+#include <hardware.h>
+#include <dac_driver.h>
+
+#include "bcm2835_sim.h"
+
+BCM2835_SIM_TypeDef bcm2835_sim;
+sim_stats_t sim_stats;
+uint32_t sim_fiq_entry_ns;
+int sim_bare;
+
+static uint64_t sim_ns;
+static uint32_t sim_gpio_level;
+static int sim_fiq_masked = 1;
+static int sim_fiq_pending;
+static int sim_in_fiq;
+static FILE *sim_trace;
+
+/* DAC output changes during the current FIQ. A word reaches its output
+ * when it is written with LDAC low, or else at the next falling edge. */
+static int sim_dac_loaded;
+static int sim_dac_changed;
+static uint64_t sim_dac_first, sim_dac_last;
+
+static const char *const sim_cs_name[] = {
+	[SIM_CS_MCP4902_2] = "mcp4902.2",
+	[SIM_CS_MCP4902_1] = "mcp4902.1",
+	[SIM_CS_MCP4922] = "mcp4922",
+#if DAC_DRIVER == DAC_DRIVER_TLV5610
+	[SIM_CS_TLV5610] = "tlv5610"
+#else
+	[SIM_CS_NONE] = "none"
+#endif
+};
+
+/* sim_set_time
+ *
+ * Move virtual time without looking at the timer compare, and update the
+ * free-running counter to match.
+ */
+static void sim_set_time(uint64_t ns) {
+	uint64_t us = ns / 1000;
+
+	sim_ns = ns;
+	bcm2835_sim.st.CLO = (uint32_t)us;
+	bcm2835_sim.st.CHI = (uint32_t)(us >> 32);
+}
+
+/* sim_next_match
+ *
+ * Return the time at which CLO next becomes equal to C1. Writing C1 with
+ * the current CLO means it won't match until the counter wraps.
+ */
+static uint64_t sim_next_match(void) {
+	uint64_t now_us = sim_ns / 1000;
+	uint64_t d = (uint32_t)(bcm2835_sim.st.C1 - (uint32_t)now_us);
+
+	if (!d)
+		d = 1ULL << 32;
+	return (now_us + d) * 1000;
+}
+
+static void sim_dac_change(void) {
+	if (!sim_in_fiq)
+		return;
+	if (!sim_dac_changed)
+		sim_dac_first = sim_ns;
+	sim_dac_last = sim_ns;
+	sim_dac_changed = 1;
+}
+
+/* sim_fiq_dispatch
+ *
+ * Run the backend's FIQ handler for a pending match, unless FIQs are masked or one
+ * is already running; either way it stays pending until then. A match
+ * during the handler is taken as soon as it returns, just late.
+ */
+static void sim_fiq_dispatch(void) {
+	while (sim_fiq_pending && !sim_fiq_masked && !sim_in_fiq) {
+		uint64_t start = sim_ns, len;
+
+		sim_fiq_pending = 0;
+		sim_in_fiq = 1;
+		sim_dac_changed = 0;
+		if (sim_trace)
+			fprintf(sim_trace, "%llu fiq\n", (unsigned long long)sim_ns);
+		sim_advance(sim_fiq_entry_ns);
+		dac_driver.fiq();
+		sim_in_fiq = 0;
+
+		if (sim_dac_changed) {
+			if (sim_dac_last - sim_dac_first > sim_stats.skew_max_ns)
+				sim_stats.skew_max_ns = sim_dac_last - sim_dac_first;
+			if (sim_dac_last - start > sim_stats.lag_max_ns)
+				sim_stats.lag_max_ns = sim_dac_last - start;
+		}
+
+		len = sim_ns - start;
+		sim_stats.fiqs++;
+		sim_stats.fiq_ns += len;
+		if (len > sim_stats.fiq_max_ns)
+			sim_stats.fiq_max_ns = len;
+	}
+}
+
+void sim_reset(void) {
+	memset(&bcm2835_sim, 0, sizeof(bcm2835_sim));
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	sim_gpio_level = 0;
+	sim_fiq_masked = 1;
+	sim_fiq_pending = 0;
+	sim_in_fiq = 0;
+	sim_dac_loaded = 0;
+	sim_set_time(0);
+}
+
+uint64_t sim_now_ns(void) {
+	return sim_ns;
+}
+
+/* sim_advance_to
+ *
+ * Run virtual time forward to ns, taking every timer match on the way. A
+ * match only raises the FIQ if it is enabled in the interrupt controller
+ * at that moment, as the C1 status bit is always cleared before that is
+ * turned on.
+ */
+void sim_advance_to(uint64_t ns) {
+	while (sim_ns < ns) {
+		uint64_t match = sim_next_match();
+
+		if (match > ns) {
+			sim_set_time(ns);
+			break;
+		}
+
+		sim_set_time(match);
+		if (bcm2835_sim.irq.FIQ_CONTROL & 0x80) {
+			if (sim_fiq_pending || sim_fiq_masked || sim_in_fiq)
+				sim_stats.fiq_deferred++;
+			sim_fiq_pending = 1;
+			sim_fiq_dispatch();
+		}
+	}
+}
+
+void sim_advance(uint64_t ns) {
+	sim_advance_to(sim_ns + ns);
+}
+
+void sim_trace_open(FILE *f) {
+	sim_trace = f;
+}
+
+/* bcm2835_sim_bus_addr
+ *
+ * Map a register in the register file to the bus address the DMA engine
+ * would see it at on the target, so that control blocks built on the host
+ * hold the same addresses. Returns 0 for anything else.
+ */
+uint32_t bcm2835_sim_bus_addr(const volatile void *reg) {
+	static const struct {
+		const volatile void *file;
+		uint32_t size;
+		uint32_t base;
+	} map[] = {
+		{ &bcm2835_sim.st, sizeof(bcm2835_sim.st), BCM2835_ST_BASE },
+		{ &bcm2835_sim.irq, sizeof(bcm2835_sim.irq), BCM2835_IRQ_BASE },
+		{ &bcm2835_sim.gpio, sizeof(bcm2835_sim.gpio), BCM2835_GPIO_BASE },
+		{ &bcm2835_sim.spi0, sizeof(bcm2835_sim.spi0), BCM2835_SPI0_BASE },
+		{ &bcm2835_sim.pwm, sizeof(bcm2835_sim.pwm), BCM2835_PWM_BASE },
+		{ &bcm2835_sim.cm_pwm, sizeof(bcm2835_sim.cm_pwm), BCM2835_CM_PWM_BASE },
+		{ &bcm2835_sim.uart1, sizeof(bcm2835_sim.uart1), BCM2835_UART1_BASE },
+		{ &bcm2835_sim.dma_enable, 4, BCM2835_DMA_BASE + 0xFF0 },
+	};
+	uintptr_t a = (uintptr_t)reg;
+	uintptr_t dma = (uintptr_t)bcm2835_sim.dma;
+	unsigned i;
+
+	/* DMA channels are 0x100 apart on the target. */
+	if (a >= dma && a < dma + sizeof(bcm2835_sim.dma)) {
+		uint32_t ch = (a - dma) / sizeof(bcm2835_sim.dma[0]);
+		uint32_t off = (a - dma) % sizeof(bcm2835_sim.dma[0]);
+		return BCM2835_DMA_BASE + (ch << 8) + off
+			- BCM2835_PERI_BASE + BCM2835_PERI_BUS_BASE;
+	}
+
+	for (i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		uintptr_t file = (uintptr_t)map[i].file;
+		if (a >= file && a < file + map[i].size)
+			return a - file + map[i].base
+				- BCM2835_PERI_BASE + BCM2835_PERI_BUS_BASE;
+	}
+
+	return 0;
+}
+
+/* vectors.s */
+
+void __disable_fiq(void) {
+	sim_fiq_masked = 1;
+}
+
+void __enable_fiq(void) {
+	sim_fiq_masked = 0;
+	sim_fiq_dispatch();
+}
+
+void __disable_irq(void) {
+}
+
+void __enable_irq(void) {
+}
+
+void memory_barrier(void) {
+}
+
+/* fiq_handler.S: c_fiq_handler keeps nothing in banked registers. */
+void dac_fiq_seed(void) {
+}
+
+/* bcm2835_asm.S */
+
+uint64_t bcm2835_st_read(void) {
+	return ((uint64_t)bcm2835_sim.st.CHI << 32) | bcm2835_sim.st.CLO;
+}
+
+void bcm2835_st_delay(uint64_t offset_micros, uint64_t micros) {
+	uint64_t until = (offset_micros + micros) * 1000;
+
+	if (until > sim_ns)
+		sim_advance_to(until);
+}
+
+void bcm2835_gpio_fsel(uint8_t pin, uint8_t mode) {
+	volatile uint32_t *fsel = &bcm2835_sim.gpio.GPFSEL0 + pin / 10;
+	uint8_t shift = (pin % 10) * 3;
+
+	*fsel = (*fsel & ~(BCM2835_GPIO_FSEL_MASK << shift)) | (mode << shift);
+}
+
+/* bcm2835_spi_write
+ *
+ * Shift one 16-bit word out, holding the CPU until it is done as the asm
+ * version does: 16 SPI clocks at the core clock over the CLK divider.
+ */
+void bcm2835_spi_write(uint16_t data) {
+	uint32_t div = bcm2835_sim.spi0.CLK & 0xFFFF;
+	int cs = (sim_gpio_level >> HC139_A_GPIO_PIN & 1)
+		| (sim_gpio_level >> HC139_B_GPIO_PIN & 1) << 1;
+	uint64_t ns;
+
+	if (sim_bare) {
+		bcm2835_sim.spi0.FIFO = data;
+		return;
+	}
+
+	if (!div)
+		div = 65536;
+	ns = 16ULL * div * 1000000000ULL / SIM_CORE_CLOCK_HZ;
+
+	if (sim_trace)
+		fprintf(sim_trace, "%llu spi %s %04x\n",
+			(unsigned long long)sim_ns, sim_cs_name[cs], data);
+
+	bcm2835_sim.spi0.FIFO = data;
+	sim_stats.spi_words++;
+	sim_stats.spi_ns += ns;
+	sim_advance(ns);
+
+	if (sim_gpio_level & (1 << LDAC_GPIO_PIN))
+		sim_dac_loaded = 1;
+	else
+		sim_dac_change();
+}
+
+/* bcm2835.c */
+
+static void sim_gpio_change(uint8_t pin, int on) {
+	uint32_t old = sim_gpio_level;
+
+	if (on)
+		sim_gpio_level |= 1 << pin;
+	else
+		sim_gpio_level &= ~(1 << pin);
+
+	if (sim_bare)
+		return;
+
+	*(volatile uint32_t *)&bcm2835_sim.gpio.GPLEV0 = sim_gpio_level;
+	if (on)
+		bcm2835_sim.gpio.GPSET0 = 1 << pin;
+	else
+		bcm2835_sim.gpio.GPCLR0 = 1 << pin;
+
+	if (pin == LDAC_GPIO_PIN && !on && (old & (1 << pin))
+	    && sim_dac_loaded) {
+		sim_dac_loaded = 0;
+		sim_dac_change();
+	}
+
+	if (sim_trace && old != sim_gpio_level
+	    && (pin == LDAC_GPIO_PIN || pin == SHUTTER_GPIO_PIN))
+		fprintf(sim_trace, "%llu gpio %d %d\n",
+			(unsigned long long)sim_ns, pin, on);
+}
+
+void bcm2835_gpio_set(uint8_t pin) {
+	sim_gpio_change(pin, 1);
+}
+
+void bcm2835_gpio_clr(uint8_t pin) {
+	sim_gpio_change(pin, 0);
+}
+
+void bcm2835_gpio_write(uint8_t pin, uint8_t on) {
+	sim_gpio_change(pin, on);
+}
+
+uint8_t bcm2835_gpio_lev(uint8_t pin) {
+	return (sim_gpio_level >> pin) & 1;
+}
+
+void bcm2835_spi_begin(void) {
+	bcm2835_gpio_fsel(RPI_GPIO_P1_26, BCM2835_GPIO_FSEL_ALT0);
+	bcm2835_gpio_fsel(RPI_GPIO_P1_24, BCM2835_GPIO_FSEL_ALT0);
+	bcm2835_gpio_fsel(RPI_GPIO_P1_21, BCM2835_GPIO_FSEL_ALT0);
+	bcm2835_gpio_fsel(RPI_GPIO_P1_19, BCM2835_GPIO_FSEL_ALT0);
+	bcm2835_gpio_fsel(RPI_GPIO_P1_23, BCM2835_GPIO_FSEL_ALT0);
+	bcm2835_sim.spi0.CS = 0;
+}
+
+void bcm2835_spi_setBitOrder(uint8_t order) {
+}
+
+void bcm2835_spi_setClockDivider(uint16_t divider) {
+	bcm2835_sim.spi0.CLK = divider;
+}
+
+void bcm2835_spi_setDataMode(uint8_t mode) {
+	bcm2835_sim.spi0.CS = (bcm2835_sim.spi0.CS
+		& ~(BCM2835_SPI0_CS_CPOL | BCM2835_SPI0_CS_CPHA)) | (mode << 2);
+}
+
+void bcm2835_spi_chipSelect(uint8_t cs) {
+	bcm2835_sim.spi0.CS = (bcm2835_sim.spi0.CS & ~BCM2835_SPI0_CS_CS) | cs;
+}
+
+void bcm2835_spi_setChipSelectPolarity(uint8_t cs, uint8_t active) {
+	uint8_t shift = 21 + cs;
+
+	bcm2835_sim.spi0.CS = (bcm2835_sim.spi0.CS & ~(1 << shift))
+		| (active << shift);
+}
+
+/* mcp49x2_asm.S */
+
+void spi_select_mcp4922(void) {
+	bcm2835_gpio_clr(HC139_A_GPIO_PIN);
+	bcm2835_gpio_set(HC139_B_GPIO_PIN);
+}
+
+void spi_select_mcp4902_1(void) {
+	bcm2835_gpio_set(HC139_A_GPIO_PIN);
+	bcm2835_gpio_clr(HC139_B_GPIO_PIN);
+}
+
+void spi_select_mcp4902_2(void) {
+	bcm2835_gpio_clr(HC139_A_GPIO_PIN);
+	bcm2835_gpio_clr(HC139_B_GPIO_PIN);
+}
@@ -0,0 +1,62 @@
+#ifndef BCM2835_SIM_H_
+#define BCM2835_SIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Host model of the BCM2835 peripherals used by the DAC path
+ *
+ * The register file itself (bcm2835_sim, see bcm2835.h) is plain memory.
+ * This stands in for the low-level drivers that touch it - the asm
+ * routines in bcm2835_asm.S, mcp49x2_asm.S and vectors.s, and the GPIO
+ * and SPI setup in bcm2835.c - and gives them timing: everything runs in
+ * virtual time, which only moves when the model says so. Whenever it
+ * moves past the System Timer C1 compare value with the FIQ enabled and
+ * unmasked, the FIQ handler is called at exactly that time.
+ */
+
+/* SPI0 is clocked from the 250MHz core clock. */
+#define SIM_CORE_CLOCK_HZ		250000000
+
+/* HC139 outputs, as selected by spi_select_*() */
+#define SIM_CS_MCP4902_2		0
+#define SIM_CS_MCP4902_1		1
+#define SIM_CS_MCP4922			2
+#define SIM_CS_NONE				3
+#define SIM_CS_TLV5610			3
+
+typedef struct sim_stats {
+	uint64_t spi_words;
+	uint64_t spi_ns;		/* time spent shifting words out */
+	uint64_t fiqs;
+	uint64_t fiq_ns;		/* time spent in the FIQ handler */
+	uint64_t fiq_max_ns;
+	uint64_t fiq_deferred;	/* matches that waited for the FIQ mask */
+	uint64_t skew_max_ns;	/* first to last DAC output change in a FIQ */
+	uint64_t lag_max_ns;	/* FIQ start to the last output change */
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+/* Extra time from timer match to the first instruction of the handler. */
+extern uint32_t sim_fiq_entry_ns;
+
+/* With this set, SPI writes and GPIO changes only update the register
+ * file: no time passes, and nothing is traced or counted. This is for
+ * timing the firmware on the host without the model's own cost. */
+extern int sim_bare;
+
+void sim_reset(void);
+uint64_t sim_now_ns(void);
+void sim_advance(uint64_t ns);
+void sim_advance_to(uint64_t ns);
+
+/* sim_trace_open
+ *
+ * Record every SPI word, with the time and chip select it went out on,
+ * and every change of the LDAC and shutter pins, to f. NULL stops
+ * tracing.
+ */
+void sim_trace_open(FILE *f);
+
+#endif /* BCM2835_SIM_H_ */
@@ -0,0 +1,76 @@
+/* SD card from a host disk image
+ *
+ * In a SIMFS=image build the file player reads through the firmware's
+ * own FatFs (common/lib/ff.c), from an image of a FAT formatted card
+ * given with -i, so that the sector reads it makes are the ones the card
+ * would see. Every disk_read() is counted, and takes virtual time.
+ */
+
+#include <stdio.h>
+#include <ff.h>
+#include <diskio.h>
+
+#include "bcm2835_sim.h"
+#include "ff_sim.h"
+
+#define FF_SIM_SECTOR		512
+
+uint32_t ff_sim_read_ns_per_kb;
+uint32_t ff_sim_cmd_ns;
+uint64_t ff_sim_eject_ns;
+ff_sim_stats_t ff_sim_stats;
+
+static FILE *ff_sim_image;
+static FATFS ff_sim_fs;
+
+int ff_sim_mount(const char *image) {
+	if (!image) {
+		fprintf(stderr, "SIMFS=image builds need a disk image (-i)\n");
+		return -1;
+	}
+
+	ff_sim_image = fopen(image, "rb");
+	if (!ff_sim_image) {
+		perror(image);
+		return -1;
+	}
+
+	return f_mount(0, &ff_sim_fs) == FR_OK ? 0 : -1;
+}
+
+DSTATUS disk_initialize(BYTE pdrv) {
+	return ff_sim_image ? 0 : STA_NOINIT;
+}
+
+DSTATUS disk_status(BYTE pdrv) {
+	return ff_sim_image ? 0 : STA_NOINIT;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, BYTE count) {
+	if (ff_sim_eject_ns && sim_now_ns() >= ff_sim_eject_ns)
+		return RES_NOTRDY;
+
+	if (fseek(ff_sim_image, (long)sector * FF_SIM_SECTOR, SEEK_SET)
+	    || fread(buff, FF_SIM_SECTOR, count, ff_sim_image) != count)
+		return RES_ERROR;
+
+	ff_sim_stats.reads++;
+	ff_sim_stats.sectors += count;
+	ff_sim_stats.bytes += count * FF_SIM_SECTOR;
+	sim_advance(ff_sim_cmd_ns
+		+ (uint64_t)count * FF_SIM_SECTOR * ff_sim_read_ns_per_kb / 1024);
+
+	return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, BYTE count) {
+	return RES_WRPRT;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+	return cmd == CTRL_SYNC ? RES_OK : RES_PARERR;
+}
+
+DWORD get_fattime(void) {
+	return 0;
+}
@@ -0,0 +1,96 @@
+/* FatFs on host files
+ *
+ * Just enough of the FatFs API for the file player: files are opened
+ * from the host filesystem, and fptr is kept as the file position, since
+ * ild-player.c rewinds frames by poking it directly, and the file's inode
+ * stands in for its first cluster, which tells files apart in the frame
+ * cache. Reads can be made
+ * to take virtual time, to stand in for the SD card. This is the default,
+ * SIMFS=host, build; see diskio_sim.c for reading from a disk image.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <ff.h>
+#include <diskio.h>
+
+#include "bcm2835_sim.h"
+#include "ff_sim.h"
+
+uint32_t ff_sim_read_ns_per_kb;
+uint32_t ff_sim_cmd_ns;
+uint64_t ff_sim_eject_ns;
+ff_sim_stats_t ff_sim_stats;
+
+static FATFS ff_sim_fs;
+static FILE *ff_sim_file[4];
+
+int ff_sim_mount(const char *image) {
+	if (image) {
+		fprintf(stderr, "disk images need a SIMFS=image build\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+	FILE *f;
+
+	if (mode != FA_READ)
+		return FR_DENIED;
+
+	if (ff_sim_fs.id >= sizeof(ff_sim_file) / sizeof(ff_sim_file[0]))
+		return FR_TOO_MANY_OPEN_FILES;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return FR_NO_FILE;
+
+	struct stat st;
+	fstat(fileno(f), &st);
+
+	fseek(f, 0, SEEK_END);
+	fp->fs = &ff_sim_fs;
+	fp->sclust = st.st_ino;
+	fp->id = ff_sim_fs.id;
+	fp->fptr = 0;
+	fp->fsize = ftell(f);
+	fp->clust = 0;
+	fp->dsect = 0;
+
+	ff_sim_file[ff_sim_fs.id++] = f;
+	return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+	FILE *f = ff_sim_file[fp->id];
+
+	if (ff_sim_eject_ns && sim_now_ns() >= ff_sim_eject_ns)
+		return FR_NOT_READY;
+
+	if (fseek(f, fp->fptr, SEEK_SET))
+		return FR_DISK_ERR;
+
+	*br = fread(buff, 1, btr, f);
+	fp->fptr += *br;
+
+	ff_sim_stats.reads++;
+	ff_sim_stats.bytes += *br;
+	sim_advance(ff_sim_cmd_ns + (uint64_t)*br * ff_sim_read_ns_per_kb / 1024);
+	return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, DWORD ofs) {
+	if (ofs > fp->fsize)
+		ofs = fp->fsize;
+	fp->fptr = ofs;
+	return FR_OK;
+}
+
+FRESULT f_close(FIL *fp) {
+	fclose(ff_sim_file[fp->id]);
+	ff_sim_file[fp->id] = NULL;
+	return FR_OK;
+}
+
@@ -0,0 +1,28 @@
+#ifndef FF_SIM_H_
+#define FF_SIM_H_
+
+#include <stdint.h>
+
+/* Virtual time taken by each read from the SD card: a fixed cost per
+ * command, plus a cost per KiB. 0 makes reads free. With host files
+ * every f_read() is a command; with a disk image, every disk_read(). */
+extern uint32_t ff_sim_read_ns_per_kb;
+extern uint32_t ff_sim_cmd_ns;
+
+/* Virtual time at which the card is pulled out, and reads start to fail;
+ * 0 leaves it in. */
+extern uint64_t ff_sim_eject_ns;
+
+typedef struct ff_sim_stats {
+	uint64_t reads;		/* Commands */
+	uint64_t sectors;	/* Disk image only */
+	uint64_t bytes;
+} ff_sim_stats_t;
+
+extern ff_sim_stats_t ff_sim_stats;
+
+/* Mount the disk image, in a SIMFS=image build; host file builds take
+ * no image. */
+int ff_sim_mount(const char *image);
+
+#endif /* FF_SIM_H_ */
@@ -0,0 +1,117 @@
+/* Host benchmark for the point resampler
+ *
+ * Feeds a circle through resample_block() in the blocks the file player
+ * uses, at a few rate ratios, and reports how many output points a second
+ * each mode manages on the host, and how far the output strays from the
+ * true circle. The resampler's output runs two source points behind its
+ * input, so output point k lies at source position k * step - 2.
+ *
+ * Build with "make resample_bench"; "./resample_bench [points]" runs each
+ * case for that many output points (4000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <resample.h>
+
+#define BENCH_RADIUS		20000
+#define BENCH_CIRCLE		60	/* source points per revolution */
+#define BENCH_SOURCE		(BENCH_CIRCLE * 50)
+#define BENCH_BLOCK		25	/* ILDA_MAX_POINTS_PER_LOOP */
+
+static dac_point_t bench_src[BENCH_SOURCE];
+
+static void bench_circle(double pos, double *x, double *y) {
+	double a = 2 * M_PI * pos / BENCH_CIRCLE;
+	*x = BENCH_RADIUS * cos(a);
+	*y = BENCH_RADIUS * sin(a);
+}
+
+static uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* bench_run
+ *
+ * Resample until total output points have been produced, a block at a
+ * time. If err is given, measure the largest distance from the circle.
+ */
+static void bench_run(resample_t *r, uint64_t total, double *err) {
+	dac_point_t out[BENCH_BLOCK];
+	uint64_t k = 0;
+	int src = 0, src_used = 0;
+
+	while (k < total) {
+		if (src_used == BENCH_BLOCK) {
+			src = (src + BENCH_BLOCK) % BENCH_SOURCE;
+			src_used = 0;
+		}
+
+		int used, i;
+		int n = resample_block(r, bench_src + src + src_used,
+			BENCH_BLOCK - src_used, &used, out, BENCH_BLOCK);
+		src_used += used;
+
+		for (i = 0; err && i < n; i++) {
+			double pos = (double)(k + i) * r->step / RESAMPLE_ONE - 2;
+			double x, y;
+
+			if (pos < 2)
+				continue;
+
+			bench_circle(pos, &x, &y);
+			double d = hypot(out[i].x - x, out[i].y - y);
+			if (d > *err)
+				*err = d;
+		}
+
+		k += n;
+	}
+}
+
+int main(int argc, char **argv) {
+	static const struct { int src, out; } ratios[] = {
+		{ 30000, 60000 }, { 30000, 45000 }, { 30000, 20000 },
+	};
+	uint64_t total = argc > 1 ? strtoull(argv[1], NULL, 0) : 4000000;
+	int i, mode;
+
+	for (i = 0; i < BENCH_SOURCE; i++) {
+		double x, y;
+		bench_circle(i, &x, &y);
+		memset(&bench_src[i], 0, sizeof(bench_src[i]));
+		bench_src[i].x = lrint(x);
+		bench_src[i].y = lrint(y);
+		bench_src[i].r = bench_src[i].i = 65535;
+	}
+
+	for (i = 0; i < (int)(sizeof(ratios) / sizeof(ratios[0])); i++) {
+		for (mode = RESAMPLE_LINEAR; mode <= RESAMPLE_CUBIC; mode++) {
+			resample_t r = { .mode = mode };
+			double err = 0;
+
+			resample_set_rate(&r, ratios[i].src, ratios[i].out);
+
+			resample_reset(&r);
+			bench_run(&r, BENCH_SOURCE * 4, &err);
+
+			resample_reset(&r);
+			uint64_t start = bench_ns();
+			bench_run(&r, total, NULL);
+			uint64_t ns = bench_ns() - start;
+
+			printf("%6d -> %6d  %-6s  %7.2f Mpts/s  %6.2f ns/pt  "
+				"err max %.1f\n", ratios[i].src, ratios[i].out,
+				mode == RESAMPLE_CUBIC ? "cubic" : "linear",
+				total * 1e3 / ns, (double)ns / total, err);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,556 @@
+/* Host simulator for the DAC output path
+ *
+ * This runs dac.c, the C FIQ handler, the DAC backend and the file
+ * player against the bcm2835_sim register file, in virtual time, so that
+ * throughput, underflow and latency can be measured repeatably without
+ * hardware. The main loop is modelled as a fixed cost per iteration;
+ * between iterations, the FIQ fires at each timer match, and every SPI
+ * word it writes can be traced.
+ *
+ * With an ILDA file argument the file player feeds the DAC, as it does
+ * from the SD card; the file is a host file, or one on a card image in a
+ * SIMFS=image build (see the Makefile). With -D, the file is only decoded,
+ * as fast as the host can, to measure the player itself. Otherwise a synthetic producer writes a circle into
+ * the point ring, and the time from each point's dac_advance() to its
+ * output is recorded. With -T, one of the self-tests in sim_test.c runs
+ * instead.
+ *
+ * Build with "make sim", or "make sim DAC_DRIVER=..." for another backend
+ * (see dac_driver.h); run "./sim -h" for the options. The trace shows
+ * each backend's SPI word stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include <serial.h>
+#include <tables.h>
+#include <hardware.h>
+#include <bcm2835.h>
+#include <lightengine.h>
+#include <playback.h>
+#include <dac.h>
+#include <dac_clock.h>
+#include <dac_instrument.h>
+#include <dac_settings.h>
+#include <dac_driver.h>
+#include <dac_calibrate.h>
+#include <dac_optimize.h>
+#include <file_player.h>
+#include <resample.h>
+#include <frame_cache.h>
+
+#include "bcm2835_sim.h"
+#include "ff_sim.h"
+#include "sim_test.h"
+
+dac_settings_t settings;
+
+TABLE(initializer_t, hardware);
+TABLE(initializer_t, poll);
+
+static int sim_verbose;
+
+int ilda_read_points(int points, dac_buffer_point_t *pp);
+void ilda_reset_file(void);
+extern int fplay_error_detail;
+
+/* Firmware services
+ *
+ * These are provided by main.c, serial.c and lightengine.c on the target.
+ */
+void outputf(const char *fmt, ...) {
+	va_list va;
+
+	if (!sim_verbose)
+		return;
+
+	fprintf(stderr, "[%10.3f] ", sim_now_ns() / 1e6);
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fputc('\n', stderr);
+}
+
+void debugf(const char *fmt, ...) {
+}
+
+enum le_state le_get_state(void) {
+	return LIGHTENGINE_READY;
+}
+
+/* Synthetic producer */
+
+#define SIM_LATENCY_QUEUE	4096
+
+static struct {
+	uint64_t produced;
+	uint64_t played_base;
+	uint32_t last_count;
+	uint32_t phase;
+	uint32_t frame_points;
+	struct {
+		uint64_t index;
+		uint64_t ns;
+	} queue[SIM_LATENCY_QUEUE];
+	unsigned head, tail;
+	uint64_t n, sum_ns, min_ns, max_ns;
+} sim_prod;
+
+/* sim_played
+ *
+ * Return the total number of points played. dac_control.count starts
+ * over whenever the DAC stops, so anything played since the last call
+ * before a stop is lost.
+ */
+static uint64_t sim_played(void) {
+	uint32_t count = dac_get_count();
+
+	if (count < sim_prod.last_count)
+		sim_prod.played_base += sim_prod.last_count;
+	sim_prod.last_count = count;
+
+	return sim_prod.played_base + count;
+}
+
+static void sim_produce(int start_points) {
+	int n = dac_request();
+	dac_point_t batch[64];
+
+	if (n < 0) {
+		/* Stopped on underflow: start counting again from here. */
+		sim_prod.produced = sim_played();
+		sim_prod.head = sim_prod.tail;
+		dac_prepare();
+		return;
+	}
+
+	if (n > (int)(sizeof(batch) / sizeof(batch[0])))
+		n = sizeof(batch) / sizeof(batch[0]);
+
+	if (n) {
+		int i;
+
+		for (i = 0; i < n; i++) {
+			double a = 2 * M_PI * sim_prod.phase / sim_prod.frame_points;
+			memset(&batch[i], 0, sizeof(batch[i]));
+			batch[i].x = 20000 * cos(a);
+			batch[i].y = 20000 * sin(a);
+			batch[i].r = batch[i].g = batch[i].b = batch[i].i = 65535;
+			sim_prod.phase = (sim_prod.phase + 1) % sim_prod.frame_points;
+		}
+
+		dac_store_points(dac_request_addr(), batch, n);
+		dac_advance(n);
+		sim_prod.produced += n;
+
+		unsigned next = (sim_prod.head + 1) % SIM_LATENCY_QUEUE;
+		if (next != sim_prod.tail) {
+			sim_prod.queue[sim_prod.head].index = sim_prod.produced;
+			sim_prod.queue[sim_prod.head].ns = sim_now_ns();
+			sim_prod.head = next;
+		}
+	}
+
+	if (dac_get_state() == DAC_PREPARED && dac_fullness() >= start_points)
+		dac_start();
+}
+
+/* sim_latency_update
+ *
+ * Retire batches whose last point has been played. This is checked once
+ * per main loop iteration, so the result has that resolution.
+ */
+static void sim_latency_update(void) {
+	uint64_t played = sim_played();
+
+	while (sim_prod.tail != sim_prod.head
+	       && sim_prod.queue[sim_prod.tail].index <= played) {
+		uint64_t ns = sim_now_ns() - sim_prod.queue[sim_prod.tail].ns;
+
+		if (!sim_prod.n || ns < sim_prod.min_ns)
+			sim_prod.min_ns = ns;
+		if (ns > sim_prod.max_ns)
+			sim_prod.max_ns = ns;
+		sim_prod.sum_ns += ns;
+		sim_prod.n++;
+		sim_prod.tail = (sim_prod.tail + 1) % SIM_LATENCY_QUEUE;
+	}
+}
+
+/* File playback */
+
+static void sim_file_stats(void) {
+	double frames = fplay_stats.frames ? fplay_stats.frames : 1;
+
+	printf("file       %u frames, %u loads (%u prefetched), %u rewinds, "
+		"%.1f KiB\n", fplay_stats.frames, fplay_stats.loads,
+		fplay_stats.prefetches, fplay_stats.rewinds,
+		fplay_stats.bytes / 1024.0);
+	if (fplay_preload_progress() >= 0)
+		printf("preload    %d%% of %u KiB\n", fplay_preload_progress(),
+			fplay_preload_bytes >> 10);
+	printf("schedule   %u frames dropped, drift %.3f ms, worst %.3f ms\n",
+		fplay_stats.dropped, fplay_stats.drift_us / 1000.0,
+		fplay_stats.drift_max_us / 1000.0);
+	printf("cache      %u hits, %u misses, %u frames in %u of %u blocks, "
+		"%u evicted, %u uncached\n", fcache_stats.hits,
+		fcache_stats.misses, fcache_stats.frames,
+		fcache_stats.blocks_used, fcache_stats.blocks,
+		fcache_stats.evictions, fcache_stats.uncached);
+
+	if (ff_sim_stats.sectors)
+		printf("sd         %llu reads, %llu sectors, %.2f reads and "
+			"%.2f sectors a frame\n",
+			(unsigned long long)ff_sim_stats.reads,
+			(unsigned long long)ff_sim_stats.sectors,
+			ff_sim_stats.reads / frames,
+			ff_sim_stats.sectors / frames);
+	else
+		printf("sd         %llu reads, %.2f a frame\n",
+			(unsigned long long)ff_sim_stats.reads,
+			ff_sim_stats.reads / frames);
+}
+
+/* sim_decode
+ *
+ * Decode the file passes times over, with no DAC to wait for, and report
+ * how fast the host did it.
+ */
+static int sim_decode(int passes) {
+	dac_buffer_point_t buf[64];
+	uint64_t points = 0;
+	struct timespec start, end;
+	int pass = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (pass < passes) {
+		int n = ilda_read_points(sizeof(buf) / sizeof(buf[0]), buf);
+
+		if (n < 0) {
+			fprintf(stderr, (const char *)(-n), fplay_error_detail);
+			fputc('\n', stderr);
+			return 1;
+		} else if (n == 0) {
+			ilda_reset_file();
+			pass++;
+		}
+
+		points += n;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("decode     %llu points in %d passes, %.2f Mpts/s on the host\n",
+		(unsigned long long)points, passes, s > 0 ? points / s / 1e6 : 0.0);
+	sim_file_stats();
+
+	return 0;
+}
+
+/* sim_fiq_bench
+ *
+ * Time the FIQ handler on the host over this many points of the
+ * synthetic circle. The handler is called directly with the FIQ masked
+ * and the SPI and GPIO model bare (see sim_bare), and the ring is topped
+ * up between batches, so only the handler itself is timed. Comparing a
+ * DAC_BUFFER_ENCODED=0 build with a =1 build ("make fiq-bench") shows
+ * what encoding points ahead of time saves the FIQ.
+ */
+static int sim_fiq_bench(int points) {
+	struct timespec start, end;
+	uint64_t host_ns = 0;
+	double best = 0;
+	int done = 0;
+
+	dac_prepare();
+
+	while (done < points) {
+		int i, n;
+
+		while (dac_request() > 0)
+			sim_produce(1);
+		if (dac_get_state() != DAC_PLAYING) {
+			fprintf(stderr, "dac didn't start\n");
+			return 1;
+		}
+		__disable_fiq();
+
+		n = dac_fullness();
+		if (n > points - done)
+			n = points - done;
+
+		sim_bare = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < n; i++)
+			dac_driver.fiq();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		sim_bare = 0;
+
+		uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL
+			+ end.tv_nsec - start.tv_nsec;
+		if (!best || (double)ns / n < best)
+			best = (double)ns / n;
+		host_ns += ns;
+		done += n;
+	}
+
+	/* The best batch is the least disturbed by the rest of the host. */
+	printf("fiq bench  %s ring, %s, %d points\n",
+		DAC_BUFFER_ENCODED ? "encoded" : "packed", dac_driver.name, done);
+	printf("fiq        %.1f ns a point on the host, best batch %.1f ns\n",
+		(double)host_ns / done, best);
+
+	return 0;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+	    "usage: %s [options] [file.ild]\n"
+	    "  -r pps        point rate (30000)\n"
+	    "  -t ms         virtual run time (1000)\n"
+	    "  -b points     point ring size\n"
+	    "  -u policy     underflow policy: stop, hold or park (stop)\n"
+	    "  -L low:high   latency target in ms\n"
+	    "  -l ns         main loop iteration cost (5000)\n"
+	    "  -s every:len  stall the producer for len ms every ms\n"
+	    "  -d ns[:cmd]   SD read cost per KiB, and per command (0:0)\n"
+	    "  -i image      SD card image to play from (SIMFS=image builds)\n"
+	    "  -E ms         pull the SD card out at this time\n"
+	    "  -P            preload the whole file into memory\n"
+	    "  -D passes     just decode the file this many times, and time it\n"
+	    "  -f fps        repeat file frames up to this frame rate\n"
+	    "  -j frame      start the file from this frame\n"
+	    "  -x            play the file's frames in reverse\n"
+	    "  -e ns         FIQ entry latency (0)\n"
+	    "  -c div        SPI clock divider (from dac_calibrate)\n"
+	    "  -a            latch all outputs together with LDAC\n"
+	    "  -O vmax:amax  optimize file playback rates for this galvo model\n"
+	    "  -R pps:mode   resample file playback to pps, linear or cubic\n"
+	    "  -p points     points per synthetic circle (600)\n"
+	    "  -o file       write a trace of SPI words and pin changes\n"
+	    "  -v            show firmware output\n"
+	    "  -B points     time the FIQ handler on the host over this many points\n"
+	    "  -T test       run a self-test instead: " SIM_TESTS " or all\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int pps = 30000, run_ms = 1000, buffer = 0, policy = DAC_UNDERFLOW_STOP;
+	int lat_low = 0, lat_high = 0, stall_every = 0, stall_len = 0;
+	int spi_div = 0, latched = 0;
+	unsigned opt_vmax = 0, opt_amax = 0;
+	int out_pps = 0, out_mode = RESAMPLE_CUBIC;
+	char mode[8];
+	const char *image = NULL, *test = NULL;
+	int decode_passes = 0, bench_points = 0, fps = 0, start_frame = 0, reverse = 0;
+	uint64_t loop_ns = 5000, start_ns = 0;
+	FILE *trace = NULL;
+	const volatile initializer_t *t;
+	int c;
+
+	sim_prod.frame_points = 600;
+
+	while ((c = getopt(argc, argv, "r:t:b:u:L:l:s:d:i:E:PD:f:j:xe:c:aO:R:p:o:vB:T:h")) != -1) {
+		switch (c) {
+		case 'r': pps = atoi(optarg); break;
+		case 't': run_ms = atoi(optarg); break;
+		case 'b': buffer = atoi(optarg); break;
+		case 'u':
+			if (!strcmp(optarg, "stop")) policy = DAC_UNDERFLOW_STOP;
+			else if (!strcmp(optarg, "hold")) policy = DAC_UNDERFLOW_HOLD;
+			else if (!strcmp(optarg, "park")) policy = DAC_UNDERFLOW_PARK;
+			else usage(argv[0]);
+			break;
+		case 'L':
+			if (sscanf(optarg, "%d:%d", &lat_low, &lat_high) != 2)
+				usage(argv[0]);
+			break;
+		case 'l': loop_ns = strtoull(optarg, NULL, 0); break;
+		case 's':
+			if (sscanf(optarg, "%d:%d", &stall_every, &stall_len) != 2)
+				usage(argv[0]);
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u:%u", &ff_sim_read_ns_per_kb,
+				   &ff_sim_cmd_ns) < 1)
+				usage(argv[0]);
+			break;
+		case 'i': image = optarg; break;
+		case 'E': ff_sim_eject_ns = strtoull(optarg, NULL, 0) * 1000000; break;
+		case 'P': fplay_set_preload(1); break;
+		case 'D': decode_passes = atoi(optarg); break;
+		case 'f': fps = atoi(optarg); break;
+		case 'j': start_frame = atoi(optarg); break;
+		case 'x': reverse = 1; break;
+		case 'e': sim_fiq_entry_ns = atoi(optarg); break;
+		case 'c': spi_div = atoi(optarg); break;
+		case 'a': latched = 1; break;
+		case 'O':
+			if (sscanf(optarg, "%u:%u", &opt_vmax, &opt_amax) != 2)
+				usage(argv[0]);
+			break;
+		case 'R':
+			if (sscanf(optarg, "%d:%7s", &out_pps, mode) != 2)
+				usage(argv[0]);
+			if (!strcmp(mode, "linear")) out_mode = RESAMPLE_LINEAR;
+			else if (!strcmp(mode, "cubic")) out_mode = RESAMPLE_CUBIC;
+			else usage(argv[0]);
+			break;
+		case 'p': sim_prod.frame_points = atoi(optarg); break;
+		case 'o':
+			trace = fopen(optarg, "w");
+			if (!trace) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'v': sim_verbose = 1; break;
+		case 'B': bench_points = atoi(optarg); break;
+		case 'T': test = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (pps <= 0 || out_pps < 0 || fps < 0 || run_ms <= 0 || !loop_ns || sim_prod.frame_points <= 0)
+		usage(argv[0]);
+
+	sim_reset();
+	settings.buffer_points = buffer;
+
+	for (t = hardware_table; t < hardware_table_end; t++)
+		t->f();
+
+	if (spi_div)
+		bcm2835_spi_setClockDivider(spi_div);
+
+	dac_set_underflow_policy(policy);
+	dac_set_latched(latched);
+	if (opt_vmax) {
+		dac_opt_set_model(opt_vmax, opt_amax);
+		dac_opt_set_enabled(1);
+	}
+	dac_set_park(0, 0);
+	if (dac_set_latency(lat_low, lat_high) < 0)
+		usage(argv[0]);
+	fplay_set_rate(pps);
+	sim_trace_open(trace);
+
+	if (test)
+		return sim_test_run(test);
+
+	if (optind < argc) {
+		if (ff_sim_mount(image) < 0)
+			return 1;
+		fplay_set_resample_mode(out_mode);
+		if (fps)
+			ilda_set_fps_limit(fps);
+		if (out_pps)
+			fplay_set_output_rate(out_pps);
+		fplay_set_reverse(reverse);
+		playback_set_src(SRC_ILDAPLAYER);
+
+		uint64_t reads = ff_sim_stats.reads, sectors = ff_sim_stats.sectors;
+		if (fplay_open(argv[optind]) < 0)
+			return 1;
+		printf("index      %d frames, from %llu reads of %llu sectors\n",
+			fplay_frames, (unsigned long long)(ff_sim_stats.reads - reads),
+			(unsigned long long)(ff_sim_stats.sectors - sectors));
+
+		if (start_frame && fplay_seek_frame(start_frame) < 0) {
+			fprintf(stderr, "no frame %d\n", start_frame);
+			return 1;
+		}
+		playback_source_flags |= ILDA_PLAYER_PLAYING | ILDA_PLAYER_REPEAT;
+
+		if (decode_passes)
+			return sim_decode(decode_passes);
+	} else {
+		playback_set_src(SRC_NETWORK);
+	}
+
+	if (bench_points > 0)
+		return sim_fiq_bench(bench_points);
+
+	int start_points = dac_latency_low_points();
+	if (!start_points)
+		start_points = dac_get_buffer_size() / 2;
+
+	dac_prepare();
+
+	uint64_t end_ns = (uint64_t)run_ms * 1000000;
+	while (sim_now_ns() < end_ns) {
+		uint64_t now_ms = sim_now_ns() / 1000000;
+		int stalled = stall_every && now_ms % stall_every >= stall_every - stall_len;
+
+		if (!stalled) {
+			if (playback_src == SRC_ILDAPLAYER) {
+				for (t = poll_table; t < poll_table_end; t++)
+					t->f();
+			} else {
+				sim_produce(start_points);
+			}
+		}
+
+		if (!start_ns && dac_get_state() == DAC_PLAYING)
+			start_ns = sim_now_ns();
+
+		sim_advance(loop_ns);
+		sim_latency_update();
+	}
+
+	if (trace)
+		fclose(trace);
+
+	uint64_t played = sim_played();
+	double run_s = (end_ns - start_ns) / 1e9;
+
+	printf("run        %d ms at %d pps, %d point ring, %s, state %d\n",
+		run_ms, dac_nominal_pps, dac_get_buffer_size(), dac_driver.name,
+		dac_get_state());
+	printf("calibrate  spi /%d, %u ns a point, max %d pps\n",
+		dac_spi_divider, dac_point_ns, dac_max_rate);
+	printf("started    %.3f ms\n", start_ns / 1e6);
+	printf("played     %llu points, %.1f pps since start\n",
+		(unsigned long long)played, start_ns ? played / run_s : 0.0);
+	printf("spi        %llu words, %.3f us each\n",
+		(unsigned long long)sim_stats.spi_words, sim_stats.spi_words
+		? sim_stats.spi_ns / 1e3 / sim_stats.spi_words : 0.0);
+	printf("fiq        n %llu avg %.3f us max %.3f us deferred %llu\n",
+		(unsigned long long)sim_stats.fiqs, sim_stats.fiqs
+		? sim_stats.fiq_ns / 1e3 / sim_stats.fiqs : 0.0,
+		sim_stats.fiq_max_ns / 1e3,
+		(unsigned long long)sim_stats.fiq_deferred);
+	printf("fiq stats  dur max %u late max %u missed %u slips %u\n",
+		dac_fiq_stats.max_duration, dac_fiq_stats.max_lateness,
+		dac_fiq_stats.missed, dac_st_clock.slips);
+	printf("update     skew max %.3f us, lag max %.3f us\n",
+		sim_stats.skew_max_ns / 1e3, sim_stats.lag_max_ns / 1e3);
+	printf("underflow  n %u starved %u longest %u\n",
+		dac_underflow.count, dac_underflow.starved,
+		dac_underflow.longest);
+	if (dac_opt.enabled)
+		printf("optimize   %u changes, avg %llu pps over %u windows\n",
+			dac_opt.changes, (unsigned long long)(dac_opt.windows
+			? dac_opt.rate_sum / dac_opt.windows : 0), dac_opt.windows);
+	if (fplay_output_pps)
+		printf("resample   %d pps content at %d pps, %s\n",
+			fplay_source_pps, dac_nominal_pps,
+			out_mode == RESAMPLE_CUBIC ? "cubic" : "linear");
+	if (playback_src == SRC_ILDAPLAYER) {
+		printf("prefill    %d points\n", playback_prefill);
+		sim_file_stats();
+	} else if (sim_prod.n)
+		printf("latency    min %.3f avg %.3f max %.3f ms\n",
+			sim_prod.min_ns / 1e6, sim_prod.sum_ns / 1e6 / sim_prod.n,
+			sim_prod.max_ns / 1e6);
+
+	return 0;
+}
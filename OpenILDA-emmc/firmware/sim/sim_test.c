@@ -0,0 +1,904 @@
+/* Self-tests for the host simulator
+ *
+ * See sim_test.h. Each test returns the number of checks that failed, or
+ * -1 if it doesn't apply to this build; the first few failures of each
+ * are printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <tables.h>
+#include <bcm2835.h>
+#include <spi_dac.h>
+#include <dac.h>
+#include <dac_dma.h>
+#include <dac_driver.h>
+#include <transform.h>
+#include <frame_cache.h>
+#include <resample.h>
+#include <playback.h>
+#include <file_player.h>
+
+#include "bcm2835_sim.h"
+#include "sim_test.h"
+
+#define SIM_TEST_SHOW	10
+
+static const char *sim_test_name;
+static int sim_test_failures;
+
+static void sim_test_fail(int line, const char *fmt, ...) {
+	va_list va;
+
+	if (sim_test_failures++ >= SIM_TEST_SHOW)
+		return;
+
+	printf("%-10s line %d: ", sim_test_name, line);
+	va_start(va, fmt);
+	vprintf(fmt, va);
+	va_end(va);
+	putchar('\n');
+}
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) \
+		sim_test_fail(__LINE__, __VA_ARGS__); \
+} while (0)
+
+/* Deterministic test content: positions that sweep the whole range,
+ * including both extremes, and colors with distinct high bytes. */
+static void sim_test_point(dac_point_t *p, int i) {
+	memset(p, 0, sizeof(*p));
+	p->x = i ? (int16_t)(i * 2749 - 32768) : -32768;
+	p->y = i == 1 ? 32767 : (int16_t)(i * -1931 + 77);
+	p->i = (i * 0x3100 + 0x0100) & 0xFFFF;
+	p->r = (i * 0x0700 + 0x8000) & 0xFFFF;
+	p->g = (i * 0x1D00 + 0x4000) & 0xFFFF;
+	p->b = 0xFF00 - ((i * 0x0B00) & 0xFF00);
+}
+
+/* sim_test_queue
+ *
+ * Prepare the DAC and store n test points in its ring.
+ */
+static int sim_test_queue(int n) {
+	dac_point_t batch[64];
+	int done = 0;
+
+	if (dac_prepare() < 0)
+		return -1;
+
+	while (done < n) {
+		int i, avail = dac_request();
+		if (avail <= 0)
+			return -1;
+		if (avail > n - done)
+			avail = n - done;
+		if (avail > (int)(sizeof(batch) / sizeof(batch[0])))
+			avail = sizeof(batch) / sizeof(batch[0]);
+
+		for (i = 0; i < avail; i++)
+			sim_test_point(&batch[i], done + i);
+		dac_store_points(dac_request_addr(), batch, avail);
+		dac_advance(avail);
+		done += avail;
+	}
+
+	return 0;
+}
+
+/* MCP49x2 command words: buffered, 1x gain, active, channel A or B. */
+#define MCP_WORD(ch, code)	(0x3000 | ((ch) << 15) | (code))
+
+/* DMA engine
+ *
+ * Queue a full block and a partial one, start the DMA engine, and walk
+ * the control block chain it was handed, checking every control block
+ * against the register map: transfer info and DREQ, source and dest,
+ * the SPI words and HC139 selects they carry, and the links. Then play
+ * the completion write at the end of each block, and check that the poll
+ * loop retires exactly that block's points.
+ */
+
+#if DAC_DRIVER_DMA
+
+static void sim_test_mcp_words(uint16_t *w, int chip, const dac_point_t *p) {
+	switch (chip) {
+	case 0:
+		w[0] = MCP_WORD(0, ((p->x >> 4) + 0x800) & 0xFFF);
+		w[1] = MCP_WORD(1, ((p->y >> 4) + 0x800) & 0xFFF);
+		break;
+	case 1:
+		w[0] = MCP_WORD(0, (p->i >> 8) << 4);
+		w[1] = MCP_WORD(1, (p->r >> 8) << 4);
+		break;
+	default:
+		w[0] = MCP_WORD(0, (p->g >> 8) << 4);
+		w[1] = MCP_WORD(1, (p->b >> 8) << 4);
+		break;
+	}
+}
+
+#define BUS_GPSET0		0x7E20001C
+#define BUS_GPCLR0		0x7E200028
+#define BUS_SPI0_FIFO	0x7E204004
+#define BUS_PWM_RNG1	0x7E20C010
+#define BUS_PWM_FIF1	0x7E20C018
+
+#define TI_PACE		0x00050048	/* PWM DREQ, WAIT_RESP */
+#define TI_WRITE	0x00000008	/* WAIT_RESP */
+#define TI_SELECT	0x00000118	/* SRC_INC, DEST_INC, WAIT_RESP */
+#define TI_SPI_TX	0x00060148	/* SPI TX DREQ, SRC_INC, WAIT_RESP */
+#define TI_SPI_RX	0x00070408	/* SPI RX DREQ on the source, WAIT_RESP */
+
+static void *sim_test_ram(uint32_t bus) {
+	if ((bus & 0xC0000000) != 0x40000000)
+		return NULL;
+	return (void *)(uintptr_t)(bus & 0x3FFFFFFF);
+}
+
+static void sim_test_run_poll(const char *name) {
+	extern const volatile initializer_t poll_table[], poll_table_end[];
+	const volatile initializer_t *t;
+
+	for (t = poll_table; t < poll_table_end; t++)
+		if (!strcmp(t->name, name))
+			t->f();
+}
+
+#define CHECK_CB(cb, ti, src, dest, len) do { \
+	CHECK((cb)->TI == (ti), "%s ti %08x", where, (cb)->TI); \
+	CHECK(!(src) || (cb)->SOURCE_AD == (src), "%s src %08x", where, (cb)->SOURCE_AD); \
+	CHECK(!(dest) || (cb)->DEST_AD == (dest), "%s dest %08x", where, (cb)->DEST_AD); \
+	CHECK((cb)->TXFR_LEN == (len), "%s len %u", where, (cb)->TXFR_LEN); \
+	CHECK((cb)->STRIDE == 0, "%s stride", where); \
+} while (0)
+
+#endif
+
+static int sim_test_dma(void) {
+#if DAC_DRIVER_DMA
+	static const int chip_cs[3] = {
+		SIM_CS_MCP4922, SIM_CS_MCP4902_1, SIM_CS_MCP4902_2
+	};
+	const int block_points[2] = { DAC_DMA_BLOCK_POINTS, 5 };
+	const int n = block_points[0] + block_points[1];
+	const uint32_t ticks = DAC_DMA_PWM_HZ / dac_current_pps;
+	const uint32_t rem = DAC_DMA_PWM_HZ % dac_current_pps;
+	uint32_t bus, seq[2], levels = 0, range_sum = 0;
+	BCM2835_DMA_CB_TypeDef *done[2];
+	int blk, p, i, index = 0;
+	char where[48];
+
+	CHECK(bcm2835_sim.dma_enable & (1 << DAC_DMA_CHANNEL), "channel not enabled");
+	CHECK(transform_matrix[0] == COORD_MAX && transform_matrix[1] == 0
+		&& transform_matrix[2] == 0 && transform_matrix[3] == 0
+		&& transform_matrix[4] == 0 && transform_matrix[5] == COORD_MAX
+		&& transform_matrix[6] == 0 && transform_matrix[7] == 0,
+		"transform is not the identity");
+
+	if (dac_set_engine(DAC_ENGINE_DMA) < 0 || sim_test_queue(n) < 0
+	    || dac_start() < 0) {
+		CHECK(0, "couldn't start the DMA engine");
+		return sim_test_failures;
+	}
+
+	CHECK(BCM2835_DMA(DAC_DMA_CHANNEL)->CS & BCM2835_DMA_CS_ACTIVE, "not running");
+	CHECK(dac_dma_fullness() == n, "fullness %d", dac_dma_fullness());
+
+	bus = BCM2835_DMA(DAC_DMA_CHANNEL)->CONBLK_AD;
+	for (blk = 0; blk < 2; blk++) {
+		for (p = 0; p < block_points[blk]; p++, index++) {
+			BCM2835_DMA_CB_TypeDef *cb = sim_test_ram(bus);
+			dac_point_t pt;
+			uint32_t *range;
+			int chip, ch;
+
+			snprintf(where, sizeof(where), "point %d cb 0", index);
+			if (!cb || (bus & 31)) {
+				CHECK(0, "%s at %08x", where, bus);
+				return sim_test_failures;
+			}
+
+			sim_test_point(&pt, index);
+
+			CHECK_CB(&cb[0], TI_PACE, 0, BUS_PWM_FIF1, 4);
+			CHECK(sim_test_ram(cb[0].SOURCE_AD), "%s src", where);
+			snprintf(where, sizeof(where), "point %d ldac", index);
+			CHECK_CB(&cb[1], TI_WRITE, BCM2835_RAM_BUS_ADDR(&dac_ldac_mask), BUS_GPCLR0, 4);
+			CHECK_CB(&cb[3], TI_WRITE, BCM2835_RAM_BUS_ADDR(&dac_ldac_mask), BUS_GPSET0, 4);
+
+			snprintf(where, sizeof(where), "point %d range", index);
+			CHECK_CB(&cb[2], TI_WRITE, 0, BUS_PWM_RNG1, 4);
+			range = sim_test_ram(cb[2].SOURCE_AD);
+			CHECK(range && (*range == ticks || *range == ticks + 1),
+				"%s %u", where, range ? *range : 0);
+			if (range)
+				range_sum += *range;
+
+			for (chip = 0; chip < 3; chip++) {
+				BCM2835_DMA_CB_TypeDef *sel = &cb[4 + chip * 5];
+				uint32_t *gpio = sim_test_ram(sel->SOURCE_AD);
+				uint16_t words[2];
+				int cs;
+
+				snprintf(where, sizeof(where), "point %d chip %d select", index, chip);
+				CHECK_CB(sel, TI_SELECT, 0, BUS_GPSET0, 16);
+				if (!gpio) {
+					CHECK(0, "%s src %08x", where, sel->SOURCE_AD);
+					continue;
+				}
+
+				/* GPSET0, GPSET1, reserved, GPCLR0 */
+				CHECK(!gpio[1] && !gpio[2], "%s touches GPSET1", where);
+				levels = (levels | gpio[0]) & ~gpio[3];
+				cs = (levels >> HC139_A_GPIO_PIN & 1)
+					| (levels >> HC139_B_GPIO_PIN & 1) << 1;
+				CHECK(cs == chip_cs[chip], "%s selects %d", where, cs);
+
+				sim_test_mcp_words(words, chip, &pt);
+				for (ch = 0; ch < 2; ch++) {
+					BCM2835_DMA_CB_TypeDef *tx = sel + 1 + 2 * ch, *rx = tx + 1;
+					uint32_t *spi = sim_test_ram(tx->SOURCE_AD);
+					uint32_t swapped = (words[ch] >> 8) | ((words[ch] & 0xFF) << 8);
+
+					snprintf(where, sizeof(where), "point %d chip %d ch %d", index, chip, ch);
+					CHECK_CB(tx, TI_SPI_TX, 0, BUS_SPI0_FIFO, 8);
+					CHECK_CB(rx, TI_SPI_RX, BUS_SPI0_FIFO, 0, 4);
+					CHECK(sim_test_ram(rx->DEST_AD), "%s sink %08x", where, rx->DEST_AD);
+					CHECK(spi && spi[0] == ((2 << 16) | BCM2835_SPI0_CS_TA),
+						"%s header %08x", where, spi ? spi[0] : 0);
+					CHECK(spi && spi[1] == swapped, "%s word %04x, expected %04x",
+						where, spi ? spi[1] : 0, swapped);
+				}
+			}
+
+			snprintf(where, sizeof(where), "point %d", index);
+			for (i = 0; i < DAC_DMA_CB_PER_POINT - 1; i++)
+				CHECK(cb[i].NEXTCONBK == BCM2835_RAM_BUS_ADDR(&cb[i + 1]),
+					"%s cb %d links to %08x", where, i, cb[i].NEXTCONBK);
+
+			bus = cb[DAC_DMA_CB_PER_POINT - 1].NEXTCONBK;
+			if (p < block_points[blk] - 1)
+				CHECK(bus != 0 && bus != BCM2835_RAM_BUS_ADDR(cb),
+					"%s links to %08x", where, bus);
+		}
+
+		/* The completion write: the block's sequence number to the
+		 * word dac_dma_poll() watches. */
+		done[blk] = sim_test_ram(bus);
+		snprintf(where, sizeof(where), "block %d done", blk);
+		if (!done[blk] || (bus & 31)) {
+			CHECK(0, "%s at %08x", where, bus);
+			return sim_test_failures;
+		}
+		CHECK_CB(done[blk], TI_WRITE, 0, 0, 4);
+		CHECK(sim_test_ram(done[blk]->SOURCE_AD) && sim_test_ram(done[blk]->DEST_AD),
+			"%s %08x to %08x", where, done[blk]->SOURCE_AD, done[blk]->DEST_AD);
+		seq[blk] = *(uint32_t *)sim_test_ram(done[blk]->SOURCE_AD);
+
+		bus = done[blk]->NEXTCONBK;
+	}
+
+	CHECK(bus == 0, "last block links to %08x", bus);
+	CHECK(done[0]->DEST_AD == done[1]->DEST_AD, "blocks report to different words");
+	CHECK(seq[1] == seq[0] + 1, "sequence %u then %u", seq[0], seq[1]);
+	CHECK(range_sum == n * ticks + (uint64_t)n * rem / dac_current_pps,
+		"periods add up to %u", range_sum);
+
+	/* Nothing is retired until the engine writes the sequence number. */
+	sim_test_run_poll("dac_dma_poll");
+	CHECK(dac_get_count() == 0, "retired %d early", dac_get_count());
+
+	for (blk = 0; blk < 2; blk++) {
+		*(uint32_t *)sim_test_ram(done[blk]->DEST_AD) =
+			*(uint32_t *)sim_test_ram(done[blk]->SOURCE_AD);
+		sim_test_run_poll("dac_dma_poll");
+		CHECK(dac_get_count() == (blk ? n : block_points[0]),
+			"block %d retired %d", blk, dac_get_count());
+		CHECK(dac_dma_fullness() == (blk ? 0 : block_points[1]),
+			"block %d fullness %d", blk, dac_dma_fullness());
+	}
+
+	dac_stop(0);
+	dac_set_engine(DAC_ENGINE_FIQ);
+	return sim_test_failures;
+#else
+	printf("%-10s skipped, no DMA engine for %s\n", sim_test_name, dac_driver.name);
+	return -1;
+#endif
+}
+
+/* SPI sequence
+ *
+ * Play a run of test points through the FIQ engine with the trace
+ * captured, and check every SPI word and the chip select it went out on
+ * against the sequence the backend's datasheet calls for: the MCP49x2
+ * board sends I and R to one MCP4902, G and B to the other, then X and Y
+ * to the MCP4922; the TLV5610 takes all six, each tagged with its
+ * channel address. Colors keep the bits the point ring stores.
+ */
+
+#define TLV_WORD(ch, code)	(((ch) << 12) | (code))
+
+static int sim_test_expect(const dac_point_t *p, const char **cs, uint16_t *w) {
+	uint16_t x = ((p->x >> 4) + 0x800) & 0xFFF;
+	uint16_t y = ((p->y >> 4) + 0x800) & 0xFFF;
+#if DAC_DRIVER == DAC_DRIVER_MCP49X2
+	static const char *const chips[6] = {
+		"mcp4902.1", "mcp4902.1", "mcp4902.2", "mcp4902.2",
+		"mcp4922", "mcp4922"
+	};
+
+	w[0] = MCP_WORD(0, (p->i >> 8) << 4);
+	w[1] = MCP_WORD(1, (p->r >> 8) << 4);
+	w[2] = MCP_WORD(0, (p->g >> 8) << 4);
+	w[3] = MCP_WORD(1, (p->b >> 8) << 4);
+	w[4] = MCP_WORD(0, x);
+	w[5] = MCP_WORD(1, y);
+#elif DAC_DRIVER == DAC_DRIVER_TLV5610
+	static const char *const chips[6] = {
+		"tlv5610", "tlv5610", "tlv5610", "tlv5610", "tlv5610", "tlv5610"
+	};
+
+	w[0] = TLV_WORD(5, p->i >> 4);
+	w[1] = TLV_WORD(4, p->r >> 4);
+	w[2] = TLV_WORD(3, p->g >> 4);
+	w[3] = TLV_WORD(2, p->b >> 4);
+	w[4] = TLV_WORD(7, x);
+	w[5] = TLV_WORD(6, y);
+#else
+	return 0;
+#endif
+	memcpy(cs, chips, sizeof(chips));
+	return 6;
+}
+
+static int sim_test_spi(void) {
+	const int n = 300;
+	const char *cs[6];
+	uint16_t words[6];
+	dac_point_t pt;
+	char *buf = NULL, *line, *next;
+	size_t len = 0;
+	uint64_t limit;
+	FILE *f;
+	int index = 0, k = 0, per_point, played;
+
+	sim_test_point(&pt, 0);
+	per_point = sim_test_expect(&pt, cs, words);
+	if (!per_point) {
+		printf("%-10s skipped, no sequence for %s\n", sim_test_name, dac_driver.name);
+		return -1;
+	}
+
+	if (sim_test_queue(n) < 0) {
+		CHECK(0, "couldn't queue points");
+		return sim_test_failures;
+	}
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		CHECK(0, "no memory for the trace");
+		dac_stop(0);
+		return sim_test_failures;
+	}
+
+	/* Stop tracing as soon as the last point is out, before the
+	 * underflow that follows it zeroes the DACs. */
+	sim_trace_open(f);
+	dac_start();
+	limit = sim_now_ns() + (uint64_t)n * 1000000000 / dac_current_pps * 2;
+	while ((int)dac_get_count() < n && dac_get_state() == DAC_PLAYING
+	       && sim_now_ns() < limit)
+		sim_advance(1000);
+	sim_trace_open(NULL);
+	fclose(f);
+	played = dac_get_count();
+	dac_stop(0);
+
+	CHECK(played == n, "played %d of %d", played, n);
+
+	for (line = buf; line && *line; line = next) {
+		char name[16];
+		unsigned word;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (sscanf(line, "%*u spi %15s %x", name, &word) != 2)
+			continue;
+
+		if (index >= n) {
+			CHECK(0, "extra word %s %04x", name, word);
+			continue;
+		}
+
+		if (!k) {
+			sim_test_point(&pt, index);
+			sim_test_expect(&pt, cs, words);
+		}
+		CHECK(!strcmp(name, cs[k]) && word == words[k],
+			"point %d word %d: %s %04x, expected %s %04x",
+			index, k, name, word, cs[k], words[k]);
+
+		if (++k == per_point) {
+			k = 0;
+			index++;
+		}
+	}
+
+	CHECK(index == n && !k, "traced %d points and %d words", index, k);
+	free(buf);
+	return sim_test_failures;
+}
+
+/* Geometric corrector
+ *
+ * The dual-multiply transform_points() kernel, run through the C models
+ * of the ARMv6 instructions, against translate(): many more coefficient
+ * sets than the check at startup.
+ */
+static int sim_test_transform(void) {
+	int bad = transform_selftest(4096);
+
+	CHECK(bad == 0, "%d mismatches", bad);
+	return sim_test_failures;
+}
+
+/* Frame cache
+ *
+ * Fill, commit and look up frames of one, one block's and several
+ * blocks' worth of points, and read them back. Then fill the cache with
+ * four big frames, and check that each new one pushes out whichever was
+ * least recently looked up. Taking the whole cache for a frame that is
+ * then abandoned must leave it empty.
+ */
+static int sim_test_cache_fill(int frame, int points) {
+	fcache_key_t key = { 0x5157, 1000, frame };
+	fcache_cursor_t c;
+	dac_point_t pt;
+	int e = fcache_fill_begin(&key, points, frame * 100);
+
+	if (e < 0)
+		return -1;
+
+	/* Just the first and last points of the big ones */
+	fcache_cursor_start(&c, e);
+	sim_test_point(&pt, frame);
+	fcache_put(&c, 0, &pt, 1);
+	sim_test_point(&pt, frame + 1);
+	fcache_put(&c, points - 1, &pt, 1);
+	fcache_fill_commit(e);
+
+	return e;
+}
+
+static int sim_test_cache_has(int frame, int points) {
+	fcache_key_t key = { 0x5157, 1000, frame };
+	fcache_cursor_t c;
+	dac_point_t pt, got;
+	packed_point_t packed;
+	uint32_t next;
+	int n, e = fcache_lookup(&key, &n, &next);
+
+	if (e < 0)
+		return 0;
+
+	CHECK(n == points && next == frame * 100, "frame %d: %d points, next %u",
+		frame, n, next);
+
+	fcache_cursor_start(&c, e);
+	sim_test_point(&pt, frame + 1);
+	dac_pack_point(&packed, &pt);
+	dac_unpack_point(&pt, &packed);
+	fcache_get(&c, points - 1, &got, 1);
+	CHECK(!memcmp(&got, &pt, sizeof(pt)), "frame %d: last point changed", frame);
+
+	sim_test_point(&pt, frame);
+	dac_pack_point(&packed, &pt);
+	dac_unpack_point(&pt, &packed);
+	fcache_get(&c, 0, &got, 1);
+	CHECK(!memcmp(&got, &pt, sizeof(pt)), "frame %d: first point changed", frame);
+
+	return 1;
+}
+
+static int sim_test_cache_empty(void) {
+	fcache_key_t key = { 0, 0, -1 };
+	int e = fcache_fill_begin(&key, fcache_stats.blocks * FCACHE_BLOCK_POINTS, 0);
+
+	if (e < 0)
+		return -1;
+	CHECK(fcache_stats.frames == 0, "%u frames left", fcache_stats.frames);
+	CHECK(fcache_stats.blocks_used == fcache_stats.blocks,
+		"%u of %u blocks taken", fcache_stats.blocks_used, fcache_stats.blocks);
+
+	fcache_fill_abort(e);
+	CHECK(fcache_stats.blocks_used == 0, "abort left %u blocks used",
+		fcache_stats.blocks_used);
+	return 0;
+}
+
+static int sim_test_cache(void) {
+	static const int sizes[] = { 1, FCACHE_BLOCK_POINTS, 3 * FCACHE_BLOCK_POINTS + 17 };
+	dac_point_t in[3 * FCACHE_BLOCK_POINTS + 17], out[sizeof(in) / sizeof(in[0])];
+	fcache_key_t key = { 0x5157, 1000, 0 };
+	packed_point_t packed;
+	fcache_cursor_t c;
+	uint32_t next, evictions;
+	int blocks = fcache_init(), big, f, i, n, e;
+
+	if (blocks < 16) {
+		CHECK(0, "only %d blocks", blocks);
+		return sim_test_failures;
+	}
+
+	CHECK(sim_test_cache_empty() == 0, "couldn't take the whole cache");
+
+	/* Round trip, putting and getting in uneven pieces, out of order */
+	for (f = 0; f < 3; f++) {
+		int points = sizes[f];
+
+		key.frame = 10 + f;
+		e = fcache_fill_begin(&key, points, 4242 + f);
+		CHECK(e >= 0, "no room for %d points", points);
+		if (e < 0)
+			return sim_test_failures;
+
+		for (i = 0; i < points; i++)
+			sim_test_point(&in[i], f * 1000 + i);
+
+		fcache_cursor_start(&c, e);
+		fcache_put(&c, points / 2, in + points / 2, points - points / 2);
+		fcache_put(&c, 0, in, points / 2);
+
+		CHECK(fcache_lookup(&key, &n, &next) < 0, "frame %d found before commit", f);
+		fcache_fill_commit(e);
+
+		memset(out, 0, sizeof(out));
+		e = fcache_lookup(&key, &n, &next);
+		CHECK(e >= 0 && n == points && next == 4242 + f,
+			"frame %d: entry %d, %d points, next %u", f, e, n, next);
+		if (e < 0)
+			continue;
+
+		fcache_cursor_start(&c, e);
+		for (i = 0; i < points; i += 100)
+			fcache_get(&c, i, out + i, points - i < 100 ? points - i : 100);
+		fcache_get(&c, 0, out, 1);
+
+		for (i = 0; i < points; i++) {
+			dac_pack_point(&packed, &in[i]);
+			dac_unpack_point(&in[i], &packed);
+			CHECK(!memcmp(&in[i], &out[i], sizeof(in[i])),
+				"frame %d point %d: x %d, expected %d", f, i, out[i].x, in[i].x);
+		}
+	}
+
+	key.frame = 99;
+	CHECK(fcache_lookup(&key, &n, &next) < 0, "found a frame never added");
+	CHECK(fcache_stats.frames == 3 && fcache_stats.blocks_used == 1 + 1 + 4,
+		"%u frames in %u blocks", fcache_stats.frames, fcache_stats.blocks_used);
+
+	/* LRU: four frames of a block short of a quarter of the cache each,
+	 * so that the fifth needs one of them dropped. */
+	CHECK(sim_test_cache_empty() == 0, "couldn't take the whole cache");
+	big = (blocks / 4 - 1) * FCACHE_BLOCK_POINTS;
+	for (f = 0; f < 4; f++)
+		CHECK(sim_test_cache_fill(f, big) >= 0, "no room for frame %d", f);
+	evictions = fcache_stats.evictions;
+
+	/* Look up 0, so 1 is the oldest. */
+	CHECK(sim_test_cache_has(0, big), "frame 0 gone");
+	CHECK(sim_test_cache_fill(4, big) >= 0, "no room for frame 4");
+	CHECK(fcache_stats.evictions == evictions + 1, "%u evictions for frame 4",
+		fcache_stats.evictions - evictions);
+	CHECK(!sim_test_cache_has(1, big), "frame 1 kept");
+
+	/* That leaves 0, 2, 3, 4 looked up in that order, so 0 goes next. */
+	for (f = 0; f < 5; f++)
+		if (f != 1)
+			CHECK(sim_test_cache_has(f, big), "frame %d gone", f);
+	CHECK(sim_test_cache_fill(5, big) >= 0, "no room for frame 5");
+	CHECK(!sim_test_cache_has(0, big), "frame 0 kept");
+	for (f = 2; f < 6; f++)
+		CHECK(sim_test_cache_has(f, big), "frame %d gone", f);
+	CHECK(fcache_stats.frames == 4, "%u frames", fcache_stats.frames);
+
+	/* Abandoning a fill gives its blocks back. At least four blocks are
+	 * still free, so nothing is dropped for it. */
+	key.frame = 98;
+	n = fcache_stats.blocks_used;
+	evictions = fcache_stats.evictions;
+	e = fcache_fill_begin(&key, 3 * FCACHE_BLOCK_POINTS, 0);
+	CHECK(e >= 0 && fcache_stats.blocks_used == n + 3,
+		"fill took %u blocks", fcache_stats.blocks_used - n);
+	if (e >= 0)
+		fcache_fill_abort(e);
+	CHECK(fcache_lookup(&key, &i, &next) < 0, "aborted frame found");
+	CHECK(fcache_stats.blocks_used == n && fcache_stats.evictions == evictions,
+		"%u blocks used after abort, %d before", fcache_stats.blocks_used, n);
+
+	CHECK(sim_test_cache_empty() == 0, "couldn't take the whole cache");
+	return sim_test_failures;
+}
+
+/* Resampler
+ *
+ * Resample a circle a block at a time, as the file player does, and
+ * check that the output point count is what the step calls for, that X
+ * and Y stay within a bound of the true circle, and that every other
+ * channel is exactly that of the nearest source point, so blanking edges
+ * stay sharp. Output k lies at source position k * step - 2: the output
+ * runs two points behind the input, and the stream starts from a
+ * standstill at its first point.
+ */
+
+#define RS_RADIUS		20000
+#define RS_CIRCLE		60	/* source points per revolution */
+#define RS_SOURCE		(RS_CIRCLE * 20)
+#define RS_BLOCK		25	/* ILDA_MAX_POINTS_PER_LOOP */
+#define RS_MAX_LINEAR	32.0	/* the chord's sagitta is 27.4 */
+#define RS_MAX_CUBIC	4.0
+
+static void sim_test_circle(double pos, double *x, double *y) {
+	double a = 2 * M_PI * pos / RS_CIRCLE;
+	*x = RS_RADIUS * cos(a);
+	*y = RS_RADIUS * sin(a);
+}
+
+static int sim_test_resample(void) {
+	static const struct { int src, out; } ratios[] = {
+		{ 30000, 60000 }, { 30000, 45000 }, { 30000, 20000 },
+	};
+	static dac_point_t src[RS_SOURCE], out[RS_SOURCE * 2 + RS_BLOCK];
+	int i, mode;
+
+	for (i = 0; i < RS_SOURCE; i++) {
+		double x, y;
+		sim_test_circle(i, &x, &y);
+		memset(&src[i], 0, sizeof(src[i]));
+		src[i].x = lrint(x);
+		src[i].y = lrint(y);
+		/* Blanked every other run of seven, and ramps to tell the
+		 * points apart. */
+		src[i].r = src[i].i = (i / 7) % 2 ? 0xFFFF : 0;
+		src[i].g = i * 37;
+		src[i].b = i;
+		src[i].u1 = i ^ 0x5555;
+	}
+
+	for (i = 0; i < (int)(sizeof(ratios) / sizeof(ratios[0])); i++) {
+		for (mode = RESAMPLE_LINEAR; mode <= RESAMPLE_CUBIC; mode++) {
+			const char *name = mode == RESAMPLE_CUBIC ? "cubic" : "linear";
+			resample_t r = { .mode = mode };
+			int in = 0, n = 0, expect, k;
+			double err = 0, bound;
+
+			resample_set_rate(&r, ratios[i].src, ratios[i].out);
+			resample_reset(&r);
+
+			/* Offer blocks of source, and take the output in blocks
+			 * too, so that some calls stop short of their input. */
+			while (n + RS_BLOCK <= (int)(sizeof(out) / sizeof(out[0]))) {
+				int used, got, avail = RS_SOURCE - in;
+
+				if (avail > RS_BLOCK)
+					avail = RS_BLOCK;
+				got = resample_block(&r, src + in, avail, &used,
+					out + n, RS_BLOCK);
+				CHECK(used >= 0 && used <= avail, "used %d of %d", used, avail);
+				in += used;
+				n += got;
+				if (!got && in == RS_SOURCE)
+					break;
+			}
+
+			expect = ((uint64_t)RS_SOURCE * RESAMPLE_ONE + r.step - 1) / r.step;
+			CHECK(in == RS_SOURCE && n == expect,
+				"%d -> %d %s: %d points from %d, expected %d from %d",
+				ratios[i].src, ratios[i].out, name, n, in, expect, RS_SOURCE);
+
+			/* Where the step is exact, it and the count follow from
+			 * the rates alone. */
+			if (!(((uint64_t)ratios[i].src << 16) % ratios[i].out)) {
+				CHECK(r.step == ((uint64_t)ratios[i].src << 16) / ratios[i].out,
+					"%d -> %d: step %u", ratios[i].src, ratios[i].out, r.step);
+				expect = ((uint64_t)RS_SOURCE * ratios[i].out
+					+ ratios[i].src - 1) / ratios[i].src;
+				CHECK(n == expect, "%d -> %d %s: %d points, expected %d",
+					ratios[i].src, ratios[i].out, name, n, expect);
+			}
+
+			for (k = 0; k < n; k++) {
+				int64_t pos = (int64_t)k * r.step - 2 * RESAMPLE_ONE;
+				int near = pos < 0 ? 0 : (int)((pos + RESAMPLE_ONE / 2) >> 16);
+				double x, y, d;
+
+				CHECK(out[k].r == src[near].r && out[k].i == src[near].i
+					&& out[k].g == src[near].g && out[k].b == src[near].b
+					&& out[k].u1 == src[near].u1,
+					"%d -> %d %s: point %d has the colors of %d, not %d",
+					ratios[i].src, ratios[i].out, name, k, out[k].b, near);
+
+				if (pos < 2 * RESAMPLE_ONE)
+					continue;
+
+				sim_test_circle((double)pos / RESAMPLE_ONE, &x, &y);
+				d = hypot(out[k].x - x, out[k].y - y);
+				if (d > err)
+					err = d;
+			}
+
+			bound = mode == RESAMPLE_CUBIC ? RS_MAX_CUBIC : RS_MAX_LINEAR;
+			CHECK(err <= bound, "%d -> %d %s: off the circle by %.1f, over %.1f",
+				ratios[i].src, ratios[i].out, name, err, bound);
+		}
+	}
+
+	return sim_test_failures;
+}
+
+/* Frame scheduling
+ *
+ * Play an indexed file under an fps limit, with every frame two and a
+ * half slots long, so that the show clock falls behind by one and a half
+ * slots each frame.
+ * fplay_schedule() has to skip the frames whose slot has passed by way
+ * of the index, without reading their headers, so that the frames shown
+ * plus those dropped account for exactly the frames played through, and
+ * no frame starts more than a slot late.
+ */
+
+#define SCHED_FPS		150
+#define SCHED_SLOT		(30000 / SCHED_FPS)	/* at the sim's 30k pps */
+#define SCHED_POINTS	(5 * SCHED_SLOT / 2)
+#define SCHED_FRAMES	240
+#define SCHED_RUN_NS	1000000000ULL
+
+#ifndef SIM_FS_IMAGE
+
+static void sim_test_be16(FILE *f, int v) {
+	fputc((v >> 8) & 0xFF, f);
+	fputc(v & 0xFF, f);
+}
+
+/* Format 5 (2D true color) frames of a circle, then the empty header
+ * that ends the file */
+static int sim_test_ilda(const char *path, int frames, int points) {
+	FILE *f = fopen(path, "wb");
+	int n, i;
+
+	if (!f)
+		return -1;
+
+	for (n = 0; n <= frames; n++) {
+		fwrite("ILDA\0\0\0\5", 1, 8, f);
+		fwrite("sim     test    ", 1, 16, f);
+		sim_test_be16(f, n < frames ? points : 0);
+		sim_test_be16(f, n);
+		sim_test_be16(f, frames);
+		fputc(0, f);
+		fputc(0, f);
+
+		for (i = 0; n < frames && i < points; i++) {
+			double a = 2 * M_PI * i / points;
+			sim_test_be16(f, (int)lrint(20000 * cos(a)));
+			sim_test_be16(f, (int)lrint(20000 * sin(a)));
+			fputc(i == points - 1 ? 0x80 : 0, f);
+			fputc(n, f);
+			fputc(i, f);
+			fputc(255, f);
+		}
+	}
+
+	return fclose(f) ? -1 : 0;
+}
+
+#endif
+
+static int sim_test_schedule(void) {
+#ifndef SIM_FS_IMAGE
+	extern const volatile initializer_t poll_table[], poll_table_end[];
+	const volatile initializer_t *t;
+	char path[] = "/tmp/sim_test_XXXXXX";
+	int fd = mkstemp(path);
+	uint64_t end;
+
+	if (fd < 0 || close(fd) < 0
+	    || sim_test_ilda(path, SCHED_FRAMES, SCHED_POINTS) < 0) {
+		CHECK(0, "couldn't write %s", path);
+		unlink(path);
+		return sim_test_failures;
+	}
+
+	playback_set_src(SRC_ILDAPLAYER);
+	ilda_set_fps_limit(SCHED_FPS);
+	if (fplay_open(path) < 0) {
+		CHECK(0, "couldn't open %s", path);
+		unlink(path);
+		return sim_test_failures;
+	}
+	unlink(path);
+
+	CHECK(fplay_frames == SCHED_FRAMES, "indexed %d frames", fplay_frames);
+	memset(&fplay_stats, 0, sizeof(fplay_stats));
+	playback_source_flags |= ILDA_PLAYER_PLAYING;
+	dac_prepare();
+
+	end = sim_now_ns() + SCHED_RUN_NS;
+	while (sim_now_ns() < end) {
+		for (t = poll_table; t < poll_table_end; t++)
+			t->f();
+		sim_advance(5000);
+	}
+
+	CHECK(dac_get_state() == DAC_PLAYING, "state %d", dac_get_state());
+	CHECK(fplay_frame < SCHED_FRAMES - 1, "ran out of file at frame %d", fplay_frame);
+	CHECK(fplay_stats.dropped > 0, "no frames dropped");
+
+	/* Each frame takes two and a half slots, so three are dropped for
+	 * every two shown. */
+	CHECK(2 * fplay_stats.dropped >= 3 * fplay_stats.frames - 4
+		&& 2 * fplay_stats.dropped <= 3 * fplay_stats.frames + 4,
+		"%u frames read, %u dropped", fplay_stats.frames, fplay_stats.dropped);
+	CHECK(fplay_stats.frames + fplay_stats.dropped == fplay_frame + 1,
+		"%u frames read and %u dropped by frame %d",
+		fplay_stats.frames, fplay_stats.dropped, fplay_frame);
+	CHECK(fplay_stats.drift_max_us <= SCHED_SLOT * 1000000 / 30000,
+		"frames started up to %d us late", fplay_stats.drift_max_us);
+
+	playback_source_flags = 0;
+	playback_set_src(SRC_NETWORK);
+	return sim_test_failures;
+#else
+	printf("%-10s skipped, needs a SIMFS=host build\n", sim_test_name);
+	return -1;
+#endif
+}
+
+static const struct {
+	const char *name;
+	int (*f)(void);
+} sim_tests[] = {
+	{ "dma", sim_test_dma },
+	{ "spi", sim_test_spi },
+	{ "transform", sim_test_transform },
+	{ "cache", sim_test_cache },
+	{ "resample", sim_test_resample },
+	{ "schedule", sim_test_schedule },
+};
+
+int sim_test_run(const char *name) {
+	int all = !strcmp(name, "all"), found = 0, failed = 0, r;
+	unsigned i;
+
+	for (i = 0; i < sizeof(sim_tests) / sizeof(sim_tests[0]); i++) {
+		if (!all && strcmp(name, sim_tests[i].name))
+			continue;
+
+		found = 1;
+		sim_test_name = sim_tests[i].name;
+		sim_test_failures = 0;
+		r = sim_tests[i].f();
+		if (r > 0) {
+			printf("%-10s FAILED, %d checks\n", sim_test_name, sim_test_failures);
+			failed = 1;
+		} else if (!r) {
+			printf("%-10s ok\n", sim_test_name);
+		}
+	}
+
+	if (!found) {
+		fprintf(stderr, "no test %s\n", name);
+		return 1;
+	}
+
+	return failed;
+}
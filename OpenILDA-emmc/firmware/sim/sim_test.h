@@ -0,0 +1,21 @@
+#ifndef SIM_TEST_H_
+#define SIM_TEST_H_
+
+/* Self-tests for the host simulator
+ *
+ * "./sim -T name" runs one of these in place of the main loop, after the
+ * same setup: the hardware initializers have run, and the rate, latch
+ * and underflow options have been applied. "make sim-test" builds the
+ * simulator and runs them all.
+ */
+
+#define SIM_TESTS	"dma, spi, transform, cache, resample, schedule"
+
+/* sim_test_run
+ *
+ * Run the named test, or all of them, and print a line for each. Returns
+ * 0 if everything passed, and 1 otherwise.
+ */
+int sim_test_run(const char *name);
+
+#endif /* SIM_TEST_H_ */
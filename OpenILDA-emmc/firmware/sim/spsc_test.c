@@ -0,0 +1,184 @@
+/* Host stress test for the SPSC ring indices
+ *
+ * Runs a producer and a consumer against one spsc_ring_t, each a small
+ * state machine (reserve, then fill and commit; peek, then check and
+ * release), and interleaves their steps at random, so that every call
+ * also lands between the other side's reserve/peek and its
+ * commit/release. Phases that favour one side push the ring to full and
+ * to empty over and over. Every element carries a sequence number, and
+ * every call is checked against a model of the ring: order, counts,
+ * and batch sizes up to the end of the storage, with sizes up to the
+ * 65536 slots the 16-bit indices allow.
+ *
+ * Build and run with "make spsc_test" (also part of "make sim-test");
+ * "./spsc_test [steps]" runs each ring size for that many steps (2000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <spsc_ring.h>
+
+#define TEST_SHOW	10
+
+static uint32_t test_seed = 1;
+static int test_failures;
+
+static uint32_t test_rand(void) {
+	test_seed = test_seed * 1664525 + 1013904223;
+	return test_seed >> 8;
+}
+
+#define CHECK(cond, ...) do { \
+	if (!(cond) && test_failures++ < TEST_SHOW) { \
+		printf("line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		putchar('\n'); \
+	} \
+} while (0)
+
+typedef struct test_stats {
+	uint64_t items;
+	uint64_t full, empty;		/* steps that saw the ring full, empty */
+	uint64_t wraps;			/* batches that ended at the storage end */
+} test_stats_t;
+
+/* test_ring
+ *
+ * Run steps interleaved producer and consumer steps on a ring of mask + 1
+ * slots.
+ */
+static void test_ring(unsigned mask, uint64_t steps, test_stats_t *st) {
+	uint32_t *slots = calloc(mask + 1, sizeof(*slots));
+	spsc_ring_t ring;
+	uint32_t next_in = 0, next_out = 0;	/* sequence numbers */
+	unsigned held = 0;			/* items in the ring, by the model */
+	unsigned p_idx = 0, p_n = 0, c_idx = 0, c_n = 0;
+	int p_reserved = 0, c_peeked = 0;
+	unsigned bias = 50;
+	uint64_t i;
+
+	spsc_ring_reset(&ring);
+
+	for (i = 0; i < steps; i++) {
+		unsigned count = spsc_ring_count(&ring, mask);
+		unsigned space = spsc_ring_space(&ring, mask);
+
+		/* Long runs with the producer ahead, then the consumer. */
+		if (i % 4096 == 0)
+			bias = test_rand() % 2 ? 90 : 10;
+
+		CHECK(count == held, "mask %u: count %u, expected %u", mask, count, held);
+		CHECK(count + space == mask, "mask %u: count %u + space %u", mask, count, space);
+		if (!space)
+			st->full++;
+		if (!count)
+			st->empty++;
+
+		if (test_rand() % 100 < bias) {
+			/* Producer */
+			if (!p_reserved) {
+				unsigned idx, n = spsc_ring_reserve(&ring, mask, &idx);
+				unsigned to_end = mask + 1 - idx;
+
+				CHECK(idx == ring.produce, "mask %u: reserve at %u", mask, idx);
+				CHECK(n == (space < to_end ? space : to_end),
+					"mask %u: reserve %u, space %u, to end %u", mask, n, space, to_end);
+				if (n) {
+					p_idx = idx;
+					p_n = 1 + test_rand() % n;
+					p_reserved = 1;
+				}
+			} else {
+				unsigned k;
+
+				for (k = 0; k < p_n; k++)
+					slots[p_idx + k] = next_in++;
+				spsc_ring_commit(&ring, mask, p_n);
+				held += p_n;
+				st->items += p_n;
+				if (p_idx + p_n == mask + 1)
+					st->wraps++;
+				p_reserved = 0;
+			}
+		} else {
+			/* Consumer */
+			if (!c_peeked) {
+				unsigned idx, n = spsc_ring_peek(&ring, mask, &idx);
+				unsigned to_end = mask + 1 - idx;
+
+				CHECK(idx == ring.consume, "mask %u: peek at %u", mask, idx);
+				CHECK(n == (count < to_end ? count : to_end),
+					"mask %u: peek %u, count %u, to end %u", mask, n, count, to_end);
+				if (n) {
+					c_idx = idx;
+					c_n = 1 + test_rand() % n;
+					c_peeked = 1;
+				}
+			} else {
+				unsigned k;
+
+				for (k = 0; k < c_n; k++) {
+					CHECK(slots[c_idx + k] == next_out,
+						"mask %u: got %u, expected %u", mask,
+						slots[c_idx + k], next_out);
+					next_out++;
+				}
+				spsc_ring_release(&ring, mask, c_n);
+				held -= c_n;
+				c_peeked = 0;
+			}
+		}
+	}
+
+	/* Drain, and check nothing was lost or duplicated. */
+	if (p_reserved) {
+		unsigned k;
+		for (k = 0; k < p_n; k++)
+			slots[p_idx + k] = next_in++;
+		spsc_ring_commit(&ring, mask, p_n);
+	}
+	for (;;) {
+		unsigned idx, k, n = spsc_ring_peek(&ring, mask, &idx);
+		if (!n)
+			break;
+		for (k = 0; k < n; k++) {
+			CHECK(slots[idx + k] == next_out, "mask %u: drained %u, expected %u",
+				mask, slots[idx + k], next_out);
+			next_out++;
+		}
+		spsc_ring_release(&ring, mask, n);
+	}
+	CHECK(next_out == next_in, "mask %u: %u in, %u out", mask, next_in, next_out);
+	CHECK(spsc_ring_count(&ring, mask) == 0, "mask %u: not empty", mask);
+
+	free(slots);
+}
+
+int main(int argc, char **argv) {
+	static const unsigned masks[] = { 1, 3, 7, 15, 255, 2047, 65535 };
+	uint64_t steps = argc > 1 ? strtoull(argv[1], NULL, 0) : 2000000;
+	unsigned i;
+
+	for (i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+		test_stats_t st = { 0 };
+		int before = test_failures;
+
+		test_ring(masks[i], steps, &st);
+
+		/* Every state of interest has to have come up. */
+		CHECK(st.full && st.empty && st.wraps,
+			"mask %u: full %llu empty %llu wraps %llu", masks[i],
+			(unsigned long long)st.full, (unsigned long long)st.empty,
+			(unsigned long long)st.wraps);
+
+		printf("spsc %5u slots  %9llu items  full %7llu  empty %7llu  "
+			"wraps %6llu  %s\n", masks[i] + 1,
+			(unsigned long long)st.items, (unsigned long long)st.full,
+			(unsigned long long)st.empty, (unsigned long long)st.wraps,
+			test_failures == before ? "ok" : "FAILED");
+	}
+
+	return test_failures ? 1 : 0;
+}
@@ -29,7 +29,15 @@ _start:
     ldr pc, data_handler
     ldr pc, unused_handler
     ldr pc, irq_handler
-    ldr pc, fiq_handler
+.global fiq_vector
+fiq_vector:
+    ldr pc, fiq_handler		@ until fiq_install() puts asm_fiq_handler here
+
+@ The FIQ vector is last, so the handler can run on from it. Leave it the
+@ rest of the vector page, up to the words the other vectors load.
+.space 0xFE0 - (. - _start)
+.global fiq_vector_end
+fiq_vector_end:
 
 reset_handler:			.word reset
 undefined_handler:	.word hang
@@ -39,12 +47,13 @@ data_handler:			.word hang
 unused_handler:		.word hang
 irq_handler:			.word irq
 fiq_handler:			.word fiq
+vectors_end:
 
 reset:
-    @ Copy vectors (including fiq handler) to 0x0000
+    @ Copy the vector page, with the words above, to 0x0000
     ldr   r1, =_start
     mov   r2, #0x0000
-    ldr   r3, =reset_handler
+    ldr   r3, =(vectors_end - _start)
 1:  cmp   r2, r3
     ldrlo r0, [r1], #4
     strlo r0, [r2], #4
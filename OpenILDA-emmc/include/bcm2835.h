@@ -53,6 +53,44 @@
 
 #define BCM2835_BSC_FIFO_SIZE   				16 ///< BSC FIFO size
 
+#define BCM2835_DMA_CS_RESET				0x80000000 ///< Reset the channel
+#define BCM2835_DMA_CS_ABORT				0x40000000 ///< Abort the current control block
+#define BCM2835_DMA_CS_WAIT_WRITES			0x10000000 ///< Wait for outstanding writes
+#define BCM2835_DMA_CS_PANIC_PRIORITY(x)	(((x) & 0xF) << 20) ///< AXI panic priority
+#define BCM2835_DMA_CS_PRIORITY(x)			(((x) & 0xF) << 16) ///< AXI priority
+#define BCM2835_DMA_CS_ERROR				0x00000100 ///< Channel has an error
+#define BCM2835_DMA_CS_INT					0x00000004 ///< Interrupt status
+#define BCM2835_DMA_CS_END					0x00000002 ///< Transfer complete
+#define BCM2835_DMA_CS_ACTIVE				0x00000001 ///< Activate the channel
+
+#define BCM2835_DMA_TI_NO_WIDE_BURSTS		0x04000000 ///< Don't do wide writes as 2 beat bursts
+#define BCM2835_DMA_TI_WAITS(x)				(((x) & 0x1F) << 21) ///< Add wait cycles
+#define BCM2835_DMA_TI_PERMAP(x)			(((x) & 0x1F) << 16) ///< Peripheral mapping
+#define BCM2835_DMA_TI_SRC_IGNORE			0x00000800 ///< Ignore reads
+#define BCM2835_DMA_TI_SRC_DREQ				0x00000400 ///< Control source reads with DREQ
+#define BCM2835_DMA_TI_SRC_INC				0x00000100 ///< Source address increment
+#define BCM2835_DMA_TI_DEST_IGNORE			0x00000080 ///< Ignore writes
+#define BCM2835_DMA_TI_DEST_DREQ			0x00000040 ///< Control destination writes with DREQ
+#define BCM2835_DMA_TI_DEST_INC				0x00000010 ///< Destination address increment
+#define BCM2835_DMA_TI_WAIT_RESP			0x00000008 ///< Wait for a write response
+#define BCM2835_DMA_TI_INTEN				0x00000001 ///< Interrupt enable
+
+#define BCM2835_DMA_PERMAP_PWM				5 ///< PWM DREQ
+#define BCM2835_DMA_PERMAP_SPI_TX			6 ///< SPI0 TX DREQ
+#define BCM2835_DMA_PERMAP_SPI_RX			7 ///< SPI0 RX DREQ
+
+#define BCM2835_PWM_CTL_CLRF1				0x00000040 ///< Clear the FIFO
+#define BCM2835_PWM_CTL_USEF1				0x00000020 ///< Channel 1 uses the FIFO
+#define BCM2835_PWM_CTL_PWEN1				0x00000001 ///< Channel 1 enable
+#define BCM2835_PWM_DMAC_ENAB				0x80000000 ///< DMA enable
+#define BCM2835_PWM_DMAC_PANIC(x)			(((x) & 0xFF) << 8) ///< DMA panic threshold
+#define BCM2835_PWM_DMAC_DREQ(x)			((x) & 0xFF) ///< DMA DREQ threshold
+
+#define BCM2835_CM_PASSWD					0x5A000000 ///< Clock manager password
+#define BCM2835_CM_BUSY						0x00000080 ///< Clock generator is running
+#define BCM2835_CM_ENAB						0x00000010 ///< Enable the clock generator
+#define BCM2835_CM_SRC_PLLD					6 ///< 500 MHz PLLD
+
 #define RPI_GPIO_P1_03         0  ///< Version 1, Pin P1-03
 #define RPI_GPIO_P1_05         1  ///< Version 1, Pin P1-05
 #define RPI_GPIO_P1_07         4  ///< Version 1, Pin P1-07
@@ -344,23 +382,116 @@ typedef struct {
   __IO uint32_t IRQ_BASIC_DISABLE;// 0x24
 } BCM2835_IRQ_TypeDef;
 
+typedef struct {
+	__IO uint32_t CS;		// 0x00
+	__IO uint32_t CONBLK_AD;// 0x04
+	__I uint32_t TI;		// 0x08
+	__I uint32_t SOURCE_AD;	// 0x0C
+	__I uint32_t DEST_AD;	// 0x10
+	__I uint32_t TXFR_LEN;	// 0x14
+	__I uint32_t STRIDE;	// 0x18
+	__I uint32_t NEXTCONBK;	// 0x1C
+	__IO uint32_t DEBUG;	// 0x20
+} BCM2835_DMA_TypeDef;
+
+/* DMA control block. The controller requires these to be 256-bit aligned. */
+typedef struct {
+	uint32_t TI;
+	uint32_t SOURCE_AD;
+	uint32_t DEST_AD;
+	uint32_t TXFR_LEN;
+	uint32_t STRIDE;
+	uint32_t NEXTCONBK;
+	uint32_t RES[2];
+} __attribute__((aligned(32))) BCM2835_DMA_CB_TypeDef;
+
+typedef struct {
+	__IO uint32_t CTL;		// 0x00
+	__IO uint32_t STA;		// 0x04
+	__IO uint32_t DMAC;		// 0x08
+	__IO uint32_t RES1;		// 0x0C
+	__IO uint32_t RNG1;		// 0x10
+	__IO uint32_t DAT1;		// 0x14
+	__O uint32_t FIF1;		// 0x18
+	__IO uint32_t RES2;		// 0x1C
+	__IO uint32_t RNG2;		// 0x20
+	__IO uint32_t DAT2;		// 0x24
+} BCM2835_PWM_TypeDef;
+
+typedef struct {
+	__IO uint32_t CTL;		// 0x00
+	__IO uint32_t DIV;		// 0x04
+} BCM2835_CM_TypeDef;
+
 #endif
 
 #define BCM2835_PERI_BASE      		0x20000000
 #define BCM2835_ST_BASE				(BCM2835_PERI_BASE + 0x3000)
+#define BCM2835_DMA_BASE			(BCM2835_PERI_BASE + 0x7000)
 #define BCM2835_IRQ_BASE			(BCM2835_PERI_BASE + 0xB200)
+#define BCM2835_CM_PWM_BASE			(BCM2835_PERI_BASE + 0x1010A0)
 #define BCM2835_GPIO_BASE      		(BCM2835_PERI_BASE + 0x200000)
 #define BCM2835_SPI0_BASE          	(BCM2835_PERI_BASE + 0x204000)
+#define BCM2835_PWM_BASE			(BCM2835_PERI_BASE + 0x20C000)
 #define BCM2835_UART1_BASE			(BCM2835_PERI_BASE + 0x215000)
 #define BCM2835_BSC1_BASE			(BCM2835_PERI_BASE + 0x804000)
 #define BCM2835_BSC2_BASE			(BCM2835_PERI_BASE + 0x805000)
 
+#if defined(PC_BUILD) && !defined(__ASSEMBLY__)
+/* Host builds have no peripherals: the registers the DAC code touches
+ * live in plain memory, in a register file owned by the simulator
+ * (firmware/sim), which advances the timer and models SPI and GPIO. */
+typedef struct {
+	BCM2835_ST_TypeDef st;
+	BCM2835_IRQ_TypeDef irq;
+	BCM2835_GPIO_TypeDef gpio;
+	BCM2835_SPI_TypeDef spi0;
+	BCM2835_PWM_TypeDef pwm;
+	BCM2835_CM_TypeDef cm_pwm;
+	BCM2835_UART_TypeDef uart1;
+	BCM2835_DMA_TypeDef dma[16];
+	uint32_t dma_enable;
+} BCM2835_SIM_TypeDef;
+
+extern BCM2835_SIM_TypeDef bcm2835_sim;
+
+uint32_t bcm2835_sim_bus_addr(const volatile void *reg);
+
+#define BCM2835_ST					(&bcm2835_sim.st)
+#define BCM2835_DMA(ch)				(&bcm2835_sim.dma[(ch)])
+#define BCM2835_DMA_ENABLE			(&bcm2835_sim.dma_enable)
+#define BCM2835_CM_PWM				(&bcm2835_sim.cm_pwm)
+#define BCM2835_PWM					(&bcm2835_sim.pwm)
+#define BCM2835_IRQ					(&bcm2835_sim.irq)
+#define BCM2835_GPIO 				(&bcm2835_sim.gpio)
+#define BCM2835_SPI0 				(&bcm2835_sim.spi0)
+#define BCM2835_UART1 				(&bcm2835_sim.uart1)
+#else
 #define BCM2835_ST					((BCM2835_ST_TypeDef *)   BCM2835_ST_BASE)
+#define BCM2835_DMA(ch)				((BCM2835_DMA_TypeDef *)  (BCM2835_DMA_BASE + ((ch) << 8)))
+#define BCM2835_DMA_ENABLE			(BCM2835_DMA_BASE + 0xFF0)
+#define BCM2835_CM_PWM				((BCM2835_CM_TypeDef *)   BCM2835_CM_PWM_BASE)
+#define BCM2835_PWM					((BCM2835_PWM_TypeDef *)  BCM2835_PWM_BASE)
 #define BCM2835_IRQ					((BCM2835_IRQ_TypeDef *)  BCM2835_IRQ_BASE)
 #define BCM2835_GPIO 				((BCM2835_GPIO_TypeDef *) BCM2835_GPIO_BASE)
 #define BCM2835_SPI0 				((BCM2835_SPI_TypeDef *)  BCM2835_SPI0_BASE)
 #define BCM2835_UART1 				((BCM2835_UART_TypeDef *) BCM2835_UART1_BASE)
 #define BCM2835_BSC1 				((BCM2835_BSC_TypeDef *)  BCM2835_BSC1_BASE)
 #define BCM2835_BSC2 				((BCM2835_BSC_TypeDef *)  BCM2835_BSC2_BASE)
+#endif
+
+/* The DMA engine sees the world through the VideoCore bus: peripherals live
+ * at 0x7E000000, and SDRAM is reached through the L2-coherent 0x40000000
+ * alias (the ARM side runs without MMU, so its L1 data cache is off). */
+#define BCM2835_PERI_BUS_BASE		0x7E000000
+#if defined(PC_BUILD) && !defined(__ASSEMBLY__)
+/* On the host, registers are found in the register file, and RAM is below
+ * 1GB because the simulator is linked without PIE. */
+#define BCM2835_PERI_BUS_ADDR(a)	bcm2835_sim_bus_addr(a)
+#define BCM2835_RAM_BUS_ADDR(a)		((uint32_t)(uintptr_t)(a) | 0x40000000)
+#else
+#define BCM2835_PERI_BUS_ADDR(a)	((uint32_t)(a) - BCM2835_PERI_BASE + BCM2835_PERI_BUS_BASE)
+#define BCM2835_RAM_BUS_ADDR(a)		((uint32_t)(a) | 0x40000000)
+#endif
 
 #endif /* BCM2835_H_ */
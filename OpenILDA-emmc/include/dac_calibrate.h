@@ -0,0 +1,34 @@
+#ifndef DAC_CALIBRATE_H_
+#define DAC_CALIBRATE_H_
+
+#include <stdint.h>
+
+/* Each divider is timed over DAC_CAL_ROUNDS rounds of DAC_CAL_POINTS
+ * point writes, and dividers are tried up to DAC_CAL_MAX_DIVIDER. */
+#define DAC_CAL_POINTS		256
+#define DAC_CAL_ROUNDS		4
+#define DAC_CAL_MAX_DIVIDER	32
+
+/* SPI0 divides the 250MHz core clock. */
+#define DAC_CAL_CORE_HZ		250000000
+
+/* Per point, the FIQ does more than the SPI writes that are timed: entry
+ * and exit, rescheduling the timer, the ring and the transform. This is
+ * a generous allowance for all that. */
+#define DAC_CAL_FIQ_OVERHEAD_NS	1000
+
+/* Share of each point period, in percent, that the FIQ may take; the
+ * rest is the main loop's, to refill the ring. */
+#define DAC_CAL_FIQ_SHARE	75
+
+/* Highest point rate the FIQ can keep up with, as of the last
+ * dac_calibrate(); DAC_MAX_POINT_RATE until then. */
+extern int dac_max_rate;
+
+/* SPI clock divider in use, and the time one point write took with it. */
+extern int dac_spi_divider;
+extern uint32_t dac_point_ns;
+
+int dac_calibrate(void);
+
+#endif /* DAC_CALIBRATE_H_ */
@@ -0,0 +1,73 @@
+#ifndef DAC_CLOCK_H_
+#define DAC_CLOCK_H_
+
+/* Offsets into dac_clock_t, for fiq_handler.S */
+#define DAC_CLOCK_COMPARE	0
+#define DAC_CLOCK_TICKS		4
+#define DAC_CLOCK_REM		8
+#define DAC_CLOCK_ACC		12
+#define DAC_CLOCK_DIV		16
+#define DAC_CLOCK_SLIPS		20
+
+/* The FIQ engine is clocked from the 1MHz system timer. */
+#define DAC_CLOCK_ST_HZ		1000000
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+/* Phase-accumulator point clock
+ *
+ * Divides a timebase of hz ticks per second down to pps points per second.
+ * Each period is either hz / pps or hz / pps + 1 ticks long: the remainder
+ * hz % pps is accumulated, and every time it wraps past pps one extra tick
+ * is added. Over any pps consecutive points exactly hz ticks elapse, so
+ * the requested rate is hit exactly on average, whatever it is.
+ *
+ * Periods are scheduled from the previous compare value rather than from
+ * the time the handler happened to run, so handler latency doesn't
+ * accumulate either.
+ */
+typedef struct dac_clock {
+	uint32_t compare;	/* End of the current period, in ticks */
+	uint32_t ticks;		/* hz / pps */
+	uint32_t rem;		/* hz % pps */
+	uint32_t acc;		/* Accumulated remainder, always < div */
+	uint32_t div;		/* pps */
+	uint32_t slips;		/* Times a period end was already past */
+} dac_clock_t;
+
+/* dac_clock_next_period
+ *
+ * Return the length of the next period, in ticks.
+ */
+static inline uint32_t dac_clock_next_period(dac_clock_t *c) {
+	uint32_t period = c->ticks;
+	c->acc += c->rem;
+	if (c->acc >= c->div) {
+		c->acc -= c->div;
+		period++;
+	}
+	return period;
+}
+
+void dac_clock_set_rate(dac_clock_t *c, uint32_t hz, uint32_t pps);
+
+extern dac_clock_t dac_st_clock;
+
+/* Measured point rate, as seen by dac_clock_measure(). */
+typedef struct dac_rate_stats {
+	uint32_t requested_pps;
+	uint32_t measured_mpps;	/* Last window, in millipoints per second */
+	int32_t drift_points;	/* Points played minus points requested */
+	int32_t drift_ppm;
+	uint32_t elapsed_s;
+} dac_rate_stats_t;
+
+void dac_clock_measure_start(void);
+void dac_clock_measure(void);
+void dac_clock_get_stats(dac_rate_stats_t *stats);
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_CLOCK_H_ */
@@ -0,0 +1,32 @@
+#ifndef DAC_DMA_H_
+#define DAC_DMA_H_
+
+#include <stdint.h>
+
+/* DMA channel used for point output. Nothing else on the bare-metal
+ * side uses the DMA controller. */
+#define DAC_DMA_CHANNEL			5
+
+/* Points per DMA block, and the number of blocks in flight. With 128
+ * points per block and 4 blocks, the DMA engine holds ~17ms at 30kpps
+ * on top of the dac_buffer ring. */
+#define DAC_DMA_BLOCK_POINTS	128
+#define DAC_DMA_BLOCKS			4
+
+/* The PWM peripheral provides the point timebase: PLLD (500MHz) / 50. */
+#define DAC_DMA_PWM_DIVIDER		50
+#define DAC_DMA_PWM_HZ			(500000000 / DAC_DMA_PWM_DIVIDER)
+
+/* Control blocks per point: one PWM pacing write, the LDAC pulse around
+ * a write of the next period length to the PWM range register, then per
+ * MCP49x2 one HC139 select write and a TX/RX pair for each of its two
+ * channels. */
+#define DAC_DMA_CB_PER_POINT	19
+
+void dac_dma_init(void);
+int dac_dma_start(void);
+void dac_dma_stop(void);
+void dac_dma_set_rate(int points_per_second);
+int dac_dma_fullness(void);
+
+#endif /* DAC_DMA_H_ */
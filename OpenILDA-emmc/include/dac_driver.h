@@ -0,0 +1,78 @@
+#ifndef DAC_DRIVER_H_
+#define DAC_DRIVER_H_
+
+/* DAC backends
+ *
+ * The DAC hardware is chosen at build time, with DAC_DRIVER in the
+ * Makefile. Each backend has a header with its hot path, which the FIQ
+ * handlers (both fiq_handler.S and c_fiq_handler) and the point encoders
+ * are compiled against, so that nothing is decided per point at run time:
+ *
+ *  - DAC_WORD_{I,R,G,B,X,Y}_BITS: the command bits of each channel's SPI
+ *    word, that is, the word for zero;
+ *  - DAC_WORD_{I,R,G,B}(v) and DAC_WORD_{X,Y}(v): the SPI word for a 16-bit
+ *    color or a transformed coordinate;
+ *  - dac_driver_write_color() and dac_driver_write_xy(): write those words
+ *    out, selecting chips as needed;
+ *  - DAC_FIQ_SELECT_{IR,GB,XY}: the same selects, for fiq_handler.S;
+ *  - DAC_SPI_WORDS and DAC_SPI_MIN_DIVIDER: SPI words per point, and the
+ *    fastest SPI clock divider the parts are rated for (see
+ *    dac_calibrate.c).
+ *
+ * Everything else goes through dac_driver, below.
+ */
+
+#define DAC_DRIVER_MCP49X2	1
+#define DAC_DRIVER_TLV5610	2
+
+#ifndef DAC_DRIVER
+#define DAC_DRIVER		DAC_DRIVER_MCP49X2
+#endif
+
+#if DAC_DRIVER == DAC_DRIVER_MCP49X2
+#include <dac_mcp49x2.h>
+#elif DAC_DRIVER == DAC_DRIVER_TLV5610
+#include <dac_tlv5610.h>
+#else
+#error "unknown DAC_DRIVER"
+#endif
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+/* The cold side of a backend: setting it up after hw_dac_init() has
+ * configured SPI0 and the HC139 (init may be NULL), setting all outputs
+ * to zero with X/Y centred, and writing one point outside the FIQ, with
+ * X/Y already transformed and full-scale 16-bit colors. fiq is the FIQ
+ * handler for this backend.
+ */
+typedef struct dac_driver {
+	const char *name;
+	void (*init)(void);
+	void (*zero)(void);
+	void (*write_point)(int32_t x, int32_t y, uint16_t i, uint16_t r,
+		uint16_t g, uint16_t b);
+	void (*fiq)(void);
+} dac_driver_t;
+
+extern const dac_driver_t dac_driver;
+
+void asm_fiq_handler(void);
+void c_fiq_handler(void);
+
+/* asm_fiq_handler runs from the FIQ vector (see fiq_install() in dac.c),
+ * and keeps its state in the banked FIQ registers; dac_fiq_seed() loads
+ * them. The host simulator has no ARM code, so it runs the C version. */
+extern uint8_t asm_fiq_handler_end[];
+void dac_fiq_seed(void);
+
+#ifdef PC_BUILD
+#define DAC_DRIVER_FIQ		c_fiq_handler
+#else
+#define DAC_DRIVER_FIQ		asm_fiq_handler
+#endif
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_DRIVER_H_ */
@@ -0,0 +1,83 @@
+#ifndef DAC_FRAME_H_
+#define DAC_FRAME_H_
+
+/* Frame store: one frame being shown, one committed and waiting, and one
+ * being filled by the producer. */
+#define DAC_FRAME_COUNT			3
+#define DAC_FRAME_MAX_POINTS	4096
+
+/* Offsets into dac_frame_out, for fiq_handler.S */
+#define DAC_FRAME_BASE				0
+#define DAC_FRAME_NPOINTS			4
+#define DAC_FRAME_POS				6
+#define DAC_FRAME_LOOPS_LEFT		8
+#define DAC_FRAME_PENDING			12
+#define DAC_FRAME_PENDING_NPOINTS	16
+#define DAC_FRAME_PENDING_LOOPS		20
+#define DAC_FRAME_REPEATS			24
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+#include <dac.h>
+
+/* Frame-mode output state, shared with the FIQ.
+ *
+ * The output engine plays base[0..npoints) over and over. Each time it
+ * wraps, it switches to the pending frame if there is one and the current
+ * frame has been shown at least as many times as its producer asked for;
+ * otherwise it just loops the current frame again and counts a repeat.
+ * pending is written last by the producer and cleared by the FIQ, so it
+ * doubles as the handoff flag.
+ */
+typedef struct dac_frame_out {
+	dac_buffer_point_t *base;
+	uint16_t npoints;
+	uint16_t pos;
+	uint32_t loops_left;
+	dac_buffer_point_t * volatile pending;
+	uint32_t pending_npoints;
+	uint32_t pending_loops;
+	uint32_t repeats;
+} dac_frame_out_t;
+
+extern dac_frame_out_t dac_frame_out;
+
+/* dac_frame_wrap
+ *
+ * Called at the end of each pass through the current frame.
+ */
+static inline void dac_frame_wrap(dac_frame_out_t *f) {
+	f->pos = 0;
+
+	if (f->loops_left > 1) {
+		f->loops_left--;
+	} else if (f->pending) {
+		f->base = f->pending;
+		f->npoints = f->pending_npoints;
+		f->loops_left = f->pending_loops;
+		f->pending = 0;
+	} else {
+		f->repeats++;
+	}
+}
+
+/* dac_frame_next
+ *
+ * Return the next point to play in frame mode.
+ */
+static inline dac_buffer_point_t *dac_frame_next(dac_frame_out_t *f) {
+	dac_buffer_point_t *p = f->base + f->pos;
+	if (++f->pos >= f->npoints)
+		dac_frame_wrap(f);
+	return p;
+}
+
+void dac_frame_reset(void);
+dac_buffer_point_t *dac_frame_get_buffer(void);
+int dac_frame_commit(int npoints, int loops);
+int dac_frame_start(void);
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_FRAME_H_ */
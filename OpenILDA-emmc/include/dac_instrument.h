@@ -0,0 +1,59 @@
+#ifndef DAC_INSTRUMENT_H_
+#define DAC_INSTRUMENT_H_
+
+/* Histogram bins. Bin 0 counts zero-length samples, bin n counts samples
+ * in [2^(n-1), 2^n) microseconds, and the last bin also takes everything
+ * longer. */
+#define DAC_FIQ_HIST_BINS		16
+
+/* Offsets into dac_fiq_stats_t, for fiq_handler.S */
+#define DAC_FIQ_STATS_COUNT			0
+#define DAC_FIQ_STATS_MAX_DURATION	4
+#define DAC_FIQ_STATS_MAX_LATENESS	8
+#define DAC_FIQ_STATS_MISSED		12
+#define DAC_FIQ_STATS_DURATION_HIST	16
+#define DAC_FIQ_STATS_LATENESS_HIST	(16 + 4 * DAC_FIQ_HIST_BINS)
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+/* FIQ timing statistics, updated by the FIQ handler when
+ * DAC_INSTRUMENT_TIME is set.
+ *
+ * Duration is measured from handler entry to exit; lateness is handler
+ * entry minus the compare value the handler was scheduled for. A missed
+ * deadline means the handler finished after the next compare value had
+ * already gone by. All times are in system timer ticks (microseconds).
+ */
+typedef struct dac_fiq_stats {
+	uint32_t count;
+	uint32_t max_duration;
+	uint32_t max_lateness;
+	uint32_t missed;
+	uint32_t duration_hist[DAC_FIQ_HIST_BINS];
+	uint32_t lateness_hist[DAC_FIQ_HIST_BINS];
+} dac_fiq_stats_t;
+
+extern volatile dac_fiq_stats_t dac_fiq_stats;
+
+/* dac_fiq_stats_record
+ *
+ * Add a sample to a histogram and its running maximum.
+ */
+static inline void dac_fiq_stats_record(volatile uint32_t *hist,
+                                        volatile uint32_t *max, uint32_t v) {
+	int bin = v ? 32 - __builtin_clz(v) : 0;
+	if (bin > DAC_FIQ_HIST_BINS - 1)
+		bin = DAC_FIQ_HIST_BINS - 1;
+	hist[bin]++;
+	if (v > *max)
+		*max = v;
+}
+
+void dac_fiq_stats_reset(void);
+void dac_fiq_stats_print(void);
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_INSTRUMENT_H_ */
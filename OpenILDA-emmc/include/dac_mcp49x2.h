@@ -0,0 +1,66 @@
+#ifndef DAC_MCP49X2_H_
+#define DAC_MCP49X2_H_
+
+/* MCP4922 + 2x MCP4902 backend; see dac_driver.h
+ *
+ * X and Y go to the 12-bit MCP4922, I/R and G/B to the two 8-bit
+ * MCP4902s, each picked by the HC139. The data sits in bits 0-11 (the
+ * MCP4902 ignores the low four), under 0x3000 for 1x gain and output on,
+ * and the channel in bit 15.
+ */
+
+#include <spi_dac.h>
+
+#define DAC_DRIVER_NAME		"mcp49x2"
+
+/* The DMA engine's control block layout is built for this backend. */
+#define DAC_DRIVER_DMA		1
+
+/* Six words a point. The parts are rated to 20MHz; 250MHz / 12 is a
+ * shade over, and what this board has always run. */
+#define DAC_SPI_WORDS		6
+#define DAC_SPI_MIN_DIVIDER	12
+
+#define DAC_WORD_I_BITS		(0x3000 | (0 << 15))
+#define DAC_WORD_R_BITS		(0x3000 | (1 << 15))
+#define DAC_WORD_G_BITS		(0x3000 | (0 << 15))
+#define DAC_WORD_B_BITS		(0x3000 | (1 << 15))
+#define DAC_WORD_X_BITS		(0x3000 | (0 << 15))
+#define DAC_WORD_Y_BITS		(0x3000 | (1 << 15))
+
+#define DAC_FIQ_SELECT_IR	SELECT_MCP4902_1
+#define DAC_FIQ_SELECT_GB	SELECT_MCP4902_2
+#define DAC_FIQ_SELECT_XY	SELECT_MCP4922
+
+#ifndef __ASSEMBLER__
+
+#include <bcm2835.h>
+
+#define DAC_WORD_COLOR(v)	(((v) >> 4) & 0xFF0)
+
+#define DAC_WORD_I(v)		(DAC_WORD_COLOR(v) | DAC_WORD_I_BITS)
+#define DAC_WORD_R(v)		(DAC_WORD_COLOR(v) | DAC_WORD_R_BITS)
+#define DAC_WORD_G(v)		(DAC_WORD_COLOR(v) | DAC_WORD_G_BITS)
+#define DAC_WORD_B(v)		(DAC_WORD_COLOR(v) | DAC_WORD_B_BITS)
+#define DAC_WORD_X(v)		(DAC_MASK_XY(v) | DAC_WORD_X_BITS)
+#define DAC_WORD_Y(v)		(DAC_MASK_XY(v) | DAC_WORD_Y_BITS)
+
+static inline void dac_driver_write_color(uint16_t i, uint16_t r,
+					  uint16_t g, uint16_t b) {
+	spi_select_mcp4902_1();
+	bcm2835_spi_write(i);
+	bcm2835_spi_write(r);
+	spi_select_mcp4902_2();
+	bcm2835_spi_write(g);
+	bcm2835_spi_write(b);
+}
+
+static inline void dac_driver_write_xy(uint16_t x, uint16_t y) {
+	spi_select_mcp4922();
+	bcm2835_spi_write(x);
+	bcm2835_spi_write(y);
+}
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_MCP49X2_H_ */
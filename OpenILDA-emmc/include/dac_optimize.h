@@ -0,0 +1,44 @@
+#ifndef DAC_OPTIMIZE_H_
+#define DAC_OPTIMIZE_H_
+
+#include <stdint.h>
+#include <dac.h>
+
+/* Points are grouped into windows of this many, each played at one rate. */
+#define DAC_OPT_WINDOW		8
+
+/* A window may only be this much faster than the one before, as a
+ * fraction of the current rate (1/4), and a rise smaller than
+ * DAC_OPT_HYSTERESIS (1/8) isn't worth a queue entry. Slowing down is
+ * never held back. */
+#define DAC_OPT_RISE_SHIFT	2
+#define DAC_OPT_HYSTERESIS_SHIFT	3
+
+/* Galvo model: the fastest each axis may move, in coordinate units per
+ * millisecond, and the hardest it may accelerate, in units per ms^2. The
+ * defaults are about what a 30K scanner manages at the ILDA test
+ * pattern's scan angle: a 4096 unit step, or a 2048 unit change of step,
+ * per point at 30kpps. */
+#define DAC_OPT_DEFAULT_VMAX	(4096 * 30)
+#define DAC_OPT_DEFAULT_AMAX	(2048 * 30 * 30)
+
+typedef struct dac_opt {
+	int enabled;
+	uint32_t vmax;
+	uint32_t amax;
+
+	/* Statistics: points seen, rate changes queued, and the sum of the
+	 * rates chosen per window, for the average. */
+	uint32_t points;
+	uint32_t changes;
+	uint32_t windows;
+	uint64_t rate_sum;
+} dac_opt_t;
+
+extern dac_opt_t dac_opt;
+
+void dac_opt_set_enabled(int enabled);
+void dac_opt_set_model(uint32_t vmax, uint32_t amax);
+void dac_opt_process(dac_point_t *p, int n);
+
+#endif /* DAC_OPTIMIZE_H_ */
@@ -0,0 +1,71 @@
+#ifndef DAC_TLV5610_H_
+#define DAC_TLV5610_H_
+
+/* TLV5610 backend; see dac_driver.h
+ *
+ * One 8-channel 12-bit TLV5610 on HC139 output Y3 carries all six outputs
+ * at full resolution. Each word is a 4-bit address over 12 bits of data;
+ * the channels are mapped as on the original j4cDAC board (see the old
+ * writes in dac.c, dac_write_point), leaving A and B, U1 and U2 there,
+ * at zero. Nothing else is on the bus, so init selects it once, and the
+ * FIQ writes all six words back to back.
+ */
+
+#define DAC_DRIVER_NAME		"tlv5610"
+
+#define DAC_DRIVER_DMA		0
+
+/* Six words a point, at up to 30MHz: 250MHz / 10 is the fastest even
+ * divider under that. */
+#define DAC_SPI_WORDS		6
+#define DAC_SPI_MIN_DIVIDER	10
+
+#define TLV5610_ADDR(a)		((a) << 12)
+
+/* CTRL0: power, DOUT, reference and input code all left at 0 - powered
+ * up, external reference, straight binary. CTRL1: fast settling on all
+ * four channel pairs. */
+#define TLV5610_CTRL0		TLV5610_ADDR(8)
+#define TLV5610_CTRL1		TLV5610_ADDR(9)
+#define TLV5610_CTRL1_FAST	0x00F
+
+#define DAC_WORD_I_BITS		TLV5610_ADDR(5)
+#define DAC_WORD_R_BITS		TLV5610_ADDR(4)
+#define DAC_WORD_G_BITS		TLV5610_ADDR(3)
+#define DAC_WORD_B_BITS		TLV5610_ADDR(2)
+#define DAC_WORD_X_BITS		TLV5610_ADDR(7)
+#define DAC_WORD_Y_BITS		TLV5610_ADDR(6)
+
+#define DAC_FIQ_SELECT_IR	SELECT_NONE
+#define DAC_FIQ_SELECT_GB	SELECT_NONE
+#define DAC_FIQ_SELECT_XY	SELECT_NONE
+
+#ifndef __ASSEMBLER__
+
+#include <bcm2835.h>
+
+#define DAC_WORD_COLOR(v)	(((v) >> 4) & 0xFFF)
+
+#define DAC_WORD_I(v)		(DAC_WORD_COLOR(v) | DAC_WORD_I_BITS)
+#define DAC_WORD_R(v)		(DAC_WORD_COLOR(v) | DAC_WORD_R_BITS)
+#define DAC_WORD_G(v)		(DAC_WORD_COLOR(v) | DAC_WORD_G_BITS)
+#define DAC_WORD_B(v)		(DAC_WORD_COLOR(v) | DAC_WORD_B_BITS)
+#define DAC_WORD_X(v)		(DAC_MASK_XY(v) | DAC_WORD_X_BITS)
+#define DAC_WORD_Y(v)		(DAC_MASK_XY(v) | DAC_WORD_Y_BITS)
+
+static inline void dac_driver_write_color(uint16_t i, uint16_t r,
+					  uint16_t g, uint16_t b) {
+	bcm2835_spi_write(i);
+	bcm2835_spi_write(r);
+	bcm2835_spi_write(g);
+	bcm2835_spi_write(b);
+}
+
+static inline void dac_driver_write_xy(uint16_t x, uint16_t y) {
+	bcm2835_spi_write(x);
+	bcm2835_spi_write(y);
+}
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* DAC_TLV5610_H_ */
@@ -0,0 +1,58 @@
+#ifndef FRAME_CACHE_H_
+#define FRAME_CACHE_H_
+
+#include <stdint.h>
+#include <dac.h>
+
+/* Decoded frame cache; see frame_cache.c */
+
+/* Frames are stored in chains of blocks of this many points. */
+#define FCACHE_BLOCK_POINTS	256
+
+/* The cache takes half of the largest allocation, up to this, that the
+ * heap will give; with less than FCACHE_MIN_BYTES there is no cache. */
+#define FCACHE_MAX_BYTES	(64 * 1024 * 1024)
+#define FCACHE_MIN_BYTES	(256 * 1024)
+
+/* A frame is known by its file and its number in the file. Files are
+ * told apart by their first cluster and size, so that the frames of a
+ * file that is opened again are still found. */
+typedef struct fcache_key {
+	uint32_t file;
+	uint32_t size;
+	int32_t frame;
+} fcache_key_t;
+
+/* A place in a cached frame, for reading or filling it in order */
+typedef struct fcache_cursor {
+	int entry;
+	int block;
+	int base;		/* Point number of block's first point */
+} fcache_cursor_t;
+
+typedef struct fcache_stats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t fills;		/* Frames added */
+	uint32_t evictions;	/* Frames dropped to make room */
+	uint32_t uncached;	/* Frames there was no room for */
+	uint32_t frames;	/* Frames held now */
+	uint32_t blocks;	/* Blocks in the cache */
+	uint32_t blocks_used;
+} fcache_stats_t;
+
+extern fcache_stats_t fcache_stats;
+
+int fcache_init(void);
+
+int fcache_lookup(const fcache_key_t *key, int *points, uint32_t *next);
+
+int fcache_fill_begin(const fcache_key_t *key, int points, uint32_t next);
+void fcache_fill_commit(int entry);
+void fcache_fill_abort(int entry);
+
+void fcache_cursor_start(fcache_cursor_t *c, int entry);
+void fcache_put(fcache_cursor_t *c, int pos, dac_point_t *p, int n);
+void fcache_get(fcache_cursor_t *c, int pos, dac_point_t *p, int n);
+
+#endif /* FRAME_CACHE_H_ */
@@ -0,0 +1,28 @@
+#ifndef RESAMPLE_H_
+#define RESAMPLE_H_
+
+#include <stdint.h>
+#include <dac.h>
+
+/* Point stream resampler; see resample.c */
+
+#define RESAMPLE_LINEAR		1
+#define RESAMPLE_CUBIC		2
+
+/* Positions between source points are 16.16 fixed point. */
+#define RESAMPLE_ONE		(1 << 16)
+
+typedef struct resample {
+	uint32_t step;		/* Source points per output point */
+	uint32_t phase;		/* Position past hist[1], up to RESAMPLE_ONE */
+	int mode;		/* RESAMPLE_LINEAR or RESAMPLE_CUBIC */
+	int primed;
+	dac_point_t hist[4];	/* Oldest first; output lies in hist[1..2] */
+} resample_t;
+
+void resample_set_rate(resample_t *r, int src_pps, int out_pps);
+void resample_reset(resample_t *r);
+int resample_block(resample_t *r, const dac_point_t *in, int n_in, int *used,
+	dac_point_t *out, int max_out);
+
+#endif /* RESAMPLE_H_ */
@@ -10,4 +10,10 @@
 
 #define SHUTTER_GPIO_PIN	RPI_V2_GPIO_P1_15
 
+#ifndef __ASSEMBLER__
+void spi_select_mcp4922(void);
+void spi_select_mcp4902_1(void);
+void spi_select_mcp4902_2(void);
+#endif
+
 #endif /* SPI_DAC_H_ */
@@ -0,0 +1,104 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <stdint.h>
+
+/* Single-producer, single-consumer ring
+ *
+ * This only keeps the indices: the caller owns the storage, an array whose
+ * size is a power of two, and passes size - 1 as mask. produce is only
+ * written by the producer and consume only by the consumer, so the two
+ * sides can live in different contexts (main loop and FIQ or IRQ) without
+ * locking. One slot is always left empty, so produce == consume means
+ * empty.
+ *
+ * Both sides work in batches: reserve/peek return how many slots can be
+ * used from a starting index without wrapping, and commit/release hand
+ * them over.
+ *
+ * Everything runs on one core, so all the producer needs is for its
+ * element writes to be emitted before the index update, and the consumer
+ * for its element reads to stay after the index read. spsc_barrier() is
+ * a compiler barrier that ensures this. If the DMA controller reads the
+ * elements, memory_barrier() is needed as well.
+ */
+typedef struct spsc_ring {
+	volatile uint16_t produce;
+	volatile uint16_t consume;
+} spsc_ring_t;
+
+#define spsc_barrier()	asm volatile("" ::: "memory")
+
+static inline void spsc_ring_reset(volatile spsc_ring_t *r) {
+	r->produce = 0;
+	r->consume = 0;
+}
+
+/* spsc_ring_count
+ *
+ * Return the number of slots holding data. Safe from either side.
+ */
+static inline unsigned spsc_ring_count(volatile spsc_ring_t *r, unsigned mask) {
+	return (r->produce - r->consume) & mask;
+}
+
+/* spsc_ring_space
+ *
+ * Return the number of free slots. Safe from either side.
+ */
+static inline unsigned spsc_ring_space(volatile spsc_ring_t *r, unsigned mask) {
+	return (r->consume - r->produce - 1) & mask;
+}
+
+/* spsc_ring_reserve
+ *
+ * Producer: set *idx to the first free slot, and return how many free
+ * slots follow it before the end of the storage.
+ */
+static inline unsigned spsc_ring_reserve(volatile spsc_ring_t *r,
+                                         unsigned mask, unsigned *idx) {
+	unsigned produce = r->produce;
+	unsigned n = (r->consume - produce - 1) & mask;
+	unsigned to_end = mask + 1 - produce;
+
+	*idx = produce;
+	return n < to_end ? n : to_end;
+}
+
+/* spsc_ring_commit
+ *
+ * Producer: publish n slots filled after spsc_ring_reserve().
+ */
+static inline void spsc_ring_commit(volatile spsc_ring_t *r, unsigned mask,
+                                    unsigned n) {
+	spsc_barrier();
+	r->produce = (r->produce + n) & mask;
+}
+
+/* spsc_ring_peek
+ *
+ * Consumer: set *idx to the oldest filled slot, and return how many filled
+ * slots follow it before the end of the storage.
+ */
+static inline unsigned spsc_ring_peek(volatile spsc_ring_t *r,
+                                      unsigned mask, unsigned *idx) {
+	unsigned consume = r->consume;
+	unsigned n = (r->produce - consume) & mask;
+	unsigned to_end = mask + 1 - consume;
+
+	spsc_barrier();
+	*idx = consume;
+	return n < to_end ? n : to_end;
+}
+
+/* spsc_ring_release
+ *
+ * Consumer: hand n slots back to the producer once they have been read.
+ */
+static inline void spsc_ring_release(volatile spsc_ring_t *r, unsigned mask,
+                                     unsigned n) {
+	spsc_barrier();
+	r->consume = (r->consume + n) & mask;
+}
+
+#endif /* SPSC_RING_H_ */
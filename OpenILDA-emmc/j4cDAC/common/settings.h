@@ -19,6 +19,9 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+/* Mesh warp nodes per side. Must be a power of two plus one. */
+#define GEOM_MESH_NODES	9
+
 typedef struct dac_settings_s {
 	/* IP config. To use DHCP, set ip_addr to 0.0.0.0; other fields will
 	 * then be ignored. */
@@ -32,10 +35,18 @@ typedef struct dac_settings_s {
 	uint8_t b_delay;
 	uint8_t i_delay;
 
+	/* DAC point ring size, or 0 for the default */
+	uint32_t buffer_points;
+
 	/* Geometric correction */
 	int32_t transform_x[4];
 	int32_t transform_y[4];
 
+	/* Mesh warp displacements, applied before the corner transform.
+	 * Row 0 is the bottom edge and column 0 the left edge. */
+	int16_t mesh_x[GEOM_MESH_NODES][GEOM_MESH_NODES];
+	int16_t mesh_y[GEOM_MESH_NODES][GEOM_MESH_NODES];
+
 } dac_settings_t;
 
 #endif
@@ -20,13 +20,19 @@
 #include <serial.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <dac.h>
+#include <dac_optimize.h>
+#include <resample.h>
+#include <frame_cache.h>
 #include <file_player.h>
 #include <ff.h>
+#include <bcm2835.h>
 #include <LPC17xx.h>
 
 #define SMALL_FRAME_THRESHOLD	200
+#define ILDA_MAX_POINTS_PER_LOOP	25
 
 struct sfb {
 	uint16_t x;
@@ -39,6 +45,8 @@ struct sfb {
 
 static FIL fplay_file;
 static enum {
+	STATE_PRELOADED = -5,
+	STATE_CACHED = -4,
 	STATE_WAV = -3,
 	STATE_SMALL_FRAME = -2,
 	STATE_BETWEEN_FRAMES = -1,
@@ -52,14 +60,113 @@ static enum {
 
 static int fplay_points_left;
 static int fplay_repeat_count;
-static int fplay_offset;
 
-static struct {
+/* Where FatFs was in the file, so that it can be put back there without
+ * following the cluster chain from the start. */
+struct fplay_fil {
 	unsigned int fptr;
 	unsigned int curr_clust;
 	unsigned int dsect;
+};
+
+/* Read-ahead staging
+ *
+ * The file is read FPLAY_STAGE_SIZE bytes at a time, at offsets that are
+ * multiples of that, so that every read is of whole sectors and FatFs
+ * can pass each cluster's worth (or all of a read, within one cluster)
+ * to disk_read() as one multiple-block read. There are two chunks: points
+ * are decoded straight out of one while the next is loaded, when the DAC
+ * ring is full (fplay_prefetch()) or else when the decoder gets to it.
+ */
+#define FPLAY_STAGE_SIZE	(32 * 1024)
+
+static struct fplay_chunk {
+	unsigned int pos;		/* File offset of data[0]; ~0 if empty */
+	int len;			/* Bytes in data */
+	struct fplay_fil fil;		/* FatFs state at pos, to reload it */
+	uint8_t data[FPLAY_STAGE_SIZE] __attribute__((aligned(4)));
+} fplay_chunk[2];
+
+static int fplay_cur;			/* Chunk being decoded */
+static int fplay_rd;			/* Offset into it */
+
+/* Records that straddle two chunks are put back together here. */
+static uint8_t fplay_bounce[16 * ILDA_MAX_POINTS_PER_LOOP] __attribute__((aligned(4)));
+
+fplay_stats_t fplay_stats;
+
+static struct {
+	unsigned int ofs;
+	struct fplay_fil fil;		/* Of the chunk holding ofs */
 } fplay_frame_start;
 
+/* Frame index
+ *
+ * fplay_open() reads every frame header, seeking over the points between
+ * them, so that a file that can't be played through is turned away before
+ * any of it is shown. On the way it notes where each frame is, and where
+ * in the cluster chain each staging chunk starts, so that any frame can
+ * be got to with one chunk load and no walk along the chain. Palette
+ * sections (format 2) aren't supported, so every frame is drawn with the
+ * default palette and there is no palette state to keep. Files with more
+ * frames, or more chunks, than there is room for play through unindexed.
+ */
+#define FPLAY_INDEX_FRAMES	8192
+#define FPLAY_INDEX_CHUNKS	2048	/* 64 MiB of file */
+
+static struct fplay_index_entry {
+	unsigned int ofs;		/* Of the frame's header */
+	unsigned int first_point;	/* Points in the frames before it */
+	uint16_t points;
+	uint8_t format;
+} fplay_index[FPLAY_INDEX_FRAMES];
+
+static unsigned int fplay_index_clust[FPLAY_INDEX_CHUNKS];
+static unsigned int fplay_index_end;	/* Offset of the end of the frames */
+static unsigned int fplay_index_points;
+
+int fplay_frames;			/* Frames indexed; 0 if not indexed */
+int fplay_frame;			/* Frame being played */
+static int fplay_frame_next;		/* Frame whose header is read next */
+static int fplay_reverse;
+static int fplay_wav;
+
+/* Seeks in the file are put off until the next header is read from it,
+ * so that frames played from the cache in the meantime don't load chunks
+ * that are never used. */
+static int fplay_seek_pending;
+static unsigned int fplay_seek_ofs;
+
+/* Frame cache: the entry being filled as the frame is read from the
+ * file, if there was room for it, and the one being played from. */
+static int fplay_fill = -1;
+static fcache_cursor_t fplay_fill_cur, fplay_cached_cur;
+
+/* Whole-show preload
+ *
+ * With preload on, fplay_open() sets aside room for every point of an
+ * indexed file, and the show is decoded into it a frame at a time, from
+ * a second handle on the file: a step at a time whenever the DAC ring is
+ * full (fplay_prefetch()), or a whole frame at once if playback gets to
+ * it first. Loaded frames play from memory; once all of them are, the
+ * card isn't read again.
+ */
+#define FPLAY_PRELOAD_STEP	(16 * 1024)
+
+static struct {
+	int enabled;		/* For the next file opened */
+	int loading;		/* file is open, and there's more to load */
+	packed_point_t *points;	/* Every point of the show, in order */
+	int frames;		/* Frames loaded */
+	int done;		/* Points of the next frame loaded */
+	FIL file;
+	dac_point_t batch[ILDA_MAX_POINTS_PER_LOOP];
+	uint8_t buf[FPLAY_PRELOAD_STEP] __attribute__((aligned(4)));
+} fplay_preload;
+
+uint32_t fplay_preload_bytes;
+static int fplay_preload_base;		/* First point of the frame playing */
+
 static int ilda_frame_pointcount;
 static int ilda_points_per_frame;
 static uint8_t wav_channels;
@@ -70,8 +177,51 @@ static int ilda_palette_size;
 
 int ilda_current_fps;
 
+/* Show clock
+ *
+ * Frames are scheduled against the show's nominal timeline, counted in
+ * points at the source rate: under an fps limit each frame of the file
+ * has a slot of ilda_points_per_frame points, and otherwise it lasts as
+ * long as its own points do. The clock says where on the timeline the
+ * next point decoded will be shown. Until the DAC starts, that's just
+ * the points decoded so far; once it has, it's the time since it
+ * started, from the system timer, plus what is still in the ring, so
+ * underflows and rate changes count too. Frames whose slot has passed by
+ * the time they would start are skipped by way of the index, and never
+ * read; the one that is due is repeated to fill out the rest of its
+ * slot. Files without an index can't skip, and play on late.
+ */
+static struct {
+	uint64_t decoded;	/* Source points decoded since the reset */
+	uint64_t due;		/* Timeline position of the next frame's slot */
+	int64_t start;		/* ST time of timeline position 0 */
+	int running;		/* start is set, and the clock is the timer */
+	int resync;		/* Start the timeline at the clock */
+	int late;		/* Points the frame being started is behind */
+} fplay_sched;
+
+/* Rates: the content's own (source) rate, and the rate to play it at, if
+ * it should be resampled to one; 0 plays it at its own rate. */
+int fplay_source_pps;
+int fplay_output_pps;
+
+static resample_t fplay_resampler = { .step = RESAMPLE_ONE, .mode = RESAMPLE_CUBIC };
+static int fplay_dac_pps;		/* rate last given to dac_set_rate() */
+static int fplay_resample_src, fplay_resample_out;
+
+/* Decoded source points not yet taken by the resampler */
+static dac_point_t fplay_src[ILDA_MAX_POINTS_PER_LOOP];
+static int fplay_src_count, fplay_src_used;
+
 static const uint8_t ilda_palette_64[];
-static const uint8_t ilda_palette_256[];
+static const uint8_t ilda_palette_256[] __attribute__((unused));
+
+static int fplay_stage_seek(unsigned int ofs, const struct fplay_fil *at);
+static int fplay_index_build(void);
+static void fplay_preload_start(const char *fname);
+static void fplay_preload_stop(void);
+static void ilda_decode_records(int format, const uint8_t *bytes, int points,
+				dac_point_t *batch);
 
 int fplay_error_detail;
 
@@ -86,35 +236,142 @@ static void calculate_intensity(dac_point_t *p) {
 	p->i = max;
 }
 
+/* fplay_cache_abort
+ *
+ * Stop filling the cache with a frame that won't be read to its end.
+ */
+static void fplay_cache_abort(void) {
+	if (fplay_fill >= 0)
+		fcache_fill_abort(fplay_fill);
+	fplay_fill = -1;
+}
+
+static void fplay_cache_key(fcache_key_t *key, int frame) {
+	key->file = fplay_file.sclust;
+	key->size = fplay_file.fsize;
+	key->frame = frame;
+}
+
 /* ilda_reset_file
  *
  * Return to the beginning of the current ILDA file.
  */
 void ilda_reset_file(void) {
 	fplay_state = STATE_BETWEEN_FRAMES;
-	fplay_offset = 0;
 	ilda_palette_ptr = ilda_palette_64;
 	ilda_palette_size = 64;
-	f_lseek(&fplay_file, 0);
+
+	/* Played in reverse, the file starts from its last frame. */
+	fplay_frame_next = fplay_reverse && fplay_frames ? fplay_frames - 1 : 0;
+
+	fplay_cache_abort();
+	fplay_seek_pending = 1;
+	fplay_seek_ofs = fplay_frame_next ? fplay_index[fplay_frame_next].ofs : 0;
 }
 
+/* ilda_set_fps_limit
+ *
+ * Frames are repeated to make up max_fps at the source rate; resampling
+ * doesn't change how long a frame lasts.
+ */
 void ilda_set_fps_limit(int max_fps) {
 	ilda_current_fps = max_fps;
-	ilda_points_per_frame = dac_current_pps / max_fps;
+	ilda_points_per_frame = max_fps ? fplay_source_pps / max_fps : 0;
+	fplay_sched_reset();
+}
+
+/* fplay_sync_rate
+ *
+ * Set the DAC to the output rate, or to the source rate if there is no
+ * output rate or the DAC is in frame mode, which loops frames itself and
+ * so can't be resampled. The resampler converts to whatever the DAC is
+ * nominally playing at, which may be clamped, or set from elsewhere.
+ */
+static void fplay_sync_rate(void) {
+	int out = fplay_output_pps && !dac_frame_mode
+		? fplay_output_pps : fplay_source_pps;
+
+	if (!out)
+		return;
+
+	if (out != fplay_dac_pps) {
+		fplay_dac_pps = out;
+		dac_set_rate(out);
+	}
+
+	if (fplay_source_pps != fplay_resample_src
+	    || dac_nominal_pps != fplay_resample_out) {
+		fplay_resample_src = fplay_source_pps;
+		fplay_resample_out = dac_nominal_pps;
+		resample_set_rate(&fplay_resampler, fplay_source_pps,
+				  dac_nominal_pps);
+	}
+}
+
+static int fplay_resampling(void) {
+	return fplay_output_pps && !dac_frame_mode
+		&& fplay_resampler.step != RESAMPLE_ONE;
+}
+
+/* fplay_set_rate
+ *
+ * Set the rate the content was made for. WAV files set their own.
+ */
+void fplay_set_rate(int pps) {
+	/* The timeline is counted at the source rate. */
+	if (pps != fplay_source_pps) {
+		fplay_source_pps = pps;
+		fplay_sched_reset();
+	}
+
+	fplay_sync_rate();
+}
+
+/* fplay_set_output_rate
+ *
+ * Resample to pps, or play at the source rate if pps is 0.
+ */
+void fplay_set_output_rate(int pps) {
+	fplay_output_pps = pps;
+	fplay_sync_rate();
+	outputf("ild_play: output %d pps from %d", fplay_output_pps,
+		fplay_source_pps);
+}
+
+void fplay_set_resample_mode(int mode) {
+	fplay_resampler.mode = mode;
 }
 
 /* fplay_open
  *
- * Prepare the ILDA player to play a given file.
+ * Prepare the ILDA player to play a given file. ILDA files are checked
+ * and indexed first, and refused if they wouldn't play through.
  */
 int fplay_open(const char * fname) {
+	fplay_preload_stop();
+
 	FRESULT res = f_open(&fplay_file, fname, FA_READ);
 	if (res) {
 		outputf("ild_play: no file: %d", res);
 		return -1;
 	}
 
+	fplay_chunk[0].pos = fplay_chunk[1].pos = ~0;
+	fplay_chunk[0].len = fplay_chunk[1].len = 0;
+	fcache_init();
+
+	int err = fplay_index_build();
+	if (err < 0) {
+		outputf((const char *)(-err), fplay_error_detail);
+		f_close(&fplay_file);
+		return -1;
+	}
+
+	fplay_preload_start(fname);
 	ilda_reset_file();
+	fplay_sched_reset();
+	resample_reset(&fplay_resampler);
+	fplay_src_count = fplay_src_used = 0;
 
 	return 0;
 }
@@ -122,23 +379,630 @@ int fplay_open(const char * fname) {
 #define BAIL(s)	return -((int)s)
 #define BAILV(s, v) do { fplay_error_detail=(v); return -((int)s); } while(0)
 
-/* fplay_read
+/* fplay_stage_load
  *
- * A thin wrapper around fatfs's f_read. Bails out if a fatfs error
- * occurs; otherwise, returns the number of bytes read.
+ * Fill chunk c from wherever fplay_file is. Bails out if a fatfs error
+ * occurs, leaving c empty; otherwise, returns the number of bytes read.
  */
-static unsigned int fplay_read(void *buf, int n) {
+static int fplay_stage_load(struct fplay_chunk *c) {
 	unsigned int bytes_read;
 
-	FRESULT res = f_read(&fplay_file, buf, n, &bytes_read);
+	c->fil.fptr = fplay_file.fptr;
+	c->fil.curr_clust = fplay_file.clust;
+	c->fil.dsect = fplay_file.dsect;
+
+	FRESULT res = f_read(&fplay_file, c->data, FPLAY_STAGE_SIZE, &bytes_read);
 	if (res != FR_OK) {
+		c->pos = ~0;
+		c->len = 0;
 		fplay_error_detail = res;
 		BAIL("fplay_read: fatfs err %d");
 	}
 
+	c->pos = c->fil.fptr;
+	c->len = bytes_read;
+	fplay_stats.loads++;
+	fplay_stats.bytes += bytes_read;
+
 	return bytes_read;
 }
 
+/* fplay_stage_locate
+ *
+ * Put FatFs at pos, the start of a chunk: straight from the index if
+ * there is one, or else by seeking along the cluster chain.
+ */
+static int fplay_stage_locate(unsigned int pos) {
+	if (fplay_frames) {
+		fplay_file.fptr = pos;
+		fplay_file.clust = fplay_index_clust[pos / FPLAY_STAGE_SIZE];
+		fplay_file.dsect = 0;
+		return 0;
+	}
+
+	FRESULT res = f_lseek(&fplay_file, pos);
+	if (res != FR_OK) {
+		fplay_error_detail = res;
+		BAIL("fplay_read: fatfs err %d");
+	}
+
+	return 0;
+}
+
+/* fplay_stage_next
+ *
+ * Make sure the chunk after the current one is loaded. Returns 0 if the
+ * current one is the last.
+ */
+static int fplay_stage_next(void) {
+	struct fplay_chunk *c = &fplay_chunk[fplay_cur];
+	struct fplay_chunk *next = &fplay_chunk[fplay_cur ^ 1];
+	unsigned int pos = c->pos + FPLAY_STAGE_SIZE;
+
+	if (c->len < FPLAY_STAGE_SIZE)
+		return 0;
+
+	if (next->pos == pos)
+		return 1;
+
+	/* Loads are usually in order; only a seek leaves FatFs elsewhere. */
+	if (fplay_file.fptr != pos) {
+		int res = fplay_stage_locate(pos);
+		if (res < 0) return res;
+	}
+
+	int res = fplay_stage_load(next);
+	return res < 0 ? res : 1;
+}
+
+/* fplay_stage_seek
+ *
+ * Continue decoding from file offset ofs. If at is given, it is FatFs's
+ * state at the start of the chunk holding ofs. If that chunk is still
+ * loaded this costs nothing; otherwise it is loaded again.
+ */
+static int fplay_stage_seek(unsigned int ofs, const struct fplay_fil *at) {
+	unsigned int pos = ofs - ofs % FPLAY_STAGE_SIZE;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (fplay_chunk[i].pos == pos) {
+			fplay_cur = i;
+			fplay_rd = ofs - pos;
+			fplay_stats.rewinds++;
+			return 0;
+		}
+	}
+
+	if (at) {
+		fplay_file.fptr = at->fptr;
+		fplay_file.clust = at->curr_clust;
+		fplay_file.dsect = at->dsect;
+	} else {
+		int res = fplay_stage_locate(pos);
+		if (res < 0) return res;
+	}
+
+	fplay_cur ^= 1;
+	fplay_rd = ofs - pos;
+
+	int res = fplay_stage_load(&fplay_chunk[fplay_cur]);
+	return res < 0 ? res : 0;
+}
+
+/* fplay_stage_refill
+ *
+ * Move on to the next chunk once the current one has been used up.
+ * Returns 0 at the end of the file.
+ */
+static int fplay_stage_refill(void) {
+	if (fplay_rd < fplay_chunk[fplay_cur].len)
+		return 1;
+
+	int res = fplay_stage_next();
+	if (res <= 0) return res;
+
+	fplay_cur ^= 1;
+	fplay_rd = 0;
+
+	return fplay_chunk[fplay_cur].len > 0;
+}
+
+/* fplay_get
+ *
+ * Take the next n bytes of the file, and point *p at them: straight into
+ * the chunk where possible, or else into fplay_bounce, for records that
+ * cross into the next chunk or are misaligned. n is at most the size of
+ * fplay_bounce. Returns the number of bytes available, which is only
+ * short at the end of the file, or a negative error.
+ */
+static int fplay_get(const uint8_t **p, int n) {
+	int res = fplay_stage_refill();
+	if (res <= 0) return res;
+
+	struct fplay_chunk *c = &fplay_chunk[fplay_cur];
+	if (n <= c->len - fplay_rd && !(fplay_rd & 1)) {
+		*p = c->data + fplay_rd;
+		fplay_rd += n;
+		return n;
+	}
+
+	int got = 0;
+	while (got < n) {
+		res = fplay_stage_refill();
+		if (res < 0) return res;
+		if (res == 0) break;
+
+		c = &fplay_chunk[fplay_cur];
+		int len = c->len - fplay_rd;
+		if (len > n - got)
+			len = n - got;
+
+		memcpy(fplay_bounce + got, c->data + fplay_rd, len);
+		fplay_rd += len;
+		got += len;
+	}
+
+	*p = fplay_bounce;
+	return got;
+}
+
+/* fplay_read
+ *
+ * Copy the next n bytes of the file to buf. Bails out if a fatfs error
+ * occurs; otherwise, returns the number of bytes read.
+ */
+static int fplay_read(void *buf, int n) {
+	const uint8_t *p;
+
+	int res = fplay_get(&p, n);
+	if (res > 0)
+		memcpy(buf, p, res);
+
+	return res;
+}
+
+static int fplay_preload_step(void);
+
+/* fplay_prefetch
+ *
+ * Load the next chunk ahead of time, if it isn't already, or the next
+ * step of a preload. This is called when there's no room for more
+ * points, so that the read is done while the DAC has a full ring to play
+ * from. Errors are left for the decoder to find when it gets there.
+ */
+void fplay_prefetch(void) {
+	unsigned int loads = fplay_stats.loads;
+
+	if (fplay_preload.loading)
+		fplay_preload_step();
+	else if (!fplay_seek_pending && fplay_chunk[fplay_cur].pos != ~0U)
+		fplay_stage_next();
+
+	fplay_stats.prefetches += fplay_stats.loads - loads;
+}
+
+/* ilda_point_size
+ *
+ * Return the size of a point record in an ILDA format, or 0 for formats
+ * that can't be played.
+ */
+static int ilda_point_size(int format) {
+	switch (format) {
+	case STATE_ILDA_0: return 8;
+	case STATE_ILDA_1: return 6;
+	case STATE_ILDA_4: return 10;
+	case STATE_ILDA_5: return 8;
+	default: return 0;
+	}
+}
+
+/* fplay_index_build
+ *
+ * Check every frame header of the file just opened, and index them if
+ * there's room. The headers are read straight through FatFs, and the
+ * chunk starts noted in order on the way, so that the cluster chain is
+ * only followed forwards. Returns 0, or a negative error if the file
+ * would fail part way through. WAV files aren't indexed.
+ */
+static int fplay_index_build(void) {
+	unsigned int ofs = 0, size = fplay_file.fsize, points = 0;
+	int frames = 0, chunk = 0;
+	int indexed = size / FPLAY_STAGE_SIZE < FPLAY_INDEX_CHUNKS;
+	uint8_t hdr[32];
+	UINT br;
+	FRESULT res;
+
+	fplay_frames = 0;
+	fplay_wav = 0;
+
+	while (ofs < size) {
+		for (; indexed && chunk * FPLAY_STAGE_SIZE < ofs + sizeof(hdr); chunk++) {
+			res = f_lseek(&fplay_file, chunk * FPLAY_STAGE_SIZE);
+			if (res != FR_OK) goto fatfs_err;
+			fplay_index_clust[chunk] = fplay_file.clust;
+		}
+
+		res = f_lseek(&fplay_file, ofs);
+		if (res == FR_OK)
+			res = f_read(&fplay_file, hdr, sizeof(hdr), &br);
+		if (res != FR_OK) goto fatfs_err;
+
+		if (!ofs && br >= 4 && !memcmp(hdr, "RIFF", 4)) {
+			fplay_wav = 1;
+			return 0;
+		}
+
+		if (br != sizeof(hdr))
+			BAILV("ilda: frame %d header cut short", frames);
+		if (memcmp(hdr, "ILDA\0\0\0", 7))
+			BAILV("ilda: no header at frame %d", frames);
+
+		int size_pt = ilda_point_size(hdr[7]);
+		if (!size_pt)
+			BAILV("ilda: bad format %d", hdr[7]);
+
+		/* Zero-length means end of file */
+		int npoints = hdr[24] << 8 | hdr[25];
+		if (!npoints)
+			break;
+
+		unsigned int len = sizeof(hdr) + npoints * size_pt;
+		if (len > size - ofs)
+			BAILV("ilda: frame %d cut short", frames);
+
+		if (frames == FPLAY_INDEX_FRAMES)
+			indexed = 0;
+
+		if (indexed) {
+			fplay_index[frames].ofs = ofs;
+			fplay_index[frames].first_point = points;
+			fplay_index[frames].points = npoints;
+			fplay_index[frames].format = hdr[7];
+		}
+
+		frames++;
+		points += npoints;
+		ofs += len;
+	}
+
+	for (; indexed && chunk * FPLAY_STAGE_SIZE <= size; chunk++) {
+		res = f_lseek(&fplay_file, chunk * FPLAY_STAGE_SIZE);
+		if (res != FR_OK) goto fatfs_err;
+		fplay_index_clust[chunk] = fplay_file.clust;
+	}
+
+	if (!indexed) {
+		outputf("ild_play: %d frames, not indexed", frames);
+		return 0;
+	}
+
+	fplay_index_end = ofs;
+	fplay_index_points = points;
+	fplay_frames = frames;
+	outputf("ild_play: %d frames, %u points", frames, points);
+
+	return 0;
+
+fatfs_err:
+	fplay_error_detail = res;
+	BAIL("fplay_read: fatfs err %d");
+}
+
+/* fplay_goto
+ *
+ * Play frame n next, or end the file if n is past the last frame. Needs
+ * the index.
+ */
+static void fplay_goto(int n) {
+	fplay_state = STATE_BETWEEN_FRAMES;
+	fplay_points_left = 0;
+	fplay_frame_next = n;
+
+	fplay_cache_abort();
+	fplay_seek_pending = 1;
+	fplay_seek_ofs = n < fplay_frames ? fplay_index[n].ofs : fplay_index_end;
+}
+
+/* fplay_seek_frame
+ *
+ * Play on from frame n, once the current batch is out. Returns -1 if
+ * there is no such frame, or no index.
+ */
+int fplay_seek_frame(int n) {
+	if (n < 0 || n >= fplay_frames)
+		return -1;
+
+	fplay_src_count = fplay_src_used = 0;
+	fplay_goto(n);
+	fplay_sched_reset();
+
+	return 0;
+}
+
+/* fplay_seek_time
+ *
+ * Play on from ms into the show, wrapping around at its end. Under an fps
+ * limit every frame lasts as long, so the frame is found directly;
+ * otherwise frames last as long as their points take at the source rate,
+ * and the frame is looked up by point.
+ */
+int fplay_seek_time(unsigned int ms) {
+	int n;
+
+	if (!fplay_frames || !fplay_index_points)
+		return -1;
+
+	if (ilda_points_per_frame) {
+		n = (uint64_t)ms * ilda_current_fps / 1000 % fplay_frames;
+	} else {
+		unsigned int point = (uint64_t)ms * fplay_source_pps / 1000
+			% fplay_index_points;
+		int lo = 0, hi = fplay_frames - 1;
+
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (fplay_index[mid].first_point <= point)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+
+		n = lo;
+	}
+
+	return fplay_seek_frame(n);
+}
+
+/* fplay_set_reverse
+ *
+ * Play frames last to first. Each frame is still drawn forwards. This
+ * needs the index; without one, files play forwards.
+ */
+void fplay_set_reverse(int reverse) {
+	fplay_reverse = !!reverse;
+}
+
+/* fplay_queued
+ *
+ * Return how many points at the source rate are in the ring.
+ */
+static int fplay_queued(void) {
+	int n = dac_fullness();
+
+	if (dac_nominal_pps > 0)
+		n = (int64_t)n * fplay_source_pps / dac_nominal_pps;
+
+	return n;
+}
+
+/* fplay_sched_reset
+ *
+ * Start the show clock over, after an open or a seek, or a change to the
+ * timeline's rate. If the DAC is running, the timer takes over at once.
+ */
+void fplay_sched_reset(void) {
+	fplay_sched.decoded = 0;
+	fplay_sched.running = 0;
+	fplay_sched.resync = 1;
+
+	if (dac_get_state() == DAC_PLAYING)
+		fplay_sched_start();
+}
+
+/* fplay_sched_start
+ *
+ * Note that the DAC has started playing what has been decoded, and run
+ * the show clock from the timer from now on. Once started, it keeps
+ * running through underflows until the next reset.
+ */
+void fplay_sched_start(void) {
+	/* In frame mode the DAC loops frames itself, and the clock stays
+	 * on points. */
+	if (fplay_sched.running || !fplay_source_pps || dac_frame_mode)
+		return;
+
+	int64_t played = (int64_t)fplay_sched.decoded - fplay_queued();
+	fplay_sched.start = bcm2835_st_read()
+		- played * 1000000 / fplay_source_pps;
+	fplay_sched.running = 1;
+}
+
+/* fplay_clock
+ *
+ * Return the timeline position that the next point decoded will be shown
+ * at.
+ */
+static int64_t fplay_clock(void) {
+	if (!fplay_sched.running)
+		return fplay_sched.decoded;
+
+	int64_t us = bcm2835_st_read() - fplay_sched.start;
+	return us * fplay_source_pps / 1000000 + fplay_queued();
+}
+
+/* fplay_schedule
+ *
+ * Pick the next frame to play: skip over any whose slot is already over,
+ * and note how late the one that is due starts.
+ */
+static void fplay_schedule(void) {
+	int n = fplay_frame_next, skipped = 0;
+
+	if (fplay_wav || !fplay_source_pps)
+		return;
+
+	int64_t clock = fplay_clock();
+	if (fplay_sched.resync) {
+		fplay_sched.resync = 0;
+		fplay_sched.due = clock;
+	}
+
+	int64_t late = clock - (int64_t)fplay_sched.due;
+
+	while (n >= 0 && n < fplay_frames) {
+		int slot = ilda_points_per_frame
+			? ilda_points_per_frame : fplay_index[n].points;
+		if (late < slot)
+			break;
+
+		late -= slot;
+		fplay_sched.due += slot;
+		n += fplay_reverse ? -1 : 1;
+		skipped++;
+	}
+
+	if (skipped) {
+		fplay_stats.dropped += skipped;
+		fplay_goto(n >= 0 && n < fplay_frames ? n : fplay_frames);
+	}
+
+	/* Only a file without an index gets this far out; keep its drift to
+	 * what can be reported. */
+	int64_t limit = (int64_t)fplay_source_pps * 2000;
+	if (late > limit)
+		late = limit;
+	else if (late < -limit)
+		late = -limit;
+
+	fplay_sched.late = late;
+	fplay_stats.drift_us = late * 1000000 / fplay_source_pps;
+	if (fplay_stats.drift_us > fplay_stats.drift_max_us)
+		fplay_stats.drift_max_us = fplay_stats.drift_us;
+}
+
+/* fplay_set_preload
+ *
+ * Preload files opened from now on, if they fit in memory.
+ */
+void fplay_set_preload(int preload) {
+	fplay_preload.enabled = !!preload;
+}
+
+/* fplay_preload_start
+ *
+ * Set aside memory for all of the show just indexed, and open it again
+ * to load it from. Without the memory, it plays from the card as usual.
+ */
+static void fplay_preload_start(const char *fname) {
+	uint32_t bytes = fplay_index_points * sizeof(packed_point_t);
+
+	if (!fplay_preload.enabled || !fplay_frames)
+		return;
+
+	fplay_preload.points = malloc(bytes);
+	if (!fplay_preload.points) {
+		outputf("ild_play: no room to preload %u KiB", bytes >> 10);
+		return;
+	}
+
+	FRESULT res = f_open(&fplay_preload.file, fname, FA_READ);
+	if (res) {
+		outputf("ild_play: can't preload: %d", res);
+		fplay_preload_stop();
+		return;
+	}
+
+	fplay_preload.loading = 1;
+	fplay_preload.frames = fplay_preload.done = 0;
+	fplay_preload_bytes = bytes;
+}
+
+/* fplay_preload_stop
+ *
+ * Stop loading, and free the preloaded show.
+ */
+static void fplay_preload_stop(void) {
+	if (fplay_preload.loading)
+		f_close(&fplay_preload.file);
+
+	free(fplay_preload.points);
+	fplay_preload.points = NULL;
+	fplay_preload.loading = 0;
+	fplay_preload.frames = 0;
+	fplay_preload_bytes = 0;
+}
+
+/* fplay_preload_step
+ *
+ * Load up to FPLAY_PRELOAD_STEP bytes more of the show. Returns 1 if
+ * there is more to come, or 0 once all of it is loaded, or if reading it
+ * fails; frames that didn't get loaded play from the card.
+ */
+static int fplay_preload_step(void) {
+	FRESULT res = FR_OK;
+	UINT br = 0;
+	int i;
+
+	if (!fplay_preload.loading)
+		return 0;
+
+	struct fplay_index_entry *f = &fplay_index[fplay_preload.frames];
+	int size = ilda_point_size(f->format);
+	int n = f->points - fplay_preload.done;
+
+	if (n > FPLAY_PRELOAD_STEP / size)
+		n = FPLAY_PRELOAD_STEP / size;
+
+	/* Skip the frame's header */
+	if (!fplay_preload.done)
+		res = f_lseek(&fplay_preload.file, f->ofs + 32);
+	if (res == FR_OK)
+		res = f_read(&fplay_preload.file, fplay_preload.buf, n * size, &br);
+
+	if (res != FR_OK || br != n * size) {
+		outputf("ild_play: preload stopped at frame %d: %d",
+			fplay_preload.frames, res);
+		f_close(&fplay_preload.file);
+		fplay_preload.loading = 0;
+		return 0;
+	}
+
+	packed_point_t *dst = fplay_preload.points + f->first_point
+		+ fplay_preload.done;
+
+	for (i = 0; i < n; i += ILDA_MAX_POINTS_PER_LOOP) {
+		int k, batch = n - i;
+		if (batch > ILDA_MAX_POINTS_PER_LOOP)
+			batch = ILDA_MAX_POINTS_PER_LOOP;
+
+		ilda_decode_records(f->format, fplay_preload.buf + i * size,
+			batch, fplay_preload.batch);
+		for (k = 0; k < batch; k++)
+			dac_pack_point(dst + i + k, &fplay_preload.batch[k]);
+	}
+
+	fplay_preload.done += n;
+	if (fplay_preload.done < f->points)
+		return 1;
+
+	fplay_preload.done = 0;
+	if (++fplay_preload.frames < fplay_frames)
+		return 1;
+
+	f_close(&fplay_preload.file);
+	fplay_preload.loading = 0;
+	outputf("ild_play: preloaded %d frames", fplay_frames);
+	return 0;
+}
+
+/* fplay_preload_progress
+ *
+ * Return how much of the show has been preloaded, in percent, or -1 if
+ * it isn't being preloaded.
+ */
+int fplay_preload_progress(void) {
+	if (!fplay_preload.points)
+		return -1;
+
+	if (fplay_preload.frames >= fplay_frames)
+		return 100;
+
+	uint32_t loaded = fplay_index[fplay_preload.frames].first_point
+		+ fplay_preload.done;
+	return (uint64_t)loaded * 100 / fplay_index_points;
+}
+
 /* fplay_read_check
  *
  * A helper macro around fplay_read: checks that the number of bytes read
@@ -150,6 +1014,16 @@ static unsigned int fplay_read(void *buf, int n) {
 	if (res != (len)) BAIL("short read");	\
 } while(0)
 
+/* fplay_get_check
+ *
+ * The same around fplay_get.
+ */
+#define fplay_get_check(ptr, len) do {		\
+	int res = fplay_get(&(ptr), (len));	\
+	if (res < 0) return res;		\
+	if (res != (len)) BAIL("short read");	\
+} while(0)
+
 /* wav_read_file_header
  *
  * Read the header for a WAV file, and save playback information.
@@ -231,12 +1105,14 @@ static int wav_read_file_header(int file_size) {
 	fplay_repeat_count = 1;
 	fplay_state = STATE_WAV;
 
-	dac_set_rate(point_rate);
+	fplay_set_rate(point_rate);
 
 	/* Phew! */
 	return 1;
 }
 
+static void ilda_frame_repeats(int npoints);
+
 /* ilda_read_frame_header
  *
  * Read the header for an ILDA frame (formats 0/1/4/5 all use the same
@@ -257,26 +1133,38 @@ static int ilda_read_frame_header(void) {
 	 * the first. */
 	int npoints = buf[0] << 8 | buf[1];
 
-	/* Do we need to repeat this frame? */
-	if (ilda_points_per_frame) {
-		int points_needed = ilda_points_per_frame - fplay_offset;
+	ilda_frame_repeats(npoints);
+
+	return 0;
+}
+
+/* ilda_frame_repeats
+ *
+ * Set up to play a frame of npoints points, as many times as it takes to
+ * fill out what is left of its slot. Frames that would be dropped have
+ * been skipped by fplay_schedule() already, so the one that is due plays
+ * at least once, even if it overruns.
+ */
+static void ilda_frame_repeats(int npoints) {
+	/* Do we need to repeat this frame? (Not the empty one that ends
+	 * the file.) */
+	if (ilda_points_per_frame && npoints) {
+		int points_needed = ilda_points_per_frame - fplay_sched.late;
 
 		/* Round roughly halfway through the frame. */
 		fplay_repeat_count = (points_needed + (npoints / 2)) / npoints;
-
-		/* Don't drop frames. (Maybe we will in the future...) */
 		if (fplay_repeat_count <= 0)
 			fplay_repeat_count = 1;
-
-		fplay_offset += (fplay_repeat_count * npoints) - ilda_points_per_frame;
 	} else {
 		fplay_repeat_count = 1;
 	}
 
+	if (npoints)
+		fplay_sched.due += ilda_points_per_frame
+			? ilda_points_per_frame : npoints;
+
 	outputf("p %d x%d", npoints, fplay_repeat_count);
 	fplay_points_left = npoints;
-
-	return 0;
 }
 
 /* ilda_palette_point
@@ -321,11 +1209,67 @@ static void ilda_tc_point(dac_point_t *p, int r, int g, int b, int flags) {
 	}
 }
 
+/* ilda_decode_records
+ *
+ * Decode points point records of an ILDA format from bytes, which must be
+ * 2-byte aligned, into batch.
+ */
+static void ilda_decode_records(int format, const uint8_t *bytes, int points,
+				dac_point_t *batch) {
+	const uint16_t *words = (const uint16_t *)bytes;
+	dac_point_t p = { 0 };
+	int i;
+
+	switch (format) {
+	case STATE_ILDA_0:
+		/* 3D w/ palette */
+		for (i = 0; i < points; i++) {
+			p.x = rev16(words[4*i]);
+			p.y = rev16(words[4*i + 1]);
+			ilda_palette_point(&p, rev16(words[4*i + 3]));
+			batch[i] = p;
+		}
+		break;
+
+	case STATE_ILDA_1:
+		/* 2D w/ palette */
+		for (i = 0; i < points; i++) {
+			p.x = rev16(words[3*i]);
+			p.y = rev16(words[3*i + 1]);
+			ilda_palette_point(&p, rev16(words[3*i + 2]));
+			batch[i] = p;
+		}
+		break;
+	
+	case STATE_ILDA_4:
+		/* 3D truecolor */
+		for (i = 0; i < points; i++) {
+			p.x = rev16(words[5*i]);
+			p.y = rev16(words[5*i + 1]);
+			const uint8_t *b = bytes + 10*i;
+			ilda_tc_point(&p, b[9], b[8], b[7], b[6]);
+			batch[i] = p;
+		}
+		break;
+
+	case STATE_ILDA_5:
+		/* 2D truecolor */
+		for (i = 0; i < points; i++) {
+			p.x = rev16(words[4*i]);
+			p.y = rev16(words[4*i + 1]);
+			const uint8_t *b = bytes + 8*i;
+			ilda_tc_point(&p, b[7], b[6], b[5], b[4]);
+			batch[i] = p;
+		}
+		break;
+	}
+}
+
 /* wav_parse_16bit_point
  *
  * Parse a point.
  */
-static void wav_parse_16bit_point(dac_point_t *p, uint16_t *words) {
+static void wav_parse_16bit_point(dac_point_t *p, const uint16_t *words) {
 	p->u2 = words[7];
 	p->u1 = words[6];
 	p->i = words[5];
@@ -343,8 +1287,15 @@ static void wav_parse_16bit_point(dac_point_t *p, uint16_t *words) {
  */
 int fplay_read_header(void) {
 	char buf[8];
+	int ret;
+
+	if (fplay_seek_pending) {
+		fplay_seek_pending = 0;
+		ret = fplay_stage_seek(fplay_seek_ofs, NULL);
+		if (ret < 0) return ret;
+	}
 
-	int ret = fplay_read(buf, 8);
+	ret = fplay_read(buf, 8);
 	if (ret == 0) return 0;
 	else if (ret != 8) BAIL("short read");
 
@@ -378,10 +1329,22 @@ int fplay_read_header(void) {
 
 		/* Save off the beginning of this frame, in case we
 		 * need to repeat it. */
-		fplay_frame_start.fptr = fplay_file.fptr;
-		fplay_frame_start.curr_clust = fplay_file.clust;
-		fplay_frame_start.dsect = fplay_file.dsect;
+		ret = fplay_stage_refill();
+		if (ret < 0) return ret;
+		fplay_frame_start.ofs = fplay_chunk[fplay_cur].pos + fplay_rd;
+		fplay_frame_start.fil = fplay_chunk[fplay_cur].fil;
 		ilda_frame_pointcount = fplay_points_left;
+		fplay_frame = fplay_frame_next++;
+		fplay_stats.frames++;
+
+		/* Keep the frame as it's decoded, if there's room. */
+		fcache_key_t key;
+		fplay_cache_key(&key, fplay_frame);
+		fplay_fill = fcache_fill_begin(&key, fplay_points_left,
+			fplay_frame_start.ofs
+			+ fplay_points_left * ilda_point_size(fplay_state));
+		if (fplay_fill >= 0)
+			fcache_cursor_start(&fplay_fill_cur, fplay_fill);
 		break;
 
 	default:
@@ -391,16 +1354,6 @@ int fplay_read_header(void) {
 	return 1;
 }
 
-#define ILDA_MAX_POINTS_PER_LOOP	25
-
-/* ilda_read_points
- *
- * Produce up to max_points of output to be sent to the DAC.
- *
- * Returns 0 if the end of the file has been reached, -1 if an
- * error occurs, or the number of bytes actually written otherwise.
- */
-
 static inline void save_small_frame(struct sfb *sfb, struct dac_point *p) {
 	if (ilda_frame_pointcount <= SMALL_FRAME_THRESHOLD) {
 		sfb->x = p->x;
@@ -412,24 +1365,226 @@ static inline void save_small_frame(struct sfb *sfb, struct dac_point *p) {
 	}
 }
 
-int NOINLINE ilda_do_read_points(int points, packed_point_t *pp);
+static int NOINLINE ilda_decode_points(int points, dac_point_t *batch);
+
+/* fplay_memory_frame
+ *
+ * Set up to play frame n from memory: from the preloaded show, loading
+ * the frame now if the loader has got as far as it, or else from the
+ * cache. Returns its point count, and sets *next to where the file
+ * carries on after it; or returns 0 if it has to be read from the file.
+ */
+static int fplay_memory_frame(int n, uint32_t *next) {
+	fcache_key_t key;
+	int points;
+
+	if (fplay_preload.points && n < fplay_frames) {
+		while (n == fplay_preload.frames && fplay_preload_step())
+			;
+
+		if (n < fplay_preload.frames) {
+			fplay_preload_base = fplay_index[n].first_point;
+			fplay_state = STATE_PRELOADED;
+			*next = n + 1 < fplay_frames
+				? fplay_index[n + 1].ofs : fplay_index_end;
+			return fplay_index[n].points;
+		}
+	}
+
+	fplay_cache_key(&key, n);
+	int e = fcache_lookup(&key, &points, next);
+	if (e < 0)
+		return 0;
+
+	fcache_cursor_start(&fplay_cached_cur, e);
+	fplay_state = STATE_CACHED;
+	return points;
+}
+
+/* fplay_memory_play
+ *
+ * Play the next frame from memory, if it's there, and pick the file up
+ * again after it. Returns 1 if so.
+ */
+static int fplay_memory_play(void) {
+	uint32_t next;
+
+	if (fplay_wav || (fplay_frames && fplay_frame_next >= fplay_frames))
+		return 0;
+
+	int points = fplay_memory_frame(fplay_frame_next, &next);
+	if (!points)
+		return 0;
+
+	fplay_frame = fplay_frame_next++;
+	fplay_seek_pending = 1;
+	fplay_seek_ofs = next;
+
+	ilda_frame_repeats(points);
+	ilda_frame_pointcount = points;
+	return 1;
+}
+
+/* ilda_begin_points
+ *
+ * Get ready to decode points: read the next frame's header if needed.
+ * Returns 1, or 0 at the end of the file, or a negative error.
+ */
+static int ilda_begin_points(void) {
+	if (fplay_state == STATE_BETWEEN_FRAMES)
+		fplay_schedule();
+
+	if (fplay_state == STATE_BETWEEN_FRAMES && !fplay_memory_play()) {
+		/* With an index, the end needn't be read from the file. */
+		if (fplay_frames && fplay_frame_next >= fplay_frames)
+			return 0;
 
-int ilda_read_points(int points, packed_point_t *pp) {
-	if (fplay_state == STATE_BETWEEN_FRAMES) {
 		int res = fplay_read_header();
 		if (res <= 0) return res;
 	}
 
-	return ilda_do_read_points(points, pp);
+	/* Geometry changes take effect at the start of a frame, so that no
+	 * frame is drawn half in one geometry and half in another. */
+	if (fplay_state == STATE_WAV || fplay_points_left == ilda_frame_pointcount)
+		transform_latch();
+
+	return 1;
 }
 
-int NOINLINE ilda_do_read_points(int points, packed_point_t *pp) {
-	int i;
+/* ilda_read_resampled
+ *
+ * Produce up to points points at the output rate. Source points
+ * are decoded a block at a time into fplay_src, and fed through the
+ * resampler as it needs them. A new frame isn't started once some output
+ * has been produced, so that it gets its own geometry.
+ */
+static int ilda_read_resampled(int points, dac_buffer_point_t *pp) {
+	dac_point_t out[ILDA_MAX_POINTS_PER_LOOP];
+	int n = 0;
+
+	if (points > ILDA_MAX_POINTS_PER_LOOP)
+		points = ILDA_MAX_POINTS_PER_LOOP;
+
+	while (n < points) {
+		if (fplay_src_used == fplay_src_count) {
+			if (n && (fplay_state == STATE_BETWEEN_FRAMES
+			    || fplay_points_left == ilda_frame_pointcount))
+				break;
+
+			int res = ilda_begin_points();
+			if (res < 0) return res;
+			if (res == 0) break;
+
+			res = ilda_decode_points(ILDA_MAX_POINTS_PER_LOOP, fplay_src);
+			if (res < 0) return res;
+
+			fplay_src_count = res;
+			fplay_src_used = 0;
+		}
+
+		int used;
+		n += resample_block(&fplay_resampler, fplay_src + fplay_src_used,
+			fplay_src_count - fplay_src_used, &used, out + n, points - n);
+		fplay_src_used += used;
+	}
+
+	if (n)
+		dac_store_points(pp, out, n);
+
+	return n;
+}
+
+/* ilda_read_points
+ *
+ * Produce up to max_points of output to be sent to the DAC,
+ * resampled to the output rate if there is one.
+ *
+ * Returns 0 if the end of the file has been reached, -1 if an
+ * error occurs, or the number of bytes actually written otherwise.
+ */
+int ilda_read_points(int points, dac_buffer_point_t *pp) {
+	dac_point_t batch[ILDA_MAX_POINTS_PER_LOOP];
+
+	fplay_sync_rate();
+
+	if (fplay_resampling())
+		return ilda_read_resampled(points, pp);
+
+	int res = ilda_begin_points();
+	if (res <= 0) return res;
 
-	union {
-		uint16_t words[8 * ILDA_MAX_POINTS_PER_LOOP];
-		uint8_t bytes[16 * ILDA_MAX_POINTS_PER_LOOP];
-	} ilda_buffer;
+	/* WAV files are sampled at their own rate; only ILDA streams are
+	 * optimized. Resampled streams aren't either, as the resampler
+	 * needs the DAC to hold the output rate. */
+	int optimize = fplay_state != STATE_WAV;
+
+	res = ilda_decode_points(points, batch);
+	if (res <= 0) return res;
+
+	if (optimize)
+		dac_opt_process(batch, res);
+
+	dac_store_points(pp, batch, res);
+
+	return res;
+}
+
+/* ilda_read_frame
+ *
+ * Read one whole frame into a frame-mode buffer of max points. Rather
+ * than re-reading the frame to honor the fps limit, the number of times
+ * it should be shown is returned in *loops and the DAC loops it itself.
+ * Points beyond max are read and dropped. In frame mode the DAC would
+ * replay the optimizer's rate change tags without their queued rates, so
+ * frames are neither optimized nor resampled.
+ *
+ * Returns the number of points stored, 0 at the end of the file, or a
+ * negative error.
+ */
+int ilda_read_frame(dac_buffer_point_t *pp, int max, int *loops) {
+	dac_point_t batch[ILDA_MAX_POINTS_PER_LOOP];
+	int n = 0;
+
+	fplay_sync_rate();
+
+	int res = ilda_begin_points();
+	if (res <= 0) return res;
+
+	if (fplay_state == STATE_WAV)
+		BAIL("frame mode needs an ILDA file");
+
+	*loops = fplay_repeat_count;
+	fplay_repeat_count = 1;
+
+	while (fplay_points_left) {
+		res = ilda_decode_points(ILDA_MAX_POINTS_PER_LOOP, batch);
+		if (res < 0) return res;
+
+		if (res > max - n)
+			res = max - n;
+		if (res > 0) {
+			dac_store_points(pp + n, batch, res);
+			n += res;
+		}
+	}
+
+	/* The DAC plays the rest of the loops itself. */
+	fplay_sched.decoded += (uint64_t)(*loops - 1) * ilda_frame_pointcount;
+
+	return n;
+}
+
+/* ilda_decode_points
+ *
+ * Decode up to points points of the current frame into batch, and move
+ * on to the next frame (or repeat this one) at its end. Returns the
+ * number of points decoded, or a negative error.
+ */
+static int NOINLINE ilda_decode_points(int points, dac_point_t *batch) {
+	const uint8_t *bytes;
+	const uint16_t *words;
+	uint32_t next;
+	int i;
 
 	/* Now that we have some actual data, read from the file. */
 	if (points > fplay_points_left)
@@ -444,74 +1599,37 @@ int NOINLINE ilda_do_read_points(int points, packed_point_t *pp) {
 
 	switch (fplay_state) {
 	case STATE_ILDA_0:
-		/* 3D w/ palette */
-		fplay_read_check(ilda_buffer.bytes, 8 * points);
-		for (i = 0; i < points; i++) {
-			p.x = rev16(ilda_buffer.words[4*i]);
-			p.y = rev16(ilda_buffer.words[4*i + 1]);
-			ilda_palette_point(&p, rev16(ilda_buffer.words[4*i + 3]));
-			save_small_frame(sfb_ptr, &p);
-			dac_pack_point(pp, &p);
-			sfb_ptr++;
-			pp++;
-		}
-
-		break;
-
 	case STATE_ILDA_1:
-		/* 2D w/ palette */
-		fplay_read_check(ilda_buffer.bytes, 6 * points);
-		for (i = 0; i < points; i++) {
-			p.x = rev16(ilda_buffer.words[3*i]);
-			p.y = rev16(ilda_buffer.words[3*i + 1]);
-			ilda_palette_point(&p, rev16(ilda_buffer.words[3*i + 2]));
-			save_small_frame(sfb_ptr, &p);
-			dac_pack_point(pp, &p);
-			sfb_ptr++;
-			pp++;
-		}
-		break;
-	
 	case STATE_ILDA_4:
-		/* 3D truecolor */
-		fplay_read_check(ilda_buffer.bytes, 10 * points);
-		for (i = 0; i < points; i++) {
-			p.x = rev16(ilda_buffer.words[5*i]);
-			p.y = rev16(ilda_buffer.words[5*i + 1]);
-			uint8_t *b = ilda_buffer.bytes + 10*i;
-			ilda_tc_point(&p, b[9], b[8], b[7], b[6]);
-			save_small_frame(sfb_ptr, &p);
-			dac_pack_point(pp, &p);
-			sfb_ptr++;
-			pp++;
-		}
-		break;
-
 	case STATE_ILDA_5:
-		/* 2D truecolor */
-		fplay_read_check(ilda_buffer.bytes, 8 * points);
-		for (i = 0; i < points; i++) {
-			p.x = rev16(ilda_buffer.words[4*i]);
-			p.y = rev16(ilda_buffer.words[4*i + 1]);
-			uint8_t *b = ilda_buffer.bytes + 8*i;
-			ilda_tc_point(&p, b[7], b[6], b[5], b[4]);
-			save_small_frame(sfb_ptr, &p);
-			dac_pack_point(pp, &p);
-			sfb_ptr++;
-			pp++;
-		}
+		fplay_get_check(bytes, ilda_point_size(fplay_state) * points);
+		ilda_decode_records(fplay_state, bytes, points, batch);
+		for (i = 0; i < points; i++)
+			save_small_frame(sfb_ptr + i, &batch[i]);
 		break;
 
 	case STATE_WAV:
 		/* WAV */
-		fplay_read_check(ilda_buffer.bytes, wav_block_align * points);
+		fplay_get_check(bytes, wav_block_align * points);
+		words = (const uint16_t *)bytes;
 		for (i = 0; i < points; i++) {
-			wav_parse_16bit_point(&p, ilda_buffer.words + i * 8);
-			dac_pack_point(pp, &p);
-			pp++;
+			wav_parse_16bit_point(&p, words + i * 8);
+			batch[i] = p;
 		}
 		break;
 
+	case STATE_PRELOADED:
+		/* Frame from the preloaded show */
+		for (i = 0; i < points; i++)
+			dac_unpack_point(&batch[i], fplay_preload.points
+				+ fplay_preload_base + pt_num + i);
+		break;
+
+	case STATE_CACHED:
+		/* Frame from the cache */
+		fcache_get(&fplay_cached_cur, pt_num, batch, points);
+		break;
+
 	case STATE_SMALL_FRAME:
 		/* Small frame replay */
 		for (i = 0; i < points; i++) {
@@ -522,8 +1640,7 @@ int NOINLINE ilda_do_read_points(int points, packed_point_t *pp) {
 			p.g = sfb_ptr->g << 8;
 			p.b = sfb_ptr->b << 8;
 			sfb_ptr ++;
-			dac_pack_point(pp, &p);
-			pp++;
+			batch[i] = p;
 		}
 		break;
 
@@ -531,27 +1648,36 @@ int NOINLINE ilda_do_read_points(int points, packed_point_t *pp) {
 		panic("fplay_state: bad value");
 	}
 
+	if (fplay_fill >= 0)
+		fcache_put(&fplay_fill_cur, pt_num, batch, points);
+
 	/* Now that we've read points, advance */
 	fplay_points_left -= points;
+	fplay_sched.decoded += points;
 
 	/* Do we need to move to the next frame, or repeat this one? */
 	if (!fplay_points_left) {
+		if (fplay_fill >= 0) {
+			fcache_fill_commit(fplay_fill);
+			fplay_fill = -1;
+		}
+
 		fplay_repeat_count--;
-		if (!fplay_repeat_count) {
+		if (!fplay_repeat_count && fplay_reverse && fplay_frames) {
+			fplay_goto(fplay_frame ? fplay_frame - 1 : fplay_frames);
+		} else if (!fplay_repeat_count) {
 			fplay_state = STATE_BETWEEN_FRAMES;
+		} else if (fplay_memory_frame(fplay_frame, &next)) {
+			/* Repeated from memory */
+			fplay_points_left = ilda_frame_pointcount;
 		} else if (ilda_frame_pointcount <= SMALL_FRAME_THRESHOLD) {
 			fplay_state = STATE_SMALL_FRAME;
 			fplay_points_left = ilda_frame_pointcount;
 		} else {
-			fplay_file.fptr = fplay_frame_start.fptr;
-			fplay_file.clust = fplay_frame_start.curr_clust;
-			fplay_file.dsect = fplay_frame_start.dsect;
+			int res = fplay_stage_seek(fplay_frame_start.ofs,
+				&fplay_frame_start.fil);
+			if (res < 0) return res;
 			fplay_points_left = ilda_frame_pointcount;
-
-#if !_FS_TINY
-			if (disk_read(fplay_file.fs->drv, fplay_file.buf, fplay_file.dsect, 1))
-				return -1;
-#endif
 		}
 	}
 
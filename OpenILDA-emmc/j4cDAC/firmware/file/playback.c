@@ -16,19 +16,185 @@
  */
 
 #include <dac.h>
+#include <dac_frame.h>
 #include <file_player.h>
 #include <lightengine.h>
 #include <playback.h>
 #include <serial.h>
 #include <tables.h>
 #include <string.h>
+#include <bcm2835.h>
 
 int ilda_open(const char * fname);
 
-int ilda_read_points(int max_points, packed_point_t *p);
+int ilda_read_points(int max_points, dac_buffer_point_t *p);
+int ilda_read_frame(dac_buffer_point_t *pp, int max, int *loops);
 void ilda_reset_file(void);
 extern int fplay_error_detail;
 
+/* Frame read but not yet accepted by dac_frame_commit(). */
+static int playback_frame_points;
+static int playback_frame_loops;
+
+/* Set when the file ends or fails, with dac_frame_out.repeats at the
+ * time: the DAC is stopped once that count moves, that is, once the last
+ * frame has been shown as many times as it asked for. */
+static int playback_frame_done;
+static uint32_t playback_frame_done_repeats;
+
+/* playback_refill_frame
+ *
+ * Frame-mode counterpart of playback_refill: read the file a whole frame
+ * at a time and hand each one to the DAC, which keeps looping the current
+ * frame until the next is committed.
+ */
+static void playback_refill_frame(void) {
+	int dstate = dac_get_state();
+
+	if (dstate == DAC_IDLE) {
+		if (le_get_state() != LIGHTENGINE_READY)
+			return;
+
+		playback_frame_points = 0;
+		playback_frame_done = 0;
+		dac_prepare();
+		return;
+	}
+
+	/* Frame mode never underflows, so without this the last frame of a
+	 * file would be looped until someone sent a stop. */
+	if (playback_frame_done) {
+		if (playback_source_flags & ILDA_PLAYER_PLAYING) {
+			playback_frame_done = 0;
+		} else {
+			if (dstate == DAC_PLAYING
+			    && dac_frame_out.repeats == playback_frame_done_repeats)
+				return;
+			playback_frame_done = 0;
+			dac_stop(0);
+			return;
+		}
+	}
+
+	/* Still holding a frame from last time? */
+	if (playback_frame_points) {
+		if (dac_frame_commit(playback_frame_points, playback_frame_loops) < 0)
+			return;
+
+		playback_frame_points = 0;
+		if (dstate == DAC_PREPARED)
+			dac_start();
+	}
+
+	if (!(playback_source_flags & ILDA_PLAYER_PLAYING))
+		return;
+
+	dac_buffer_point_t *ptr = dac_frame_get_buffer();
+	int i = ilda_read_frame(ptr, DAC_FRAME_MAX_POINTS, &playback_frame_loops);
+
+	if (i < 0) {
+		outputf((const char *)(-i), fplay_error_detail);
+		playback_source_flags &= ~ILDA_PLAYER_PLAYING;
+		playback_frame_done = 1;
+	} else if (i == 0) {
+		ilda_reset_file();
+
+		if (playback_source_flags & ILDA_PLAYER_REPEAT) {
+			outputf("rep");
+		} else {
+			outputf("done");
+			playback_source_flags &= ~ILDA_PLAYER_PLAYING;
+			playback_frame_done = 1;
+		}
+	} else {
+		playback_frame_points = i;
+	}
+
+	if (playback_frame_done)
+		playback_frame_done_repeats = dac_frame_out.repeats;
+}
+
+/* Start threshold
+ *
+ * Rather than always waiting for the ring to fill, the DAC is started
+ * once it holds enough points to ride out the longest gap seen between
+ * two reads from the file, at the current point rate, plus a margin. Read
+ * throughput is tracked too: if the file can't be read as fast as it is
+ * played, no prefill short of the whole ring is safe.
+ */
+#define PLAYBACK_PREFILL_MIN		64
+#define PLAYBACK_PREFILL_MARGIN		50	/* percent */
+
+static uint32_t playback_last_read;		/* ST time of the last read, or 0 */
+static uint32_t playback_max_gap;		/* us; decays at each start */
+static uint32_t playback_read_pps;		/* smoothed read throughput */
+int playback_prefill;					/* threshold chosen at last start */
+
+/* playback_measure
+ *
+ * Account for a read of n points that finished at now.
+ */
+static void playback_measure(uint32_t now, int n) {
+	uint32_t gap = now - playback_last_read;
+	uint32_t last = playback_last_read;
+	playback_last_read = now;
+
+	if (!last || !gap || gap > 1000000)
+		return;
+
+	if (gap > playback_max_gap)
+		playback_max_gap = gap;
+
+	int32_t pps = (uint64_t)n * 1000000 / gap;
+	playback_read_pps += (pps - (int32_t)playback_read_pps) / 8;
+}
+
+/* playback_start_threshold
+ *
+ * Work out how full the ring should be before the DAC starts.
+ */
+static int playback_start_threshold(void) {
+	int capacity = dac_get_buffer_size() - 1;
+	int pps = dac_current_pps;
+
+	if (playback_read_pps <= pps)
+		return capacity;
+
+	int points = (uint64_t)pps * playback_max_gap
+		* (100 + PLAYBACK_PREFILL_MARGIN) / 100 / 1000000;
+
+	if (points < PLAYBACK_PREFILL_MIN)
+		points = PLAYBACK_PREFILL_MIN;
+
+	/* An explicit latency target can only ask for more. */
+	int low = dac_latency_low_points();
+	if (points < low)
+		points = low;
+
+	if (points > capacity)
+		points = capacity;
+
+	return points;
+}
+
+/* playback_start
+ *
+ * Start the DAC, reporting the prefill it started with.
+ */
+static void playback_start(int threshold) {
+	playback_prefill = threshold;
+	outputf("start: fill %d/%d, gap %d us, read %d pps, margin %d%%",
+		dac_fullness(), threshold, playback_max_gap, playback_read_pps,
+		PLAYBACK_PREFILL_MARGIN);
+
+	/* Let an old slow read age out, rather than holding every later
+	 * start to it. */
+	playback_max_gap -= playback_max_gap / 4;
+
+	dac_start();
+	fplay_sched_start();
+}
+
 /* playback_refill
  *
  * If we're playing a file from the SD card, read some points from it
@@ -42,9 +208,14 @@ static void playback_refill(void) {
 	if (playback_src != SRC_ILDAPLAYER)
 		return;
 
+	if (dac_frame_mode) {
+		playback_refill_frame();
+		return;
+	}
+
 	/* How much data do we have room for? */
 	int dlen = dac_request();
-	packed_point_t *ptr = dac_request_addr();
+	dac_buffer_point_t *ptr = dac_request_addr();
 
 	/* Have we underflowed? */
 	if (dlen < 0) {
@@ -58,8 +229,13 @@ static void playback_refill(void) {
 
 	/* If we don't have any more room... */
 	if (dlen == 0) {
+		/* Time spent waiting for room isn't a slow read. */
+		playback_last_read = 0;
+
 		if (dac_get_state() == DAC_PREPARED)
-			dac_start();
+			playback_start(dac_fullness());
+		else if (playback_source_flags & ILDA_PLAYER_PLAYING)
+			fplay_prefetch();
 		return;
 	}
 
@@ -73,6 +249,7 @@ static void playback_refill(void) {
 
 	/* Read some points from the file. */
 	i = ilda_read_points(dlen, ptr);
+	playback_measure(BCM2835_ST->CLO, i > 0 ? i : 0);
 
 	if (i < 0) {
 		outputf((const char *)(-i), fplay_error_detail);
@@ -87,7 +264,8 @@ static void playback_refill(void) {
 
 			/* If the whole file didn't fit in the
 			 * buffer, we may have to start it now. */
-			dlen = 0;
+			if (dac_get_state() == DAC_PREPARED)
+				playback_start(dac_fullness());
 
 			playback_source_flags &= ~ILDA_PLAYER_PLAYING;
 		}
@@ -95,9 +273,12 @@ static void playback_refill(void) {
 		dac_advance(i);
 	}
 
-	/* If the buffer is nearly full, start it up */
-	if (dlen < 200 && dac_get_state() == DAC_PREPARED)
-		dac_start();
+	/* If the buffer has enough in it, start it up */
+	if (dac_get_state() == DAC_PREPARED) {
+		int threshold = playback_start_threshold();
+		if (dac_fullness() >= threshold)
+			playback_start(threshold);
+	}
 }
 
 INITIALIZER(poll, playback_refill)
@@ -19,7 +19,12 @@ typedef uint32_t mem_ptr_t;
 #define PACK_STRUCT_BEGIN
 #define PACK_STRUCT_END
 
+#ifdef PC_BUILD
+/* The host's <endian.h> has this, and <stdlib.h> brings it in. */
+#include <endian.h>
+#else
 #define BYTE_ORDER LITTLE_ENDIAN
+#endif
 
 #ifndef NULL
 #define NULL 0
@@ -18,12 +18,42 @@
 #ifndef DAC_H
 #define DAC_H
 
-#define DAC_BUFFER_POINTS	2048//1800
+/* The point ring is allocated at startup, and can be resized while the
+ * DAC is idle. Sizes are powers of two; the ring indices are 16 bits. */
+#define DAC_BUFFER_DEFAULT_POINTS	2048
+#define DAC_BUFFER_MIN_POINTS		256
+#define DAC_BUFFER_MAX_POINTS		65536
 #define DAC_INSTRUMENT_TIME	1
 
+/* If set, dac_buffer holds pre-encoded SPI words (encoded_point_t) rather
+ * than packed_point_t, and the FIQ just streams them out. The Makefile
+ * sets this from DAC_BUFFER_ENCODED. */
+#ifndef DAC_BUFFER_ENCODED
+#define DAC_BUFFER_ENCODED	0
+#endif
+
+/* What the output engine does when the point ring runs dry: stop the DAC
+ * (and wait for dac_prepare), or keep running with the lasers blanked
+ * and either hold the scanners where they are or move them to the park
+ * position. In the last two cases output resumes as soon as points are
+ * written again. */
+#define DAC_UNDERFLOW_STOP		0
+#define DAC_UNDERFLOW_HOLD		1
+#define DAC_UNDERFLOW_PARK		2
+
+/* Offsets into dac_underflow_t, for fiq_handler.S */
+#define DAC_UNDERFLOW_POLICY	0
+#define DAC_UNDERFLOW_COUNT		4
+#define DAC_UNDERFLOW_STARVED	8
+#define DAC_UNDERFLOW_CURRENT	12
+#define DAC_UNDERFLOW_LONGEST	16
+#define DAC_UNDERFLOW_PARK_XY	20
+
 #ifndef __ASSEMBLER__
 
 #include <protocol.h>
+#include <transform.h>
+#include <dac_driver.h>
 
 enum dac_state {
 	DAC_IDLE = 0,
@@ -31,17 +61,26 @@ enum dac_state {
 	DAC_PLAYING = 2
 };
 
+/* Output engines. The FIQ engine writes one point per timer interrupt;
+ * the DMA engine streams whole blocks of points through SPI0 and is only
+ * serviced by the CPU from the main loop. */
+enum dac_engine {
+	DAC_ENGINE_FIQ = 0,
+	DAC_ENGINE_DMA = 1
+};
+
 #define DAC_FLAG_SHUTTER	(1 << 0)
 #define DAC_FLAG_STOP_UNDERFLOW	(1 << 1)
 #define DAC_FLAG_STOP_ESTOP	(1 << 2)
 #define DAC_FLAG_STOP_SRCSWITCH	(1 << 3)
 #define DAC_FLAG_STOP_ALL	0x0E
 
-#define DAC_RATE_BUFFER_SIZE	200
+#define DAC_RATE_BUFFER_SIZE	256
 
-/* This is the maximum point rate that we advertise in our periodic
- * broadcast packet. 100kpps ought to be enough for anyone. */
-#define DAC_MAX_POINT_RATE	100000
+/* Ceiling on the point rate; at this, the 1MHz system timer gives five
+ * ticks a point. What the board can actually sustain is measured by
+ * dac_calibrate(), as dac_max_rate. */
+#define DAC_MAX_POINT_RATE	200000
 
 typedef struct packed_point_t {
 	int16_t x;
@@ -62,7 +101,7 @@ static inline void dac_pack_point(packed_point_t *dest, dac_point_t *src) {
 	dest->y = src->y;
 
 	#define U(color) ((uint32_t)(src->color))
-#ifdef __arm__
+#ifndef __thumb2__
        dest->irg = (src->g >> 4) | ((U(r) & 0xFFF0) << 8) | ((U(i) & 0xFFF0) << 16);
        dest->i12 = (U(i) & 0x00F0) | ((U(u2) & 0xFFF0) << 4) | ((U(u1) & 0xFFF0) << 20);
        dest->bf = (src->b >> 4) | (src->control & 0xF000);
@@ -86,6 +125,7 @@ static inline void dac_pack_point(packed_point_t *dest, dac_point_t *src) {
 	asm("bfc %0, 0, 12" : "+r" (control));
 	dest->bf = control | (src->b >> 4);
 #endif
+	#undef U
 }
 
 #define UNPACK_X(p)	((p)->x)
@@ -97,20 +137,167 @@ static inline void dac_pack_point(packed_point_t *dest, dac_point_t *src) {
 #define UNPACK_U1(p)	(((p)->i12 >> 4) & 0xFFF0)
 #define UNPACK_U2(p)	(((p)->i12 >> 16) & 0xFFF0)
 
+/* Unpack a point stored by dac_pack_point(). Colors come back with their
+ * low four bits clear, and control with only its top four bits. */
+static inline void dac_unpack_point(dac_point_t *dest, const packed_point_t *src) {
+	dest->control = src->bf & 0xF000;
+	dest->x = UNPACK_X(src);
+	dest->y = UNPACK_Y(src);
+	dest->r = UNPACK_R(src);
+	dest->g = UNPACK_G(src);
+	dest->b = UNPACK_B(src);
+	dest->i = UNPACK_I(src);
+	dest->u1 = UNPACK_U1(src);
+	dest->u2 = UNPACK_U2(src);
+}
+
+/* Pre-encoded point: the six SPI words for the DAC backend (see
+ * dac_driver.h), in the order the FIQ writes them - I, R, G, B, X, Y.
+ * X and Y have already been through the geometric corrector.
+ */
+typedef struct encoded_point_t {
+	uint16_t word[6];
+	uint16_t control;
+	uint16_t pad;
+} __attribute__((aligned(16))) encoded_point_t;
+
+#define ENC_I	0
+#define ENC_R	1
+#define ENC_G	2
+#define ENC_B	3
+#define ENC_X	4
+#define ENC_Y	5
+
+#define DAC_MASK_XY(v)	((((v) >> 4) + 0x800) & 0xFFF)
+
+/* Encode a point into the backend's SPI words
+ *
+ * This does everything the FIQ would otherwise do per point: transform,
+ * scale down to DAC resolution, and add the channel/command bits.
+ * The transform is the one last taken by transform_latch(). Producers
+ * with more than a few points at once should use dac_store_points(),
+ * which transforms them as a batch.
+ */
+static inline void dac_encode_color(encoded_point_t *dest, dac_point_t *src) {
+	dest->word[ENC_I] = DAC_WORD_I((uint32_t)src->i);
+	dest->word[ENC_R] = DAC_WORD_R((uint32_t)src->r);
+	dest->word[ENC_G] = DAC_WORD_G((uint32_t)src->g);
+	dest->word[ENC_B] = DAC_WORD_B((uint32_t)src->b);
+	dest->control = src->control;
+}
+
+static inline void dac_encode_point(encoded_point_t *dest, dac_point_t *src) {
+	int32_t x = transform_clamp(translate(transform_encode_matrix, src->x, src->y));
+	int32_t y = transform_clamp(translate(transform_encode_matrix + 4, src->x, src->y));
+
+	dac_encode_color(dest, src);
+	dest->word[ENC_X] = DAC_WORD_X(x);
+	dest->word[ENC_Y] = DAC_WORD_Y(y);
+}
+
+#if DAC_BUFFER_ENCODED
+typedef encoded_point_t dac_buffer_point_t;
+#define DAC_BUFFER_CONTROL(p)	((p)->control)
+#else
+typedef packed_point_t dac_buffer_point_t;
+#define DAC_BUFFER_CONTROL(p)	((p)->bf & 0xF000)
+#endif
+
+/* Color delay lines: a short history of each color channel, and how many
+ * points back each channel is tapped. Index 0 is red, 1 green, 2 blue. */
+#define DAC_MAX_COLOR_DELAY	16
+
+struct delay_lines {
+	uint16_t history[3][DAC_MAX_COLOR_DELAY];
+	uint8_t produce;
+	uint8_t delay[3];
+};
+
+extern struct delay_lines delay_lines;
+
+static inline void delay_line_apply(dac_point_t *p) {
+	int produce = delay_lines.produce;
+	const int mask = DAC_MAX_COLOR_DELAY - 1;
+
+	delay_lines.history[0][produce] = p->r;
+	delay_lines.history[1][produce] = p->g;
+	delay_lines.history[2][produce] = p->b;
+	p->r = delay_lines.history[0][(produce - delay_lines.delay[0]) & mask];
+	p->g = delay_lines.history[1][(produce - delay_lines.delay[1]) & mask];
+	p->b = delay_lines.history[2][(produce - delay_lines.delay[2]) & mask];
+
+	delay_lines.produce = (produce + 1) & mask;
+}
+
+/* Store a point into the DAC buffer, in whichever format it holds, with
+ * the mesh warp and color delays applied. */
+static inline void dac_store_point(dac_buffer_point_t *dest, dac_point_t *src) {
+	dac_point_t p = *src;
+	if (mesh_active)
+		mesh_warp(&p.x, &p.y);
+	delay_line_apply(&p);
+#if DAC_BUFFER_ENCODED
+	dac_encode_point(dest, &p);
+#else
+	dac_pack_point(dest, &p);
+#endif
+}
+
+/* Underflow policy and statistics, shared with the FIQ. Starvation is
+ * counted in point periods: count is the number of times the ring ran
+ * dry, starved the total number of periods with nothing to play, current
+ * the length of the ongoing episode, and longest the longest episode.
+ * park holds the encoded X/Y words for the park position.
+ */
+typedef struct dac_underflow {
+	uint32_t policy;
+	uint32_t count;
+	uint32_t starved;
+	uint32_t current;
+	uint32_t longest;
+	uint16_t park[2];
+} dac_underflow_t;
+
+extern volatile dac_underflow_t dac_underflow;
+extern uint32_t dac_ldac_mask;
+
+void dac_store_points(dac_buffer_point_t *dest, dac_point_t *src, int n);
+
 void dac_init(void);
 
 int dac_prepare(void);
 int dac_start(void);
 int dac_request(void);
-packed_point_t *dac_request_addr(void);
+dac_buffer_point_t *dac_request_addr(void);
 void dac_advance(int count);
 void dac_stop(int flags);
 enum dac_state dac_get_state(void);
 int dac_fullness(void);
 int dac_set_rate(int points_per_second);
 int dac_rate_queue(int points_per_second);
+int dac_rate_pending(void);
+int dac_rate_pop(void);
 uint32_t dac_get_count();
 void shutter_set(int state);
+int dac_set_engine(enum dac_engine engine);
+enum dac_engine dac_get_engine(void);
+
+/* Consumer side of the point buffer, for output engines that drain it
+ * outside of the FIQ. */
+int dac_consume_request(dac_buffer_point_t **addr);
+void dac_consume_advance(int count);
+void dac_count_points(int count);
+int dac_consume_available(void);
+void dac_stop_underflow(void);
+int dac_set_frame_mode(int enable);
+int dac_set_buffer_size(int points);
+int dac_get_buffer_size(void);
+int dac_set_latency(int low_ms, int high_ms);
+int dac_latency_low_points(void);
+int dac_set_underflow_policy(int policy);
+void dac_set_park(int32_t x, int32_t y);
+void dac_underflow_reset(void);
+int dac_set_latched(int enable);
 
 void delay_line_set_delay(int color_index, int delay);
 int delay_line_get_delay(int color_index);
@@ -120,7 +307,10 @@ void color_corr_set_offset(int color_index, int32_t offset);
 void color_corr_set_gain(int color_index, int32_t gain);
 
 extern int dac_current_pps;
+extern int dac_nominal_pps;
 extern int dac_flags;
+extern enum dac_engine dac_engine;
+extern int dac_frame_mode;
 
 extern uint32_t dac_cycle_count;
 
@@ -18,10 +18,43 @@
 #ifndef FILE_PLAYER_H
 #define FILE_PLAYER_H
 
+#include <stdint.h>
+
+typedef struct fplay_stats {
+	uint32_t frames;	/* Frame headers read */
+	uint32_t loads;		/* Chunks read from the card */
+	uint32_t prefetches;	/* Of those, read while the ring was full */
+	uint32_t rewinds;	/* Seeks served from a loaded chunk */
+	uint64_t bytes;
+	uint32_t dropped;	/* Frames skipped to keep to the timeline */
+	int32_t drift_us;	/* How late the last frame started */
+	int32_t drift_max_us;	/* The latest any frame has started */
+} fplay_stats_t;
+
+extern fplay_stats_t fplay_stats;
+
 int fplay_open(const char *fname);
+void fplay_prefetch(void);
 
 void ilda_set_fps_limit(int max_fps);
 
+void fplay_set_rate(int pps);
+void fplay_set_output_rate(int pps);
+void fplay_set_resample_mode(int mode);
+
+int fplay_seek_frame(int n);
+int fplay_seek_time(unsigned int ms);
+void fplay_set_reverse(int reverse);
+void fplay_set_preload(int preload);
+int fplay_preload_progress(void);
+void fplay_sched_reset(void);
+void fplay_sched_start(void);
+
 extern int ilda_current_fps;
+extern int fplay_source_pps;
+extern int fplay_output_pps;
+extern int fplay_frames;
+extern int fplay_frame;
+extern uint32_t fplay_preload_bytes;
 
 #endif
@@ -26,6 +26,7 @@ enum playback_source {
 
 extern enum playback_source playback_src;
 extern int playback_source_flags;
+extern int playback_prefill;
 
 int playback_set_src(enum playback_source new_src);
 
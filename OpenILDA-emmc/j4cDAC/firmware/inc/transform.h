@@ -15,7 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef TRANSFORM_MAX
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
 
 #define COORD_MAX_EXP	15
 #define COORD_MAX	(1 << COORD_MAX_EXP)
@@ -45,12 +46,71 @@ typedef int32_t transform[4];
 void update_transform(void);
 
 extern int32_t transform_matrix[8];
+extern int32_t transform_encode_matrix[8];
+
+void transform_latch(void);
 
 static inline int32_t ALWAYS_INLINE translate(int32_t *c, int x, int y) {
 	int32_t xy_scale = (x * y) >> COORD_MAX_EXP;
 	return ((c[0]*x + c[1]*y + c[2]*xy_scale) >> COORD_MAX_EXP) + c[3];
 }
 
+/* Clamp a transformed coordinate to the output range, rather than letting
+ * it wrap around to the far side of the field. */
+static inline int32_t ALWAYS_INLINE transform_clamp(int32_t v) {
+#ifdef __arm__
+	asm("ssat %0, #16, %1" : "=r" (v) : "r" (v));
+	return v;
+#else
+	return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+#endif
+}
+
+void transform_points(const int32_t *c, uint32_t *xy, int n, int stride);
+int transform_selftest(int sets);
+
+/* Mesh warp
+ *
+ * The input space is split into MESH_CELLS x MESH_CELLS cells, each
+ * 2^MESH_CELL_EXP units on a side. Within a cell, the displacement is
+ * bilinear in the offset (u, v) from the cell's bottom left corner:
+ *
+ * d = k0 + (k1*u + k2*v + k3*(u*v >> MESH_CELL_EXP)) >> MESH_CELL_EXP
+ *
+ * The k terms are worked out from the four surrounding nodes whenever a
+ * node moves, so a point costs one cell lookup and a multiply-add chain
+ * per axis. Displacements are limited to MESH_MAX_OFFSET so the chain
+ * can't overflow.
+ */
+#define MESH_CELLS		8
+#define MESH_CELL_EXP	13
+#define MESH_CELL_MASK	((1 << MESH_CELL_EXP) - 1)
+#define MESH_MAX_OFFSET	(COORD_MAX / 4)
+
+typedef struct mesh_cell {
+	int32_t x[4];
+	int32_t y[4];
+} mesh_cell_t;
+
+/* Mesh as last taken by transform_latch(), and whether it does anything */
+extern mesh_cell_t mesh_cells[MESH_CELLS][MESH_CELLS];
+extern int mesh_active;
+
+void update_mesh_node(int row, int col);
+void reset_mesh(void);
+
+static inline void ALWAYS_INLINE mesh_warp(int16_t *px, int16_t *py) {
+	uint32_t ux = *px + COORD_MAX, uy = *py + COORD_MAX;
+	const mesh_cell_t *m = &mesh_cells[uy >> MESH_CELL_EXP][ux >> MESH_CELL_EXP];
+	int32_t u = ux & MESH_CELL_MASK, v = uy & MESH_CELL_MASK;
+	int32_t uv = (u * v) >> MESH_CELL_EXP;
+
+	*px = transform_clamp(*px + m->x[0]
+		+ ((m->x[1] * u + m->x[2] * v + m->x[3] * uv) >> MESH_CELL_EXP));
+	*py = transform_clamp(*py + m->y[0]
+		+ ((m->y[1] * u + m->y[2] * v + m->y[3] * uv) >> MESH_CELL_EXP));
+}
+
 static inline int32_t ALWAYS_INLINE translate_x(int32_t x, int32_t y) {
         return translate(transform_matrix, x, y);
 }
@@ -16,6 +16,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <transform.h>
 #include <tables.h>
 #include <serial.h>
@@ -73,6 +74,26 @@
 
 int32_t transform_matrix[8];
 
+/* Transform used by dac_encode_point(). Points in an encoded DAC buffer
+ * have already been transformed, so rather than have a geometry change
+ * land halfway through whatever is in flight, producers pick up changes
+ * explicitly with transform_latch() at a point boundary of their choice.
+ */
+int32_t transform_encode_matrix[8];
+static int transform_pending;
+
+/* Mesh warp cells: mesh_cells_edit follows the settings, and is copied to
+ * mesh_cells by transform_latch(). */
+#if MESH_CELLS + 1 != GEOM_MESH_NODES
+#error "mesh cell count doesn't match GEOM_MESH_NODES"
+#endif
+
+mesh_cell_t mesh_cells[MESH_CELLS][MESH_CELLS];
+int mesh_active;
+static mesh_cell_t mesh_cells_edit[MESH_CELLS][MESH_CELLS];
+static int mesh_active_edit;
+static int mesh_pending;
+
 static void calculate_transform(int32_t *c, int32_t *coords) {
 	int tl = coords[CORNER_TL];
 	int tr = coords[CORNER_TR];
@@ -87,6 +108,7 @@ static void calculate_transform(int32_t *c, int32_t *coords) {
 void update_transform(void) {
 	calculate_transform(transform_matrix, settings.transform_x);
 	calculate_transform(transform_matrix + 4, settings.transform_y);
+	transform_pending = 1;
 
 /*
 	outputf("TL: %d %d\tTR: %d %d",
@@ -98,6 +120,291 @@ void update_transform(void) {
 */
 }
 
+static void mesh_calculate(int32_t *k, int16_t d[][GEOM_MESH_NODES],
+                           int row, int col) {
+	int32_t d00 = d[row][col];
+	int32_t d10 = d[row][col + 1];
+	int32_t d01 = d[row + 1][col];
+	int32_t d11 = d[row + 1][col + 1];
+	k[0] = d00;
+	k[1] = d10 - d00;
+	k[2] = d01 - d00;
+	k[3] = d11 - d10 - d01 + d00;
+}
+
+/* update_mesh_node
+ *
+ * Recalculate the (up to four) cells around a node after it has moved in
+ * settings.mesh_x/mesh_y.
+ */
+void update_mesh_node(int row, int col) {
+	int r, c, i;
+
+	for (r = row - 1; r <= row; r++) {
+		for (c = col - 1; c <= col; c++) {
+			if (r < 0 || c < 0 || r >= MESH_CELLS || c >= MESH_CELLS)
+				continue;
+			mesh_calculate(mesh_cells_edit[r][c].x, settings.mesh_x, r, c);
+			mesh_calculate(mesh_cells_edit[r][c].y, settings.mesh_y, r, c);
+		}
+	}
+
+	const int16_t *mx = &settings.mesh_x[0][0];
+	const int16_t *my = &settings.mesh_y[0][0];
+
+	mesh_active_edit = 0;
+	for (i = 0; i < GEOM_MESH_NODES * GEOM_MESH_NODES; i++) {
+		if (mx[i] || my[i]) {
+			mesh_active_edit = 1;
+			break;
+		}
+	}
+
+	mesh_pending = 1;
+}
+
+/* reset_mesh
+ *
+ * Put every mesh node back at zero displacement.
+ */
+void reset_mesh(void) {
+	memset(settings.mesh_x, 0, sizeof(settings.mesh_x));
+	memset(settings.mesh_y, 0, sizeof(settings.mesh_y));
+	memset(mesh_cells_edit, 0, sizeof(mesh_cells_edit));
+	mesh_active_edit = 0;
+	mesh_pending = 1;
+}
+
+/* transform_latch
+ *
+ * Make the most recent geometry change take effect for points encoded
+ * from now on. Mesh changes are picked up here too, for points stored
+ * from now on in either buffer format.
+ */
+void transform_latch(void) {
+	if (transform_pending) {
+		memcpy(transform_encode_matrix, transform_matrix, sizeof(transform_matrix));
+		transform_pending = 0;
+	}
+
+	if (mesh_pending) {
+		memcpy(mesh_cells, mesh_cells_edit, sizeof(mesh_cells));
+		mesh_active = mesh_active_edit;
+		mesh_pending = 0;
+	}
+}
+
+/* ARMv6 dual 16-bit multiplies
+ *
+ * Each takes x in the low half and y in the high half of a word, as
+ * points are stored. Other builds get exact C models, so that the
+ * transform_points() kernel runs (and is tested) on the host too. Sums
+ * wrap modulo 2^32, as they do in translate() on the target.
+ */
+#if defined(__ARM_ARCH_6ZK__) || defined(__ARM_FEATURE_SIMD32)
+static inline uint32_t ALWAYS_INLINE dsp_pkhbt(int32_t lo, int32_t hi) {
+	uint32_t r;
+	asm("pkhbt %0, %1, %2, lsl #16" : "=r" (r) : "r" (lo), "r" (hi));
+	return r;
+}
+
+static inline int32_t ALWAYS_INLINE dsp_smulbt(uint32_t a, uint32_t b) {
+	int32_t r;
+	asm("smulbt %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+static inline uint32_t ALWAYS_INLINE dsp_smuad(uint32_t a, uint32_t b) {
+	uint32_t r;
+	asm("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+static inline uint32_t ALWAYS_INLINE dsp_smlad(uint32_t a, uint32_t b, uint32_t acc) {
+	uint32_t r;
+	asm("smlad %0, %1, %2, %3" : "=r" (r) : "r" (a), "r" (b), "r" (acc));
+	return r;
+}
+#else
+static inline uint32_t ALWAYS_INLINE dsp_pkhbt(int32_t lo, int32_t hi) {
+	return ((uint32_t)lo & 0xFFFF) | ((uint32_t)hi << 16);
+}
+
+static inline int32_t ALWAYS_INLINE dsp_smulbt(uint32_t a, uint32_t b) {
+	return (int16_t)a * (int16_t)(b >> 16);
+}
+
+static inline uint32_t ALWAYS_INLINE dsp_smlad(uint32_t a, uint32_t b, uint32_t acc) {
+	return acc + (uint32_t)((int16_t)a * (int16_t)b)
+		+ (uint32_t)((int16_t)(a >> 16) * (int16_t)(b >> 16));
+}
+
+static inline uint32_t ALWAYS_INLINE dsp_smuad(uint32_t a, uint32_t b) {
+	return dsp_smlad(a, b, 0);
+}
+#endif
+
+/* Cleared by transform_selftest() at startup if the fast kernel ever
+ * disagrees with translate(). */
+static int transform_fast = 1;
+
+/* transform_split
+ *
+ * Split a coefficient into a 16-bit lane for the dual multiplies and a
+ * multiple k of COORD_MAX, c = lane + k * COORD_MAX with k in -1..1. Any
+ * calibration within twice full scale fits, the identity included.
+ * Returns 0 if c doesn't.
+ */
+static int transform_split(int32_t c, int32_t *lane, int32_t *k) {
+	if (c < -2 * COORD_MAX || c >= 2 * COORD_MAX)
+		return 0;
+
+	*k = c >= COORD_MAX ? 1 : c < -COORD_MAX ? -1 : 0;
+	*lane = c - *k * COORD_MAX;
+	return 1;
+}
+
+/* transform_points_dsp
+ *
+ * transform_points() with the x and y terms done as dual 16-bit
+ * multiplies on the packed point:
+ *
+ * c0*x + c1*y = smuad(xy, lanes) + (smuad(xy, ks) << COORD_MAX_EXP)
+ *
+ * Everything is summed modulo 2^32, so this matches translate() bit for
+ * bit. Returns -1, having done nothing, if a coefficient doesn't split.
+ */
+static int transform_points_dsp(const int32_t *c, uint32_t *xy, int n, int stride) {
+	int32_t l0, l1, l4, l5, k0, k1, k4, k5;
+	uint32_t cx, cy, kx, ky;
+	uint32_t c2 = c[2], c6 = c[6];
+	int32_t c3 = c[3], c7 = c[7];
+	int i;
+
+	if (!transform_split(c[0], &l0, &k0) || !transform_split(c[1], &l1, &k1)
+	    || !transform_split(c[4], &l4, &k4) || !transform_split(c[5], &l5, &k5))
+		return -1;
+
+	cx = dsp_pkhbt(l0, l1);
+	cy = dsp_pkhbt(l4, l5);
+	kx = dsp_pkhbt(k0, k1);
+	ky = dsp_pkhbt(k4, k5);
+
+	for (i = 0; i < n; i++, xy += stride) {
+		uint32_t v = *xy;
+		uint32_t xys = dsp_smulbt(v, v) >> COORD_MAX_EXP;
+		uint32_t x = dsp_smlad(v, cx, (dsp_smuad(v, kx) << COORD_MAX_EXP) + c2 * xys);
+		uint32_t y = dsp_smlad(v, cy, (dsp_smuad(v, ky) << COORD_MAX_EXP) + c6 * xys);
+
+		*xy = dsp_pkhbt(transform_clamp(((int32_t)x >> COORD_MAX_EXP) + c3),
+			transform_clamp(((int32_t)y >> COORD_MAX_EXP) + c7));
+	}
+
+	return 0;
+}
+
+/* transform_points
+ *
+ * Run n points through the transform c, in place. Each point is a word
+ * with x in the low half and y in the high half; consecutive points are
+ * stride words apart. Results are clamped with transform_clamp(), and
+ * otherwise match translate() exactly.
+ *
+ * This is how dac_store_points() transforms points for a DAC_BUFFER_ENCODED
+ * ring; with packed points, the FIQ calls translate() itself.
+ */
+void transform_points(const int32_t *c, uint32_t *xy, int n, int stride) {
+	int i;
+
+	if (transform_fast && !transform_points_dsp(c, xy, n, stride))
+		return;
+
+	for (i = 0; i < n; i++, xy += stride) {
+		int32_t x = (int16_t)*xy, y = (int16_t)(*xy >> 16);
+		int32_t tx = transform_clamp(translate((int32_t *)c, x, y));
+		int32_t ty = transform_clamp(translate((int32_t *)c + 4, x, y));
+		*xy = (uint16_t)tx | ((uint32_t)ty << 16);
+	}
+}
+
+#define TRANSFORM_TEST_POINTS	32
+#define TRANSFORM_SELFTEST_SETS	16
+
+static uint32_t transform_rand(uint32_t *seed) {
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+static int32_t transform_rand_coef(uint32_t *seed) {
+	static const int32_t edges[] = {
+		COORD_MAX, COORD_MAX - 1, -COORD_MAX, -COORD_MAX - 1, 0,
+		2 * COORD_MAX - 1, -2 * COORD_MAX,
+	};
+	uint32_t r = transform_rand(seed);
+
+	if (r & 1)
+		return edges[(r >> 1) % (sizeof(edges) / sizeof(edges[0]))];
+	return (int32_t)(r >> 1) % (2 * COORD_MAX) * ((r & 2) ? 1 : -1);
+}
+
+/* translate() is only defined where its sum fits in 32 bits. */
+static int transform_defined(const int32_t *c, int32_t x, int32_t y) {
+	int64_t sum = (int64_t)c[0] * x + (int64_t)c[1] * y
+		+ (int64_t)c[2] * ((x * y) >> COORD_MAX_EXP);
+	return sum == (int32_t)sum;
+}
+
+/* transform_selftest
+ *
+ * Check the fast transform_points() kernel against translate(), with the
+ * given number of random coefficient sets and a batch of random points
+ * for each. The sets include the edges of the coefficient split, and
+ * offsets that drive the results into the clamp; the points include the
+ * corners of the field. Points for which translate() itself would
+ * overflow are skipped. Returns the number of mismatches.
+ */
+int transform_selftest(int sets) {
+	uint32_t seed = 0x5EED;
+	uint32_t in[TRANSFORM_TEST_POINTS], out[TRANSFORM_TEST_POINTS];
+	int32_t c[8];
+	int set, i, bad = 0;
+
+	for (set = 0; set < sets; set++) {
+		c[0] = transform_rand_coef(&seed);
+		c[1] = transform_rand_coef(&seed);
+		c[4] = transform_rand_coef(&seed);
+		c[5] = transform_rand_coef(&seed);
+		c[2] = (int32_t)(transform_rand(&seed) % 16384) - 8192;
+		c[6] = (int32_t)(transform_rand(&seed) % 16384) - 8192;
+		c[3] = (int32_t)(transform_rand(&seed) % 98304) - 49152;
+		c[7] = (int32_t)(transform_rand(&seed) % 98304) - 49152;
+
+		for (i = 0; i < TRANSFORM_TEST_POINTS; i++) {
+			if (i < 4)
+				in[i] = (i & 1 ? 0x7FFF : 0x8000) | (i & 2 ? 0x7FFF0000 : 0x80000000);
+			else
+				in[i] = transform_rand(&seed) ^ (transform_rand(&seed) << 16);
+			out[i] = in[i];
+		}
+
+		if (transform_points_dsp(c, out, TRANSFORM_TEST_POINTS, 1) < 0)
+			return -1;
+
+		for (i = 0; i < TRANSFORM_TEST_POINTS; i++) {
+			int32_t x = (int16_t)in[i], y = (int16_t)(in[i] >> 16);
+
+			if (transform_defined(c, x, y)
+			    && (int16_t)out[i] != transform_clamp(translate(c, x, y)))
+				bad++;
+			if (transform_defined(c + 4, x, y)
+			    && (int16_t)(out[i] >> 16) != transform_clamp(translate(c + 4, x, y)))
+				bad++;
+		}
+	}
+
+	return bad;
+}
+
 void init_transform(void) {
 	/* XXX Fix this to load transform from i2c EEPROM */
 	settings.transform_x[CORNER_TL] = -COORD_MAX;
@@ -109,6 +416,13 @@ void init_transform(void) {
 	settings.transform_y[CORNER_BL] = -COORD_MAX;
 	settings.transform_y[CORNER_BR] = -COORD_MAX;
 	update_transform();
+	reset_mesh();
+	transform_latch();
+
+	if (transform_selftest(TRANSFORM_SELFTEST_SETS)) {
+		outputf("transform: fast path disagrees with translate(), disabled");
+		transform_fast = 0;
+	}
 }
 
 INITIALIZER(hardware, init_transform)
@@ -158,6 +158,59 @@ static void geom_set_offset(const char *path, int32_t offset_x, int32_t offset_y
 	geom_set_sz_offset();
 }
 
+/* geom_mesh_readout
+ *
+ * Send the displacement of every mesh node that has one, as
+ * (node, offset) pairs, where node is row * GEOM_MESH_NODES + column.
+ */
+static void geom_mesh_readout(const char *path) {
+	int row, col;
+	for (row = 0; row < GEOM_MESH_NODES; row++) {
+		for (col = 0; col < GEOM_MESH_NODES; col++) {
+			int dx = settings.mesh_x[row][col];
+			int dy = settings.mesh_y[row][col];
+			if (!dx && !dy)
+				continue;
+			osc_send_int2("/geom/mesh/x", row * GEOM_MESH_NODES + col, dx);
+			osc_send_int2("/geom/mesh/y", row * GEOM_MESH_NODES + col, dy);
+		}
+	}
+}
+
+/* geom_mesh_set_node
+ *
+ * Move one mesh node: node, X displacement, Y displacement, where node is
+ * row * GEOM_MESH_NODES + column as in the /geom/mesh readout. Three
+ * arguments is also all an autoplay line can carry. Displacements are in
+ * DAC coordinates.
+ */
+static void geom_mesh_set_node(const char *path, int32_t *p, int n) {
+	if (n != 3) {
+		outputf("geom: %s takes node, dx, dy", path);
+		return;
+	}
+
+	if (p[0] < 0 || p[0] >= GEOM_MESH_NODES * GEOM_MESH_NODES) {
+		outputf("geom: no mesh node %d", p[0]);
+		return;
+	}
+
+	int row = p[0] / GEOM_MESH_NODES, col = p[0] % GEOM_MESH_NODES;
+	int32_t dx = p[1], dy = p[2];
+	if (dx > MESH_MAX_OFFSET) dx = MESH_MAX_OFFSET;
+	if (dx < -MESH_MAX_OFFSET) dx = -MESH_MAX_OFFSET;
+	if (dy > MESH_MAX_OFFSET) dy = MESH_MAX_OFFSET;
+	if (dy < -MESH_MAX_OFFSET) dy = -MESH_MAX_OFFSET;
+
+	settings.mesh_x[row][col] = dx;
+	settings.mesh_y[row][col] = dy;
+	update_mesh_node(row, col);
+}
+
+static void geom_mesh_reset(const char *path) {
+	reset_mesh();
+}
+
 static void geom_set_rdelay(const char *path, int32_t delay) {
 	delay_line_set_delay(0, delay);
 }
@@ -192,6 +245,9 @@ TABLE_ITEMS(param_handler, correction_param_updaters,
 	{ "/geom/bl", PARAM_TYPE_I2, { .f2 = geom_update }, PARAM_MODE_FIXED, FIXED(-1), FIXED(1) },
 	{ "/geom/br", PARAM_TYPE_I2, { .f2 = geom_update }, PARAM_MODE_FIXED, FIXED(-1), FIXED(1) },
 	{ "/geom", PARAM_TYPE_0, { .f0 = geom_readout } },
+	{ "/geom/mesh", PARAM_TYPE_0, { .f0 = geom_mesh_readout } },
+	{ "/geom/mesh/node", PARAM_TYPE_IN, { .fi = geom_mesh_set_node }, PARAM_MODE_INT },
+	{ "/geom/mesh/reset", PARAM_TYPE_0, { .f0 = geom_mesh_reset } },
 	{ "/geom/locktop", PARAM_TYPE_I1, { .f1 = geom_update_lock } },
 	{ "/geom/lockbottom", PARAM_TYPE_I1, { .f1 = geom_update_lock } },
 	{ "/geom/lockleft", PARAM_TYPE_I1, { .f1 = geom_update_lock } },
@@ -0,0 +1,177 @@
+#include <serial.h>
+#include <tables.h>
+#include <osc.h>
+#include <dac.h>
+#include <dac_clock.h>
+#include <dac_instrument.h>
+#include <dac_calibrate.h>
+#include <dac_optimize.h>
+
+/* dac_readout
+ *
+ * Send the current DAC output settings to the controller.
+ */
+static void dac_readout(const char *path) {
+	osc_send_int("/dac/engine", dac_get_engine());
+	osc_send_int("/dac/buffer", dac_get_buffer_size());
+	osc_send_int("/dac/latch", dac_ldac_mask != 0);
+}
+
+/* dac_rate_readout
+ *
+ * Send requested and measured point rates, and the accumulated drift
+ * since the DAC started playing.
+ */
+static void dac_rate_readout(const char *path) {
+	dac_rate_stats_t stats;
+	dac_clock_get_stats(&stats);
+
+	osc_send_int("/dac/rate/requested", stats.requested_pps);
+	osc_send_int("/dac/rate/measured", stats.measured_mpps / 1000);
+	osc_send_int("/dac/rate/drift", stats.drift_points);
+	osc_send_int("/dac/rate/ppm", stats.drift_ppm);
+	osc_send_int("/dac/rate/elapsed", stats.elapsed_s);
+	osc_send_int("/dac/rate/max", dac_max_rate);
+}
+
+/* dac_calibrate_readout
+ *
+ * Send the SPI divider and point time found by the last calibration.
+ */
+static void dac_calibrate_readout(void) {
+	osc_send_int("/dac/calibrate/spidiv", dac_spi_divider);
+	osc_send_int("/dac/calibrate/pointns", dac_point_ns);
+	osc_send_int("/dac/rate/max", dac_max_rate);
+}
+
+static void dac_calibrate_FPV_param(const char *path) {
+	if (dac_calibrate() < 0)
+		outputf("dac: calibration rejected");
+	dac_calibrate_readout();
+}
+
+static void dac_set_engine_FPV_param(const char *path, int32_t v) {
+	if (dac_set_engine(v) < 0)
+		outputf("dac: engine %d rejected", v);
+	osc_send_int("/dac/engine", dac_get_engine());
+}
+
+static void dac_set_buffer_FPV_param(const char *path, int32_t v) {
+	dac_set_buffer_size(v);
+	osc_send_int("/dac/buffer", dac_get_buffer_size());
+}
+
+static void dac_set_latency_FPV_param(const char *path, int32_t low, int32_t high) {
+	if (dac_set_latency(low, high) < 0)
+		outputf("dac: latency %d-%d ms rejected", low, high);
+}
+
+static void dac_set_latched_FPV_param(const char *path, int32_t v) {
+	dac_set_latched(v);
+	osc_send_int("/dac/latch", dac_ldac_mask != 0);
+}
+
+static void dac_set_frame_mode_FPV_param(const char *path, int32_t v) {
+	dac_set_frame_mode(v);
+	osc_send_int("/dac/framemode", dac_frame_mode);
+}
+
+/* dac_optimize_readout
+ *
+ * Send the optimizer's settings and statistics: the average rate it has
+ * chosen, per window, and how many rate changes it has queued.
+ */
+static void dac_optimize_readout(const char *path) {
+	osc_send_int("/dac/optimize", dac_opt.enabled);
+	osc_send_int2("/dac/optimize/model", dac_opt.vmax, dac_opt.amax);
+	osc_send_int("/dac/optimize/changes", dac_opt.changes);
+	osc_send_int("/dac/optimize/avgrate", dac_opt.windows
+		? dac_opt.rate_sum / dac_opt.windows : 0);
+}
+
+static void dac_set_optimize_FPV_param(const char *path, int32_t v) {
+	dac_opt_set_enabled(v);
+	osc_send_int("/dac/optimize", dac_opt.enabled);
+}
+
+static void dac_set_optimize_model_FPV_param(const char *path, int32_t vmax, int32_t amax) {
+	dac_opt_set_model(vmax, amax);
+	osc_send_int2("/dac/optimize/model", dac_opt.vmax, dac_opt.amax);
+}
+
+/* dac_underflow_readout
+ *
+ * Send the underflow policy and starvation statistics.
+ */
+static void dac_underflow_readout(const char *path) {
+	osc_send_int("/dac/underflow/policy", dac_underflow.policy);
+	osc_send_int("/dac/underflow/count", dac_underflow.count);
+	osc_send_int("/dac/underflow/starved", dac_underflow.starved);
+	osc_send_int("/dac/underflow/longest", dac_underflow.longest);
+}
+
+static void dac_underflow_reset_FPV_param(const char *path) {
+	dac_underflow_reset();
+}
+
+static void dac_set_underflow_policy_FPV_param(const char *path, int32_t v) {
+	dac_set_underflow_policy(v);
+	osc_send_int("/dac/underflow/policy", dac_underflow.policy);
+}
+
+static void dac_set_park_FPV_param(const char *path, int32_t x, int32_t y) {
+	dac_set_park(x, y);
+}
+
+/* dac_fiq_readout
+ *
+ * Send the FIQ timing statistics. Histogram bins are sent as (bin, count)
+ * pairs, skipping empty bins.
+ */
+static void dac_fiq_readout(const char *path) {
+	int i;
+
+	osc_send_int("/dac/fiq/count", dac_fiq_stats.count);
+	osc_send_int("/dac/fiq/maxduration", dac_fiq_stats.max_duration);
+	osc_send_int("/dac/fiq/maxlateness", dac_fiq_stats.max_lateness);
+	osc_send_int("/dac/fiq/missed", dac_fiq_stats.missed);
+	osc_send_int("/dac/fiq/slips", dac_st_clock.slips);
+
+	for (i = 0; i < DAC_FIQ_HIST_BINS; i++) {
+		if (dac_fiq_stats.duration_hist[i])
+			osc_send_int2("/dac/fiq/duration", i, dac_fiq_stats.duration_hist[i]);
+	}
+	for (i = 0; i < DAC_FIQ_HIST_BINS; i++) {
+		if (dac_fiq_stats.lateness_hist[i])
+			osc_send_int2("/dac/fiq/lateness", i, dac_fiq_stats.lateness_hist[i]);
+	}
+}
+
+static void dac_fiq_reset(const char *path) {
+	dac_fiq_stats_reset();
+}
+
+static void dac_fiq_print(const char *path) {
+	dac_fiq_stats_print();
+}
+
+TABLE_ITEMS(param_handler, dac_param_updaters,
+	{ "/dac", PARAM_TYPE_0, { .f0 = dac_readout } },
+	{ "/dac/rate", PARAM_TYPE_0, { .f0 = dac_rate_readout } },
+	{ "/dac/calibrate", PARAM_TYPE_0, { .f0 = dac_calibrate_FPV_param } },
+	{ "/dac/fiq", PARAM_TYPE_0, { .f0 = dac_fiq_readout } },
+	{ "/dac/fiq/reset", PARAM_TYPE_0, { .f0 = dac_fiq_reset } },
+	{ "/dac/fiq/print", PARAM_TYPE_0, { .f0 = dac_fiq_print } },
+	{ "/dac/engine", PARAM_TYPE_I1, { .f1 = dac_set_engine_FPV_param }, PARAM_MODE_INT, 0, 1 },
+	{ "/dac/underflow", PARAM_TYPE_0, { .f0 = dac_underflow_readout } },
+	{ "/dac/underflow/reset", PARAM_TYPE_0, { .f0 = dac_underflow_reset_FPV_param } },
+	{ "/dac/underflow/policy", PARAM_TYPE_I1, { .f1 = dac_set_underflow_policy_FPV_param }, PARAM_MODE_INT, 0, 2 },
+	{ "/dac/underflow/park", PARAM_TYPE_I2, { .f2 = dac_set_park_FPV_param }, PARAM_MODE_INT, -32768, 32767 },
+	{ "/dac/buffer", PARAM_TYPE_I1, { .f1 = dac_set_buffer_FPV_param }, PARAM_MODE_INT, DAC_BUFFER_MIN_POINTS, DAC_BUFFER_MAX_POINTS },
+	{ "/dac/latency", PARAM_TYPE_I2, { .f2 = dac_set_latency_FPV_param }, PARAM_MODE_INT, 0, 10000 },
+	{ "/dac/framemode", PARAM_TYPE_I1, { .f1 = dac_set_frame_mode_FPV_param }, PARAM_MODE_INT, 0, 1 },
+	{ "/dac/latch", PARAM_TYPE_I1, { .f1 = dac_set_latched_FPV_param }, PARAM_MODE_INT, 0, 1 },
+	{ "/dac/optimize", PARAM_TYPE_I1, { .f1 = dac_set_optimize_FPV_param }, PARAM_MODE_INT, 0, 1 },
+	{ "/dac/optimize/model", PARAM_TYPE_I2, { .f2 = dac_set_optimize_model_FPV_param }, PARAM_MODE_INT, 1, 0x7FFFFFFF },
+	{ "/dac/optimize/stats", PARAM_TYPE_0, { .f0 = dac_optimize_readout } },
+)
@@ -26,6 +26,7 @@
 #include <serial.h>
 #include <playback.h>
 #include <file_player.h>
+#include <frame_cache.h>
 
 static int walk_fs_request = 0;
 
@@ -79,8 +80,10 @@ static void walk_fs(int index) {
 			snprintf(path, sizeof(path), "/ilda/%d/name", i);
 			osc_send_string(path, fn);
 		} else if (index == i) {
-			fplay_open(fn);
-			playback_source_flags |= ILDA_PLAYER_PLAYING;
+			if (fplay_open(fn) == 0)
+				playback_source_flags |= ILDA_PLAYER_PLAYING;
+			else
+				playback_source_flags &= ~ILDA_PLAYER_PLAYING;
 			break;
 		}
 
@@ -93,17 +96,24 @@ static void walk_fs(int index) {
 static void NOINLINE refresh_readouts() {
 	char buf[16];
 
-	outputf("pps: %d, fps: %d", dac_current_pps, ilda_current_fps);
+	outputf("pps: %d, fps: %d", fplay_source_pps, ilda_current_fps);
 
-	osc_send_int("/ilda/pps", dac_current_pps);
+	osc_send_int("/ilda/pps", fplay_source_pps);
+	osc_send_int("/ilda/outpps", fplay_output_pps);
 	osc_send_int("/ilda/fps", ilda_current_fps);
 
-	snprintf(buf, sizeof(buf), "%dk", dac_current_pps / 1000);
+	snprintf(buf, sizeof(buf), "%dk", fplay_source_pps / 1000);
 	osc_send_string("/ilda/ppsreadout", buf);
 
 	snprintf(buf, sizeof(buf), "%d FPS", ilda_current_fps);
 	osc_send_string("/ilda/fpsreadout", buf);
 
+	osc_send_int("/ilda/prefill", playback_prefill);
+	osc_send_int("/ilda/frames", fplay_frames);
+	osc_send_int("/ilda/cache/hits", fcache_stats.hits);
+	osc_send_int("/ilda/cache/misses", fcache_stats.misses);
+	osc_send_int("/ilda/cache/frames", fcache_stats.frames);
+
 	osc_send_int("/ilda/repeat",
 		((playback_src == SRC_ILDAPLAYER)
 		 && (playback_source_flags & ILDA_PLAYER_REPEAT)));
@@ -118,7 +128,40 @@ static void ilda_reload_FPV_param(const char *path) {
 	walk_fs_request = -1;
 }
 
+static void ilda_preload_poll(void) {
+	static int last = -1;
+	int progress = fplay_preload_progress();
+
+	if (progress == last)
+		return;
+
+	last = progress;
+	osc_send_int("/ilda/preload/progress", progress);
+	osc_send_int("/ilda/preload/kib", fplay_preload_bytes >> 10);
+}
+
+/* ilda_sched_poll
+ *
+ * Report how late the show is running against its timeline, in ms, and
+ * how many frames have been dropped to keep to it, when either changes.
+ */
+static void ilda_sched_poll(void) {
+	static int32_t last_drift = -1;
+	static uint32_t last_dropped = -1;
+	int32_t drift = fplay_stats.drift_us / 1000;
+
+	if (drift == last_drift && fplay_stats.dropped == last_dropped)
+		return;
+
+	last_drift = drift;
+	last_dropped = fplay_stats.dropped;
+	osc_send_int("/ilda/drift", drift);
+	osc_send_int("/ilda/dropped", fplay_stats.dropped);
+}
+
 static void ilda_osc_poll(void) {
+	ilda_preload_poll();
+	ilda_sched_poll();
 	if (walk_fs_request == -1)
 		refresh_readouts();
 	if (walk_fs_request)
@@ -150,10 +193,18 @@ static void ilda_pps_FPV_param(const char *path, int32_t v) {
 	if (playback_src != SRC_ILDAPLAYER)
 		return;
 
-	dac_set_rate(v);
+	fplay_set_rate(v);
 	ilda_set_fps_limit(ilda_current_fps);
 }
 
+static void ilda_outpps_FPV_param(const char *path, int32_t v) {
+	fplay_set_output_rate(v);
+}
+
+static void ilda_resample_FPV_param(const char *path, int32_t v) {
+	fplay_set_resample_mode(v);
+}
+
 static void ilda_fps_FPV_param(const char *path, int32_t v) {
 	char buf[8];
 	snprintf(buf, sizeof(buf), "%ld FPS", v);
@@ -174,6 +225,24 @@ static void ilda_repeat_FPV_param(const char *path, int32_t v) {
 		playback_source_flags &= ~ILDA_PLAYER_REPEAT;
 }
 
+static void ilda_frame_FPV_param(const char *path, int32_t v) {
+	if (fplay_seek_frame(v) < 0)
+		outputf("no frame %ld", v);
+}
+
+static void ilda_seek_FPV_param(const char *path, int32_t v) {
+	if (fplay_seek_time(v) < 0)
+		outputf("can't seek");
+}
+
+static void ilda_reverse_FPV_param(const char *path, int32_t v) {
+	fplay_set_reverse(v);
+}
+
+static void ilda_preload_FPV_param(const char *path, int32_t v) {
+	fplay_set_preload(v);
+}
+
 static void ilda_stop_FPV_param(const char *path) {
 	playback_source_flags &= ~ILDA_PLAYER_PLAYING;
 	dac_stop(0);
@@ -191,8 +260,10 @@ static void ilda_play_fn_FPV_param(const char *path, const char *fn) {
 	if (fplay_open(fn) == 0) {
 		playback_source_flags |= ILDA_PLAYER_PLAYING;
 		outputf("ok");
-	} else
+	} else {
+		playback_source_flags &= ~ILDA_PLAYER_PLAYING;
 		outputf("failed");
+	}
 }
 
 TABLE_ITEMS(param_handler, ilda_osc_handlers,
@@ -208,8 +279,14 @@ TABLE_ITEMS(param_handler, ilda_osc_handlers,
 	{ "/ilda/10/play", PARAM_TYPE_0, { .f0 = ilda_play_FPV_param } },
 	{ "/ilda/reloadbutton", PARAM_TYPE_0, { .f0 = ilda_reload_FPV_param } },
 	{ "/ilda/pps", PARAM_TYPE_I1, { .f1 = ilda_pps_FPV_param }, PARAM_MODE_INT, 1000, 100000 },
+	{ "/ilda/outpps", PARAM_TYPE_I1, { .f1 = ilda_outpps_FPV_param }, PARAM_MODE_INT, 0, 200000 },
+	{ "/ilda/resample", PARAM_TYPE_I1, { .f1 = ilda_resample_FPV_param }, PARAM_MODE_INT, 1, 2 },
 	{ "/ilda/fps", PARAM_TYPE_I1, { .f1 = ilda_fps_FPV_param }, PARAM_MODE_INT, 0, 100 },
 	{ "/ilda/repeat", PARAM_TYPE_I1, { .f1 = ilda_repeat_FPV_param }, PARAM_MODE_INT },
+	{ "/ilda/frame", PARAM_TYPE_I1, { .f1 = ilda_frame_FPV_param }, PARAM_MODE_INT },
+	{ "/ilda/seek", PARAM_TYPE_I1, { .f1 = ilda_seek_FPV_param }, PARAM_MODE_INT },
+	{ "/ilda/reverse", PARAM_TYPE_I1, { .f1 = ilda_reverse_FPV_param }, PARAM_MODE_INT },
+	{ "/ilda/preload", PARAM_TYPE_I1, { .f1 = ilda_preload_FPV_param }, PARAM_MODE_INT },
 	{ "/ilda", PARAM_TYPE_0, { .f0 = ilda_tab_enter_FPV_param } },
 	{ "/stop", PARAM_TYPE_0, { .f0 = ilda_stop_FPV_param } },
 	{ "/ilda/play", PARAM_TYPE_S1, { .fs = ilda_play_fn_FPV_param } },